@@ -18,6 +18,9 @@
 
 #include "libs/base/check.h"
 #include "libs/base/gpio.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
+#include "libs/camera/camera_pipeline.h"
 #include "libs/pmic/pmic.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_csi.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_lpi2c.h"
@@ -31,15 +34,14 @@
 
 #include <cstring>
 #include <memory>
+#include <utility>
 
 namespace coralmicro {
 namespace {
 constexpr uint8_t kCameraAddress = 0x24;
-constexpr int kFramebufferCount = 4;
-constexpr float kRedCoefficient = .2126;
-constexpr float kGreenCoefficient = .7152;
-constexpr float kBlueCoefficient = .0722;
-constexpr float kUint8Max = 255.0;
+constexpr int kFramebufferCount = CameraTask::kFramebufferCount;
+// Trigger mode only captures into the first two framebuffers.
+constexpr int kTriggerFramebufferCount = 2;
 
 constexpr uint8_t kModelIdHExpected = 0x01;
 constexpr uint8_t kModelIdLExpected = 0xB0;
@@ -119,6 +121,17 @@ uint8_t* IndexToFramebufferPtr(int index) {
   return reinterpret_cast<uint8_t*>(framebuffers[index]);
 }
 
+// Auto white balance gains, carried from frame to frame. Frames are converted
+// on the callers' tasks and on the GetFrameAsync() worker, so every use holds
+// white_balance_mutex. A conversion holds it throughout, from reading the
+// gains to updating them; conversions only use the CPU, so running them one
+// at a time costs nothing on a single core.
+camera::WhiteBalance white_balance;
+SemaphoreHandle_t white_balance_mutex;
+// Scratch memory of the conversions, allocated once in Init() so that
+// converting frames doesn't allocate. Also guarded by white_balance_mutex.
+std::unique_ptr<camera::Workspace> workspace;
+
 int FramebufferPtrToIndex(const uint8_t* framebuffer_ptr) {
   for (int i = 0; i < kFramebufferCount; ++i) {
     if (reinterpret_cast<uint8_t*>(framebuffers[i]) == framebuffer_ptr) {
@@ -127,433 +140,193 @@ int FramebufferPtrToIndex(const uint8_t* framebuffer_ptr) {
   }
   return -1;
 }
+}  // namespace
 
-void ResizeNearestNeighbor(const uint8_t* src, int src_w, int src_h,
-                           uint8_t* dst, int dst_w, int dst_h, int comps,
-                           bool preserve_aspect) {
-  int src_p = src_w * comps;
-  int dst_p = dst_w * comps;
-  float ratio_src = (float)src_w / src_h;
-  float ratio_dst = (float)dst_w / dst_h;
-  int scaled_w =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? src_w * (float)dst_h / src_h : dst_w)
-          : dst_w;
-  int scaled_h =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? dst_h : src_h * (float)dst_w / src_w)
-          : dst_h;
-  float ratio_x = (float)src_w / scaled_w;
-  float ratio_y = (float)src_h / scaled_h;
-
-  for (int y = 0; y < dst_h; y++) {
-    if (y >= scaled_h) {
-      std::memset(dst, 0, dst_p);
-      dst += dst_p;
-      continue;
-    }
+extern "C" void CSI_DriverIRQHandler(void);
+extern "C" void CSI_IRQHandler(void) {
+  CSI_DriverIRQHandler();
+  __DSB();
+}
 
-    int offset_y = static_cast<int>(y * ratio_y) * src_p;
-    for (int x = 0; x < dst_w; x++) {
-      int offset_x = static_cast<int>(x * ratio_x) * comps;
-      const uint8_t* src_y = src + offset_y;
-      for (int i = 0; i < comps; i++) {
-        *dst++ = x < scaled_w ? src_y[offset_x + i] : 0;
-      }
-    }
+CameraFrameLease& CameraFrameLease::operator=(
+    CameraFrameLease&& other) noexcept {
+  if (this != &other) {
+    Release();
+    data_ = std::exchange(other.data_, nullptr);
+    index_ = std::exchange(other.index_, -1);
+    sequence_ = other.sequence_;
+    timestamp_us_ = other.timestamp_us_;
   }
+  return *this;
 }
 
-template <typename Callback>
-void BayerInternal(const uint8_t* camera_raw, int width, int height,
-                   CameraFilterMethod filter, Callback callback) {
-  if (filter == CameraFilterMethod::kNearestNeighbor) {
-    bool blue = true, green = false;
-    for (int y = 2; y < height - 2; y++) {
-      int start = green ? 3 : 2;
-      for (int x = start; x < width - 2; x += 2) {
-        int g1x = x + 1, g1y = y;
-        int g2x = x + 2, g2y = y + 1;
-        int r1x, r1y, r2x, r2y;
-        int b1x, b1y, b2x, b2y;
-        if (blue) {
-          r1x = r2x = x + 1;
-          r1y = r2y = y + 1;
-          b1x = x;
-          b1y = y;
-          b2x = x + 2;
-          b2y = y;
-        } else {
-          r1x = x;
-          r1y = y;
-          r2x = x + 2;
-          r2y = y;
-          b1x = b2x = x + 1;
-          b1y = b2y = y + 1;
-        }
-        uint8_t r1 = camera_raw[r1x + (r1y * width)];
-        uint8_t g1 = camera_raw[g1x + (g1y * width)];
-        uint8_t b1 = camera_raw[b1x + (b1y * width)];
-        uint8_t r2 = camera_raw[r2x + (r2y * width)];
-        uint8_t g2 = camera_raw[g2x + (g2y * width)];
-        uint8_t b2 = camera_raw[b2x + (b2y * width)];
-        callback(x, y, r1, g1, b1);
-        callback(x + 1, y, r2, g2, b2);
-      }
-      blue = !blue;
-      green = !green;
-    }
-  } else if (filter == CameraFilterMethod::kBilinear) {
-    int bayer_stride = width;
-
-    size_t bayer_offset = 0;
-    for (int y = 2; y < height - 2; y++) {
-      bool odd_row = y & 1;
-      int x = 1;
-      size_t bayer_end = bayer_offset + (width - 2);
-
-      if (odd_row) {
-        uint8_t r = (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-                     static_cast<uint32_t>(
-                         camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-                     1) >>
-                    1;
-        uint8_t b =
-            (static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride + 2)]) +
-             1) >>
-            1;
-        uint8_t g = camera_raw[bayer_offset + (bayer_stride + 1)];
-        callback(x, y, r, g, b);
-        bayer_offset += 1;
-        ++x;
-      }
+void CameraFrameLease::Release() {
+  if (index_ != -1) {
+    CameraTask::GetSingleton()->ReleaseFrame(index_);
+  }
+  data_ = nullptr;
+  index_ = -1;
+}
 
-      while (bayer_offset <= (bayer_end - 2)) {
-        uint8_t r1 = 0, g1 = 0, b1 = 0, r2 = 0, g2 = 0, b2 = 0;
-        uint8_t t0 = (static_cast<uint32_t>(camera_raw[bayer_offset]) +
-                      static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      2) >>
-                     2;
-        g1 = (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-              static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-              static_cast<uint32_t>(
-                  camera_raw[bayer_offset + (bayer_stride + 2)]) +
-              static_cast<uint32_t>(
-                  camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-              2) >>
-             2;
-        uint8_t t1 = (static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      1) >>
-                     1;
-        uint8_t t2 = (static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride + 1)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride + 3)]) +
-                      1) >>
-                     1;
-        uint8_t t3 = camera_raw[bayer_offset + (bayer_stride + 1)];
-        g2 = camera_raw[bayer_offset + (bayer_stride + 2)];
-        if (odd_row) {
-          r1 = t0;
-          b1 = t3;
-
-          r2 = t1;
-          b2 = t2;
-        } else {
-          b1 = t0;
-          r1 = t3;
-
-          b2 = t1;
-          r2 = t2;
-        }
-        callback(x, y, r1, g1, b1);
-        callback(x + 1, y, r2, g2, b2);
-        bayer_offset += 2;
-        x += 2;
-      }
+bool CameraTask::CheckFrameReady() {
+  if (!enabled_) {
+    printf("Camera is not enabled, cannot capture frame.\r\n");
+    return false;
+  }
+  if (mode_ == CameraMode::kTrigger && !GpioGet(Gpio::kCameraTrigger)) {
+    printf("Camera is in trigger mode but was never triggered\r\n");
+    return false;
+  }
+  return true;
+}
 
-      while (bayer_offset < bayer_end) {
-        uint8_t t0 = (static_cast<uint32_t>(camera_raw[bayer_offset]) +
-                      static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      2) >>
-                     2;
-        uint8_t g =
-            (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-             static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride + 2)]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-             2) >>
-            2;
-        uint8_t t1 = camera_raw[bayer_offset + bayer_stride + 1];
-        if (odd_row) {
-          callback(x, y, t0, g, t1);
-        } else {
-          callback(x, y, t1, g, t0);
+bool CameraTask::ProcessFrame(const uint8_t* raw,
+                              const std::vector<CameraFrameFormat>& fmts) {
+  bool ret = true;
+  // All RGB and Y8 formats are converted together so they can share the
+  // demosaicing work.
+  {
+    MutexLock lock(white_balance_mutex);
+    if (!camera::ConvertBayer(
+            raw, fmts,
+            test_pattern_ == CameraTestPattern::kNone ? &white_balance
+                                                      : nullptr,
+            workspace.get())) {
+      ret = false;
+    }
+  }
+  for (const CameraFrameFormat& fmt : fmts) {
+    switch (fmt.fmt) {
+      case CameraFormat::kRgb:
+      case CameraFormat::kY8:
+        break;
+      case CameraFormat::kRaw:
+        if (fmt.width != kWidth || fmt.height != kHeight || fmt.tensor) {
+          ret = false;
+          break;
         }
-        bayer_offset += 1;
-        ++x;
-      }
-
-      bayer_offset += 2;
+        std::memcpy(fmt.buffer, raw,
+                    kWidth * kHeight * CameraFormatBpp(CameraFormat::kRaw));
+        break;
+      default:
+        ret = false;
     }
   }
+  return ret;
 }
 
-void RotateXY(CameraRotation rotation, int in_x, int in_y, int* out_x,
-              int* out_y) {
-  CHECK(out_x);
-  CHECK(out_y);
-
-  // Short-circuit for no rotation
-  if (rotation == CameraRotation::k0) {
-    *out_x = in_x;
-    *out_y = in_y;
-    return;
+bool CameraTask::ProcessNextFrame(
+    const std::function<bool(const uint8_t* raw)>& process) {
+  if (!CheckFrameReady()) {
+    return false;
   }
 
-  // Shift our coordinates so that the center of the image is 0,0
-  in_x = in_x - (CameraTask::kWidth / 2);
-  in_y = in_y - (CameraTask::kHeight / 2);
-
-  // Simple rotation around origin
-  switch (rotation) {
-    case CameraRotation::k90:
-      *out_x = -in_y;
-      *out_y = in_x;
-      break;
-    case CameraRotation::k180:
-      *out_x = -in_x;
-      *out_y = -in_y;
-      break;
-    case CameraRotation::k270:
-      *out_x = in_y;
-      *out_y = -in_x;
-      break;
-    case CameraRotation::k0:
-    default:
-      CHECK(false);
-  }
-
-  // Undo coordinate space shift
-  *out_x = *out_x + (CameraTask::kWidth / 2);
-  *out_y = *out_y + (CameraTask::kHeight / 2);
-  CHECK(*out_x >= 0);
-  CHECK(*out_x < static_cast<int>(CameraTask::kWidth));
-  CHECK(*out_y >= 0);
-  CHECK(*out_y < static_cast<int>(CameraTask::kHeight));
-}
-
-void BayerToRgb(const uint8_t* camera_raw, uint8_t* camera_rgb, int width,
-                int height, CameraFilterMethod filter,
-                CameraRotation rotation) {
-  std::memset(camera_rgb, 0, width * height * 3);
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_rgb, width, height, rotation](int x, int y, uint8_t r,
-                                                      uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 0] = r;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 1] = g;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 2] = b;
-                });
-}
-
-void BayerToGrayscale(const uint8_t* camera_raw, uint8_t* camera_grayscale,
-                      int width, int height, CameraFilterMethod filter,
-                      CameraRotation rotation) {
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_grayscale, width, height, rotation](
-                    int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  float r_f = static_cast<float>(r) / kUint8Max;
-                  float g_f = static_cast<float>(g) / kUint8Max;
-                  float b_f = static_cast<float>(b) / kUint8Max;
-                  camera_grayscale[rot_x + (rot_y * width)] =
-                      static_cast<uint8_t>(((kRedCoefficient * r_f * r_f) +
-                                            (kGreenCoefficient * g_f * g_f) +
-                                            (kBlueCoefficient * b_f * b_f)) *
-                                           kUint8Max);
-                });
-}
-
-void RgbToGrayscale(const uint8_t* camera_rgb, uint8_t* camera_grayscale,
-                    int width, int height) {
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      float r_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 0]) /
-          kUint8Max;
-      float g_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 1]) /
-          kUint8Max;
-      float b_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 2]) /
-          kUint8Max;
-      camera_grayscale[x + (y * width)] = static_cast<uint8_t>(
-          ((kRedCoefficient * r_f * r_f) + (kGreenCoefficient * g_f * g_f) +
-           (kBlueCoefficient * b_f * b_f)) *
-          kUint8Max);
-    }
+  camera::FrameResponse frame = GetFrame(true);
+  if (frame.index == -1) {
+    return false;
   }
-}
-
-void AutoWhiteBalance(uint8_t* camera_rgb, int width, int height) {
-  unsigned int r_sum = 0, g_sum = 0, b_sum = 0;
-  float r_sum_f = 0.0, g_sum_f = 0.0, b_sum_f = 0.0;
-  float threshold = 0.9f;
-  uint16_t threshold16 = static_cast<uint16_t>(threshold * 255);
-  uint16_t min_rgb, max_rgb;
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    min_rgb = static_cast<uint16_t>(std::min(r, std::min(g, b)));
-    max_rgb = static_cast<uint16_t>(std::max(r, std::max(g, b)));
-    if (((max_rgb - min_rgb) * 255) > (threshold16 * max_rgb)) {
-      continue;
-    }
-    r_sum += r;
-    g_sum += g;
-    b_sum += b;
-  }
-  r_sum_f = static_cast<float>(r_sum);
-  g_sum_f = static_cast<float>(g_sum);
-  b_sum_f = static_cast<float>(b_sum);
-  float max_channel = std::max(r_sum_f, std::max(g_sum_f, b_sum_f));
-  float epsilon = 0.1;
-  float r_gain_f = r_sum_f < epsilon ? 0.0f : max_channel / r_sum_f;
-  float g_gain_f = g_sum_f < epsilon ? 0.0f : max_channel / g_sum_f;
-  float b_gain_f = b_sum_f < epsilon ? 0.0f : max_channel / b_sum_f;
-  uint16_t r_gain_i = static_cast<uint16_t>(r_gain_f * (1 << 8));
-  uint16_t g_gain_i = static_cast<uint16_t>(g_gain_f * (1 << 8));
-  uint16_t b_gain_i = static_cast<uint16_t>(b_gain_f * (1 << 8));
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    camera_rgb[i * 3 + 0] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(r) * r_gain_i) >> 8));
-    camera_rgb[i * 3 + 1] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(g) * g_gain_i) >> 8));
-    camera_rgb[i * 3 + 2] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(b) * b_gain_i) >> 8));
+  if (mode_ == CameraMode::kTrigger) {
+    GpioSet(Gpio::kCameraTrigger, false);
   }
+
+  bool ret = process(IndexToFramebufferPtr(frame.index));
+  ReturnFrame(frame.index);
+  return ret;
 }
-}  // namespace
 
-extern "C" void CSI_DriverIRQHandler(void);
-extern "C" void CSI_IRQHandler(void) {
-  CSI_DriverIRQHandler();
-  __DSB();
+bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
+  return ProcessNextFrame(
+      [this, &fmts](const uint8_t* raw) { return ProcessFrame(raw, fmts); });
 }
 
-int CameraFormatBpp(CameraFormat fmt) {
-  switch (fmt) {
-    case CameraFormat::kRgb:
-      return 3;
-    case CameraFormat::kRaw:
-    case CameraFormat::kY8:
-      return 1;
-  }
-  return 0;
+bool CameraTask::GetPyramid(const std::vector<CameraFrameFormat>& levels) {
+  return ProcessNextFrame([this, &levels](const uint8_t* raw) {
+    MutexLock lock(white_balance_mutex);
+    return camera::ConvertPyramid(
+        raw, levels,
+        test_pattern_ == CameraTestPattern::kNone ? &white_balance : nullptr,
+        workspace.get());
+  });
 }
 
-bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
-  if (!enabled_) {
-    printf("Camera is not enabled, cannot capture frame.\r\n");
-    return false;
+CameraFrameLease CameraTask::LeaseFrame() {
+  if (!CheckFrameReady()) {
+    return CameraFrameLease();
   }
-  if (mode_ == CameraMode::kTrigger && !GpioGet(Gpio::kCameraTrigger)) {
-    printf("Camera is in trigger mode but was never triggered\r\n");
-    return false;
+
+  const int max_leases = (mode_ == CameraMode::kTrigger
+                              ? kTriggerFramebufferCount
+                              : kFramebufferCount) -
+                         1;
+  if (leased_frames_.fetch_add(1) >= max_leases) {
+    leased_frames_.fetch_sub(1);
+    printf("All camera framebuffers are leased, cannot lease a frame.\r\n");
+    return CameraFrameLease();
   }
 
-  bool ret = true;
-  uint8_t* raw = nullptr;
-  int index = GetFrame(&raw, true);
-  if (!raw) {
-    return false;
+  camera::FrameResponse frame = GetFrame(true);
+  if (frame.index == -1) {
+    leased_frames_.fetch_sub(1);
+    return CameraFrameLease();
   }
   if (mode_ == CameraMode::kTrigger) {
     GpioSet(Gpio::kCameraTrigger, false);
   }
+  return CameraFrameLease(IndexToFramebufferPtr(frame.index), frame.index,
+                          frame.sequence, frame.timestamp_us);
+}
 
-  for (const CameraFrameFormat& fmt : fmts) {
-    switch (fmt.fmt) {
-      case CameraFormat::kRgb: {
-        if (fmt.width == kWidth && fmt.height == kHeight) {
-          BayerToRgb(raw, fmt.buffer, fmt.width, fmt.height, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(fmt.buffer, fmt.width, fmt.height);
-          }
-        } else {
-          auto buffer_rgb = std::make_unique<uint8_t[]>(
-              CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-          BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(buffer_rgb.get(), kWidth, kHeight);
-          }
-          ResizeNearestNeighbor(buffer_rgb.get(), kWidth, kHeight, fmt.buffer,
-                                fmt.width, fmt.height,
-                                CameraFormatBpp(CameraFormat::kRgb),
-                                fmt.preserve_ratio);
-        }
-        break;
-        case CameraFormat::kY8: {
-          if (fmt.width == kWidth && fmt.height == kHeight) {
-            BayerToGrayscale(raw, fmt.buffer, kWidth, kHeight, fmt.filter,
-                             fmt.rotation);
-          } else {
-            auto buffer_rgb = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-            auto buffer_rgb_scaled = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * fmt.width * fmt.height);
-            BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                       fmt.rotation);
-            ResizeNearestNeighbor(
-                buffer_rgb.get(), kWidth, kHeight, buffer_rgb_scaled.get(),
-                fmt.width, fmt.height, CameraFormatBpp(CameraFormat::kRgb),
-                fmt.preserve_ratio);
-            RgbToGrayscale(buffer_rgb_scaled.get(), fmt.buffer, fmt.width,
-                           fmt.height);
-          }
-        } break;
-        case CameraFormat::kRaw:
-          if (fmt.width != kWidth || fmt.height != kHeight) {
-            ret = false;
-            break;
-          }
-          std::memcpy(fmt.buffer, raw,
-                      kWidth * kHeight * CameraFormatBpp(CameraFormat::kRaw));
-          ret = true;
-          break;
-        default:
-          ret = false;
-      }
+bool CameraTask::GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                               std::function<void(bool success)> callback) {
+  if (!CheckFrameReady()) {
+    return false;
+  }
+
+  // A trigger yields a single frame, so only one request can wait for it.
+  const int max_pending =
+      mode_ == CameraMode::kTrigger ? 1 : kMaxPendingFrames;
+  int pending = pending_count_.load();
+  do {
+    if (pending >= max_pending) {
+      return false;
+    }
+  } while (!pending_count_.compare_exchange_weak(pending, pending + 1));
+  // With a reservation held, a free slot is certain to be found.
+  for (int i = 0; i < kMaxPendingFrames; ++i) {
+    PendingFrame& frame = pending_frames_[i];
+    bool busy = false;
+    if (!frame.busy.compare_exchange_strong(busy, true)) continue;
+    frame.fmts = fmts;
+    frame.callback = std::move(callback);
+
+    // The conversion runs on its own task rather than the camera task, which
+    // has to keep serving frames, and with a stack sized for it.
+    bool started = false;
+    if (convert_task_started_.compare_exchange_strong(started, true)) {
+      CHECK(xTaskCreate(ConvertTaskMain, "camera_convert",
+                        configMINIMAL_STACK_SIZE * 30, this, kAppTaskPriority,
+                        nullptr) == pdPASS);
     }
+    CHECK(xQueueSend(convert_queue_, &i, portMAX_DELAY) == pdTRUE);
+    return true;
   }
+  pending_count_.fetch_sub(1);
+  return false;
+}
 
-  GetSingleton()->ReturnFrame(index);
-  return ret;
+bool CameraTask::GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                               TaskHandle_t task) {
+  return GetFrameAsync(fmts, [task](bool success) {
+    xTaskNotify(task, success ? 1 : 0, eSetValueWithOverwrite);
+  });
+}
+
+bool CameraTask::ConvertFrame(const CameraFrameLease& frame,
+                              const std::vector<CameraFrameFormat>& fmts) {
+  if (!frame) {
+    return false;
+  }
+  return ProcessFrame(frame.data(), fmts);
 }
 
 bool CameraTask::Read(uint16_t reg, uint8_t* val) {
@@ -584,6 +357,13 @@ bool CameraTask::Write(uint16_t reg, uint8_t val) {
 
 void CameraTask::Init(lpi2c_rtos_handle_t* i2c_handle) {
   QueueTask::Init();
+  convert_queue_ = xQueueCreate(kMaxPendingFrames, sizeof(int));
+  CHECK(convert_queue_);
+  white_balance_mutex = xSemaphoreCreateMutex();
+  CHECK(white_balance_mutex);
+  frame_done_ = xSemaphoreCreateBinary();
+  CHECK(frame_done_);
+  workspace = std::make_unique<camera::Workspace>();
   i2c_handle_ = i2c_handle;
   enabled_ = false;
   GetMotionDetectionConfigDefault(md_config_);
@@ -596,7 +376,7 @@ void CameraTask::Init(lpi2c_rtos_handle_t* i2c_handle) {
       });
 }
 
-int CameraTask::GetFrame(uint8_t** buffer, bool block) {
+camera::FrameResponse CameraTask::GetFrame(bool block) {
   camera::Request req;
   req.type = camera::RequestType::kFrame;
   req.request.frame.index = -1;
@@ -604,8 +384,50 @@ int CameraTask::GetFrame(uint8_t** buffer, bool block) {
   do {
     resp = SendRequest(req);
   } while (block && resp.response.frame.index == -1);
-  *buffer = IndexToFramebufferPtr(resp.response.frame.index);
-  return resp.response.frame.index;
+  return resp.response.frame;
+}
+
+camera::FrameResponse CameraTask::WaitForFrame(uint32_t timeout_ms) {
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  // Registered before the first attempt, so a frame that completes right
+  // after it still wakes this task.
+  frame_waiters_.fetch_add(1);
+  camera::FrameResponse frame = GetFrame(false);
+  while (frame.index == -1 && enabled_) {
+    const TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout) break;
+    xSemaphoreTake(frame_done_, timeout - elapsed);
+    frame = GetFrame(false);
+  }
+  frame_waiters_.fetch_sub(1);
+  return frame;
+}
+
+void CameraTask::CsiTransferCallback(CSI_Type* base, csi_handle_t* handle,
+                                     status_t status, void* user_data) {
+  auto* camera = static_cast<CameraTask*>(user_data);
+  if (status != kStatus_CSI_FrameDone || camera->frame_waiters_ == 0 ||
+      camera->frame_done_posted_.exchange(true)) {
+    return;
+  }
+  // A full queue means the camera task has plenty to do already; wake the
+  // waiters directly rather than fail to post.
+  if (xQueueIsQueueFullFromISR(camera->request_queue_)) {
+    camera->frame_done_posted_ = false;
+    BaseType_t reschedule = pdFALSE;
+    xSemaphoreGiveFromISR(camera->frame_done_, &reschedule);
+    portYIELD_FROM_ISR(reschedule);
+    return;
+  }
+  camera::Request req;
+  req.type = camera::RequestType::kFrameDone;
+  camera->SendRequestAsync(req);
+}
+
+void CameraTask::HandleFrameDone() {
+  frame_done_posted_ = false;
+  xSemaphoreGive(frame_done_);
 }
 
 void CameraTask::ReturnFrame(int index) {
@@ -615,6 +437,11 @@ void CameraTask::ReturnFrame(int index) {
   SendRequest(req);
 }
 
+void CameraTask::ReleaseFrame(int index) {
+  ReturnFrame(index);
+  leased_frames_.fetch_sub(1);
+}
+
 bool CameraTask::Enable(CameraMode mode) {
   camera::Request req;
   req.type = camera::RequestType::kEnable;
@@ -647,6 +474,11 @@ void CameraTask::SetTestPattern(CameraTestPattern pattern) {
 
 void CameraTask::Trigger() { GpioSet(Gpio::kCameraTrigger, true); }
 
+void CameraTask::SetWhiteBalanceRate(float rate) {
+  MutexLock lock(white_balance_mutex);
+  white_balance.set_rate(rate);
+}
+
 void CameraTask::DiscardFrames(int count) {
   camera::Request req;
   req.type = camera::RequestType::kDiscard;
@@ -754,6 +586,12 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   camera::EnableResponse resp;
   status_t status;
 
+  // A new stream starts from scratch rather than from old gains.
+  {
+    MutexLock lock(white_balance_mutex);
+    white_balance.Reset();
+  }
+
   // Gated clock mode
   uint8_t osc_clk_div;
   Read(CameraRegisters::kOscClkDiv, &osc_clk_div);
@@ -765,13 +603,16 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   // Shifting
   Write(CameraRegisters::kVsyncHsyncPixelShiftEn, 0x0);
 
-  status = CSI_TransferCreateHandle(CSI, &csi_handle_, nullptr, 0);
+  status = CSI_TransferCreateHandle(CSI, &csi_handle_, CsiTransferCallback,
+                                    this);
 
-  int framebuffer_count = kFramebufferCount;
+  active_framebuffers_ = kFramebufferCount;
   if (mode == CameraMode::kTrigger) {
-    framebuffer_count = 2;
+    active_framebuffers_ = kTriggerFramebufferCount;
   }
-  for (int i = 0; i < framebuffer_count; i++) {
+  // Framebuffers still leased from before are queued when they come back.
+  for (int i = 0; i < active_framebuffers_; i++) {
+    if (framebuffer_held_[i]) continue;
     status = CSI_TransferSubmitEmptyBuffer(
         CSI, &csi_handle_, reinterpret_cast<uint32_t>(framebuffers[i]));
   }
@@ -787,6 +628,8 @@ void CameraTask::HandleDisableRequest() {
   enabled_ = false;
   Write(CameraRegisters::kModeSelect, 0);
   CSI_TransferStop(CSI, &csi_handle_);
+  // Frames stop, so waiters give up rather than wait out their timeout.
+  xSemaphoreGive(frame_done_);
 }
 
 camera::PowerResponse CameraTask::HandlePowerRequest(
@@ -827,11 +670,19 @@ camera::FrameResponse CameraTask::HandleFrameRequest(
     if (status == kStatus_Success) {
       DCACHE_InvalidateByRange(buffer, kHeight * kWidth);
       resp.index = FramebufferPtrToIndex(reinterpret_cast<uint8_t*>(buffer));
+      resp.sequence = frame_sequence_++;
+      resp.timestamp_us = TimerMicros();
+      if (resp.index != -1) framebuffer_held_[resp.index] = true;
     }
   } else {  // RETURN
     buffer = reinterpret_cast<uint32_t>(IndexToFramebufferPtr(frame.index));
-    if (buffer) {
-      CSI_TransferSubmitEmptyBuffer(CSI, &csi_handle_, buffer);
+    // A framebuffer only goes back to the CSI once, and only if the current
+    // mode captures into it.
+    if (buffer && framebuffer_held_[frame.index]) {
+      framebuffer_held_[frame.index] = false;
+      if (frame.index < active_framebuffers_) {
+        CSI_TransferSubmitEmptyBuffer(CSI, &csi_handle_, buffer);
+      }
     }
   }
   return resp;
@@ -869,6 +720,40 @@ void CameraTask::HandleDiscardRequest(const camera::DiscardRequest& discard) {
   }
 }
 
+void CameraTask::ConvertTaskMain(void* param) {
+  auto* camera = static_cast<CameraTask*>(param);
+  int slot;
+  while (true) {
+    if (xQueueReceive(camera->convert_queue_, &slot, portMAX_DELAY) ==
+        pdTRUE) {
+      camera->ConvertPendingFrame(slot);
+    }
+  }
+}
+
+void CameraTask::ConvertPendingFrame(int slot) {
+  PendingFrame& pending = pending_frames_[slot];
+  bool success = false;
+  camera::FrameResponse frame = WaitForFrame(kAsyncFrameTimeoutMs);
+  if (frame.index != -1) {
+    if (mode_ == CameraMode::kTrigger) {
+      GpioSet(Gpio::kCameraTrigger, false);
+    }
+    success = ProcessFrame(IndexToFramebufferPtr(frame.index), pending.fmts);
+    ReturnFrame(frame.index);
+  } else {
+    printf("No camera frame for GetFrameAsync()\r\n");
+  }
+
+  // Free the slot before calling back, so the callback can queue the next
+  // frame.
+  auto callback = std::move(pending.callback);
+  pending.fmts.clear();
+  pending.busy = false;
+  pending_count_.fetch_sub(1);
+  if (callback) callback(success);
+}
+
 void CameraTask::GetMotionDetectionConfigDefault(
     CameraMotionDetectionConfig& config) {
   config.cb = nullptr;
@@ -934,6 +819,9 @@ void CameraTask::RequestHandler(camera::Request* req) {
     case camera::RequestType::kMotionDetectionConfig:
       HandleMotionDetectionConfig(req->request.motion_detection_config);
       break;
+    case camera::RequestType::kFrameDone:
+      HandleFrameDone();
+      break;
   }
   if (req->callback) req->callback(resp);
 }
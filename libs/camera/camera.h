@@ -17,11 +17,14 @@
 #ifndef LIBS_CAMERA_CAMERA_H_
 #define LIBS_CAMERA_CAMERA_H_
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <utility>
 #include <vector>
 
 #include "libs/base/queue_task.h"
+#include "libs/camera/camera_format.h"
 #include "libs/base/tasks.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_csi.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_lpi2c_freertos.h"
@@ -100,6 +103,7 @@ enum class RequestType : uint8_t {
   kDiscard,
   kMotionDetectionInterrupt,
   kMotionDetectionConfig,
+  kFrameDone,
 };
 
 struct FrameRequest {
@@ -108,6 +112,8 @@ struct FrameRequest {
 
 struct FrameResponse {
   int index;
+  uint32_t sequence;
+  uint64_t timestamp_us;
 };
 
 struct PowerRequest {
@@ -155,63 +161,58 @@ struct Request {
 }  // namespace camera
 // @endcond
 
-// Image format options, used with `CameraFrameFormat`.
-enum class CameraFormat {
-  // RGB image.
-  kRgb,
-  // Y8 (grayscale) image.
-  kY8,
-  // Raw bayer image.
-  kRaw,
-};
-
-// Gets the bytes-per-pixel (the number of color channels) used by the
-// given image format.
-// @param The image format (from `CameraFormat`).
-// @return The number of bytes per pixel.
-int CameraFormatBpp(CameraFormat fmt);
-
-// Image resampling method (when resizing the image).
-enum class CameraFilterMethod {
-  kBilinear,
-  kNearestNeighbor,
-};
+// A raw frame leased from the camera with `CameraTask::LeaseFrame()`.
+//
+// The lease points straight at one of the camera's framebuffers, so the
+// frame can be read (by any number of consumers) without copying it. The
+// framebuffer goes back to the camera when the lease is destroyed or
+// released, after which `data()` must no longer be read. Leases can be
+// moved but not copied.
+class CameraFrameLease {
+ public:
+  // Creates an empty lease that holds no frame.
+  CameraFrameLease() = default;
+  ~CameraFrameLease() { Release(); }
 
-// Clockwise image rotations.
-enum class CameraRotation {
-  // The natural orientation for the camera module
-  k0,
-  // Rotated 90-degrees clockwise.
-  // Upside down, relative to the board's "Coral" label.
-  k90,
-  // Rotated 180-degrees clockwise.
-  k180,
-  // Rotated 270-degrees clockwise.
-  // Right-side up, relative to the board's "Coral" label.
-  k270,
-};
+  CameraFrameLease(CameraFrameLease&& other) noexcept {
+    *this = std::move(other);
+  }
+  CameraFrameLease& operator=(CameraFrameLease&& other) noexcept;
+  CameraFrameLease(const CameraFrameLease&) = delete;
+  CameraFrameLease& operator=(const CameraFrameLease&) = delete;
+
+  // Returns true if the lease holds a frame.
+  bool valid() const { return data_ != nullptr; }
+  explicit operator bool() const { return valid(); }
+
+  // The raw Bayer frame, `CameraTask::kWidth` x `CameraTask::kHeight` bytes,
+  // or nullptr if the lease is empty.
+  const uint8_t* data() const { return data_; }
+  // The index of the framebuffer holding the frame, or -1 if empty.
+  int index() const { return index_; }
+  // The number of the frame, counting every frame received from the camera
+  // (including those returned by `GetFrame()` and `DiscardFrames()`).
+  uint32_t sequence() const { return sequence_; }
+  // The time the frame was received from the camera, in microseconds since
+  // boot (see `TimerMicros()`).
+  uint64_t timestamp_us() const { return timestamp_us_; }
+
+  // Returns the framebuffer to the camera and empties the lease.
+  void Release();
 
-// Specifies your image buffer location and any image processing you want to
-// perform when fetching images with `CameraTask::GetFrame()`.
-struct CameraFrameFormat {
-  // Image format such as RGB or raw.
-  CameraFormat fmt;
-  // Filter method such as bilinear (default) or nearest-neighbor.
-  CameraFilterMethod filter = CameraFilterMethod::kBilinear;
-  // Image rotation in 90-degree increments. Default is 270 degree which
-  // corresponds to the device held vertically with USB port facing down.
-  CameraRotation rotation = CameraRotation::k270;
-  // Image width. (Native size is `CameraTask::kWidth`.)
-  int width;
-  // Image height. (Native size is `CameraTask::kHeight`.)
-  int height;
-  // If using non-native width/height, set this true to maintain the native
-  // aspect ratio, false to crop the image.
-  bool preserve_ratio;
-  // Location to store the image.
-  uint8_t* buffer;
-  // Set true to perform auto whitebalancing (default), false to disable it.
-  bool white_balance = true;
+ private:
+  friend class CameraTask;
+  CameraFrameLease(const uint8_t* data, int index, uint32_t sequence,
+                   uint64_t timestamp_us)
+      : data_(data),
+        index_(index),
+        sequence_(sequence),
+        timestamp_us_(timestamp_us) {}
+
+  const uint8_t* data_ = nullptr;
+  int index_ = -1;
+  uint32_t sequence_ = 0;
+  uint64_t timestamp_us_ = 0;
 };
 
 // Provides access to the Dev Board Micro camera.
@@ -270,6 +271,95 @@ class CameraTask
   // @return True if image processing succeeds, false otherwise.
   bool GetFrame(const std::vector<CameraFrameFormat>& fmts);
 
+  // Gets one frame from the camera buffer and processes it into an image
+  // pyramid: a set of progressively smaller images, such as the inputs of a
+  // multi-scale detector.
+  //
+  // This is faster than getting each level with its own `GetFrame()` call,
+  // or even in one: the frame is demosaiced once, and each level after the
+  // first is resampled from the level before it as its rows are written, so
+  // each level reads a smaller image than the last.
+  //
+  // @note This blocks like `GetFrame()`.
+  //
+  // @param levels The levels, largest first, each written into its own
+  // buffer (or tensor). Each must be `CameraFormat::kRgb` or
+  // `CameraFormat::kY8`, and no larger than the level before it in either
+  // dimension, not counting letterboxing. The `filter` and `roi` of the first
+  // level apply to the whole pyramid. Each level is otherwise converted as
+  // its format describes, though later levels may differ slightly from what
+  // `GetFrame()` would produce since they are resized from a smaller image.
+  // @return True if image processing succeeds, false otherwise. Nothing is
+  // written if any level is invalid.
+  bool GetPyramid(const std::vector<CameraFrameFormat>& levels);
+
+  // Gets one raw frame from the camera buffer without copying it.
+  //
+  // The frame stays in the camera's framebuffer until the returned lease is
+  // released, so it can be read by several consumers and processed with
+  // `ConvertFrame()` as many times as needed. Release it as soon as you can:
+  // the camera cannot capture into a leased framebuffer.
+  //
+  // To always leave the camera a framebuffer to capture into, at most
+  // `kFramebufferCount - 1` frames (one in trigger mode) can be leased at
+  // once. Past that, this returns an empty lease rather than blocking.
+  //
+  // A lease stays valid across `Disable()` and `Enable()`: the camera only
+  // captures into its framebuffer again once it is released.
+  //
+  // @note Like `GetFrame()`, this blocks until a new frame is available, and
+  // returns an empty lease in trigger mode if the camera was not triggered.
+  //
+  // @return The leased frame, or an empty lease on failure.
+  CameraFrameLease LeaseFrame();
+
+  // Gets one frame from the camera buffer and processes it into one or more
+  // formats in the background, calling `callback` when done.
+  //
+  // The frame is fetched and converted by a worker task, started on the
+  // first call, so the caller can keep working (for example, run inference on
+  // the previous frame) in the meantime. Up to `kMaxPendingFrames` requests
+  // (one in trigger mode) can be queued; they are served in order, each with
+  // a newer frame than the last. For double buffering, queue frame N+1 into
+  // one set of buffers while reading frame N from the other.
+  //
+  // A request fails if the camera is disabled while it waits for a frame, or
+  // if no frame arrives within `kAsyncFrameTimeoutMs`.
+  //
+  // The buffers in `fmts` must stay valid, and must not be read, until
+  // `callback` is called.
+  //
+  // @param fmts A list of image formats you want to receive.
+  // @param callback Called from the worker task once the frame is processed,
+  // with true if image processing succeeded, false otherwise. It may queue
+  // the next frame.
+  // @return True if the request was queued, false if the camera is not
+  // ready or too many requests are pending.
+  bool GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                     std::function<void(bool success)> callback);
+
+  // Like `GetFrameAsync()` above, but notifies `task` once the frame is
+  // processed instead of calling a callback.
+  //
+  // The notification value is overwritten with 1 if image processing
+  // succeeded and 0 otherwise. Wait for it with `xTaskNotifyWait()`.
+  //
+  // @param fmts A list of image formats you want to receive.
+  // @param task The task to notify, such as `xTaskGetCurrentTaskHandle()`.
+  // @return True if the request was queued, false if the camera is not
+  // ready or too many requests are pending.
+  bool GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                     TaskHandle_t task);
+
+  // Processes a leased frame into one or more formats, as `GetFrame()`
+  // does for a new frame.
+  //
+  // @param frame The leased frame.
+  // @param fmts A list of image formats you want to receive.
+  // @return True if image processing succeeds, false otherwise.
+  bool ConvertFrame(const CameraFrameLease& frame,
+                    const std::vector<CameraFrameFormat>& fmts);
+
   // Turns the camera power on and off. You must call this before `Enable()`.
   // @param enable True to turn the camera on, false to turn it off.
   // @return True if the action was successful, false otherwise.
@@ -286,6 +376,19 @@ class CameraTask
   // fetch it with `GetFrame()`.
   void Trigger();
 
+  // Sets how fast auto white balancing adapts to the scene.
+  //
+  // White balance gains are carried from frame to frame and smoothed, which
+  // avoids flicker between frames and lets each frame be balanced as it is
+  // converted. Each frame moves the gains by `rate` of the way toward its
+  // own; 1 follows the scene immediately (one frame late), smaller values
+  // are steadier. The default is 0.25. Gains restart from the first frame
+  // each time the camera is enabled. Only formats without a `roi` update
+  // the gains; crops are balanced with the gains of the whole frame.
+  //
+  // @param rate The convergence rate, from 0.01 to 1.
+  void SetWhiteBalanceRate(float rate);
+
   // Purges the image sensor data one frame at a time.
   //
   // This essentially captures images without saving any of the data,
@@ -311,14 +414,50 @@ class CameraTask
   void SetMotionDetectionConfig(const CameraMotionDetectionConfig& config);
 
   // Native image pixel width.
-  static constexpr size_t kWidth = 324;
+  static constexpr size_t kWidth = camera::kSensorWidth;
 
   // Native image pixel height.
-  static constexpr size_t kHeight = 324;
+  static constexpr size_t kHeight = camera::kSensorHeight;
+
+  // Number of framebuffers the camera captures into when streaming.
+  static constexpr int kFramebufferCount = 4;
+
+  // Maximum number of `GetFrameAsync()` requests pending at once.
+  static constexpr int kMaxPendingFrames = 2;
+
+  // How long a `GetFrameAsync()` request waits for a frame before failing.
+  static constexpr uint32_t kAsyncFrameTimeoutMs = 1000;
 
  private:
-  int GetFrame(uint8_t** buffer, bool block);
+  friend class CameraFrameLease;
+
+  // A `GetFrameAsync()` request, kept here rather than in the worker's
+  // queue, which only holds plain data.
+  struct PendingFrame {
+    std::atomic<bool> busy{false};
+    std::vector<CameraFrameFormat> fmts;
+    std::function<void(bool)> callback;
+  };
+
+  bool CheckFrameReady();
+  camera::FrameResponse GetFrame(bool block);
   void ReturnFrame(int index);
+  void ReleaseFrame(int index);
+  // Gets a new frame, passes it to `process` and returns the frame.
+  bool ProcessNextFrame(
+      const std::function<bool(const uint8_t* raw)>& process);
+  bool ProcessFrame(const uint8_t* raw,
+                    const std::vector<CameraFrameFormat>& fmts);
+  // Waits for a new frame until one arrives, the camera is disabled or
+  // `timeout_ms` passes, in which case the index is -1. Sleeps between
+  // frames, woken by the CSI's frame-done interrupt.
+  camera::FrameResponse WaitForFrame(uint32_t timeout_ms);
+  // CSI transfer callback, called from the CSI interrupt.
+  static void CsiTransferCallback(CSI_Type* base, csi_handle_t* handle,
+                                  status_t status, void* user_data);
+  void HandleFrameDone();
+  static void ConvertTaskMain(void* param);
+  void ConvertPendingFrame(int slot);
   void TaskInit() override;
   void RequestHandler(camera::Request* req) override;
   camera::EnableResponse HandleEnableRequest(const CameraMode& mode);
@@ -342,6 +481,29 @@ class CameraTask
   CameraTestPattern test_pattern_;
   CameraMotionDetectionConfig md_config_;
   bool enabled_{false};
+  uint32_t frame_sequence_{0};
+  std::atomic<int> leased_frames_{0};
+  // Framebuffers handed out by `HandleFrameRequest()` and not yet returned.
+  // `HandleEnableRequest()` leaves them out of the CSI's queue, and returning
+  // one that isn't held does nothing, so no framebuffer is ever queued twice.
+  // Only the camera task uses these.
+  bool framebuffer_held_[kFramebufferCount] = {};
+  // Framebuffers the CSI captures into in the current mode.
+  int active_framebuffers_{0};
+  PendingFrame pending_frames_[kMaxPendingFrames];
+  // Number of busy `pending_frames_`, reserved before a slot is claimed so
+  // that concurrent requests can't claim more than the mode allows.
+  std::atomic<int> pending_count_{0};
+  // Given by `HandleFrameDone()` when the CSI completes a frame, and by
+  // `HandleDisableRequest()`, to wake `WaitForFrame()`.
+  SemaphoreHandle_t frame_done_{nullptr};
+  // Tasks in `WaitForFrame()`. The CSI interrupt only posts `kFrameDone`
+  // while there are any, and only one at a time, so it can't fill the queue.
+  std::atomic<int> frame_waiters_{0};
+  std::atomic<bool> frame_done_posted_{false};
+  // Slots of the `GetFrameAsync()` requests for the worker task, in order.
+  QueueHandle_t convert_queue_{nullptr};
+  std::atomic<bool> convert_task_started_{false};
 };
 
 }  // namespace coralmicro
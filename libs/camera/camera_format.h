@@ -0,0 +1,143 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_CAMERA_CAMERA_FORMAT_H_
+#define LIBS_CAMERA_CAMERA_FORMAT_H_
+
+#include <cstdint>
+
+struct TfLiteTensor;
+
+namespace coralmicro {
+
+// @cond Do not generate docs
+namespace camera {
+// Size of the sensor's raw frames, as `CameraTask::kWidth` and
+// `CameraTask::kHeight`. Kept here, apart from the camera task, so the frame
+// conversions also build for the host.
+inline constexpr int kSensorWidth = 324;
+inline constexpr int kSensorHeight = 324;
+}  // namespace camera
+// @endcond
+
+// Image format options, used with `CameraFrameFormat`.
+enum class CameraFormat {
+  // RGB image.
+  kRgb,
+  // Y8 (grayscale) image.
+  kY8,
+  // Raw bayer image.
+  kRaw,
+};
+
+// Gets the bytes-per-pixel (the number of color channels) used by the
+// given image format.
+// @param The image format (from `CameraFormat`).
+// @return The number of bytes per pixel.
+int CameraFormatBpp(CameraFormat fmt);
+
+// Demosaicing method (when converting the raw Bayer image to color).
+enum class CameraFilterMethod {
+  kBilinear,
+  kNearestNeighbor,
+};
+
+// Image scaling method (when the output size differs from the native size).
+enum class CameraResizeMethod {
+  // Picks the nearest sensor pixel. Fastest, but aliases when downscaling.
+  kNearestNeighbor,
+  // Interpolates between the four nearest sensor pixels.
+  kBilinear,
+  // Averages every sensor pixel covered by the output pixel. Best quality
+  // when downscaling, such as to small model input sizes.
+  kArea,
+};
+
+// Clockwise image rotations.
+enum class CameraRotation {
+  // The natural orientation for the camera module
+  k0,
+  // Rotated 90-degrees clockwise.
+  // Upside down, relative to the board's "Coral" label.
+  k90,
+  // Rotated 180-degrees clockwise.
+  k180,
+  // Rotated 270-degrees clockwise.
+  // Right-side up, relative to the board's "Coral" label.
+  k270,
+};
+
+// A rectangle in sensor coordinates, as used by `CameraFrameFormat::roi`.
+//
+// Sensor coordinates are those of the raw image, before any rotation.
+struct CameraRect {
+  // The left-most column.
+  int x;
+  // The top-most row.
+  int y;
+  // The number of columns.
+  int width;
+  // The number of rows.
+  int height;
+};
+
+// Specifies your image buffer location and any image processing you want to
+// perform when fetching images with `CameraTask::GetFrame()`.
+struct CameraFrameFormat {
+  // Image format such as RGB or raw.
+  CameraFormat fmt;
+  // Filter method such as bilinear (default) or nearest-neighbor.
+  CameraFilterMethod filter = CameraFilterMethod::kBilinear;
+  // Image rotation in 90-degree increments. Default is 270 degree which
+  // corresponds to the device held vertically with USB port facing down.
+  CameraRotation rotation = CameraRotation::k270;
+  // Image width. (Native size is `CameraTask::kWidth`.)
+  int width;
+  // Image height. (Native size is `CameraTask::kHeight`.)
+  int height;
+  // If using non-native width/height, set this true to maintain the native
+  // aspect ratio (or that of `roi`), false to stretch the image.
+  bool preserve_ratio;
+  // Location to store the image.
+  uint8_t* buffer;
+  // Set true to perform auto whitebalancing (default), false to disable it.
+  // See `CameraTask::SetWhiteBalanceRate()`.
+  bool white_balance = true;
+  // Resize method such as nearest-neighbor (default), bilinear or area.
+  CameraResizeMethod resize = CameraResizeMethod::kNearestNeighbor;
+  // Region of the sensor to convert, in sensor coordinates. The region is
+  // rotated with `rotation` and scaled to `width` x `height`, and only the
+  // sensor pixels inside it are processed (including for white balance).
+  // A zero width or height selects the full frame (default).
+  CameraRect roi = {0, 0, 0, 0};
+  // Tensor to write the image into, in place of `buffer` (`kRgb` and `kY8`
+  // only). It must be uint8 or int8 and hold exactly `width` x `height`
+  // pixels, such as a [1, height, width, 3] tensor for `kRgb`. Each channel
+  // value v is normalized to (v - `mean`) / `stddev` and quantized with the
+  // tensor's scale and zero point as it is written, so the tensor is ready
+  // for inference without a copy or a preprocessing pass.
+  TfLiteTensor* tensor = nullptr;
+  // Mean subtracted from each channel value written to `tensor`.
+  float mean = 0.0f;
+  // Standard deviation each channel value written to `tensor` is divided
+  // by. For example, a `mean` and `stddev` of 127.5 give inputs in [-1, 1],
+  // and 0 and 255 give inputs in [0, 1].
+  float stddev = 1.0f;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_CAMERA_CAMERA_FORMAT_H_
@@ -0,0 +1,1751 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/camera/camera_pipeline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "third_party/tflite-micro/tensorflow/lite/c/common.h"
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/fsl_device_registers.h"
+#endif
+
+namespace coralmicro {
+namespace camera {
+namespace {
+constexpr int kRawWidth = kSensorWidth;
+constexpr int kRawHeight = kSensorHeight;
+constexpr int kMaxRawDim = std::max(kRawWidth, kRawHeight);
+constexpr int kCenterX = kRawWidth / 2;
+constexpr int kCenterY = kRawHeight / 2;
+
+constexpr float kRedCoefficient = .2126;
+constexpr float kGreenCoefficient = .7152;
+constexpr float kBlueCoefficient = .0722;
+constexpr int kLumaFractionBits = 16;
+
+// Both demosaic filters need two rows of context, so only raw rows
+// [kFirstRow, kEndRow) produce pixels; everything else is left black.
+constexpr int kFirstRow = 2;
+constexpr int kEndRow = kRawHeight - 2;
+
+// Maps one axis of the output image onto the rotated sensor image, where the
+// converted window spans `source` pixels from rotated coordinate `offset`.
+// Output indices at or past `scaled` are padding, which is how
+// `CameraFrameFormat::preserve_ratio` letterboxes the image. `First()`
+// implements nearest-neighbor sampling.
+struct ResampleAxis {
+  int size;
+  int scaled;
+  int source;
+  int offset;
+  float ratio;
+
+  // Returns the first output index that samples rotated coordinate `r` or
+  // later.
+  int First(int r) const {
+    r -= offset;
+    int o = std::min(std::max(static_cast<int>(r / ratio), 0), scaled);
+    while (o > 0 && static_cast<int>((o - 1) * ratio) >= r) --o;
+    while (o < scaled && static_cast<int>(o * ratio) < r) ++o;
+    return o;
+  }
+};
+
+// Describes where each sensor pixel lands in the output buffer.
+//
+// Sensor columns walk the output's "inner" axis and sensor rows walk its
+// "outer" axis. Depending on the rotation, either one can be the output's x
+// axis, so each has its own byte stride into the output buffer. The rotated
+// coordinate of sensor pixel (x, y) is `inner_origin + inner_step * x` along
+// the inner axis and `outer_origin + outer_step * y` along the outer one.
+// Only sensor pixels in the window [x_begin, x_end) x [y_begin, y_end) are
+// converted.
+struct Plan {
+  ResampleAxis inner;
+  ResampleAxis outer;
+  int inner_stride;
+  int outer_stride;
+  int inner_origin;
+  int inner_step;
+  int outer_origin;
+  int outer_step;
+  int x_begin;
+  int x_end;
+  int y_begin;
+  int y_end;
+};
+
+struct AwbStats {
+  uint32_t r_sum = 0;
+  uint32_t g_sum = 0;
+  uint32_t b_sum = 0;
+
+  // Accumulates one pixel unless it is strongly saturated. Branch-free, since
+  // the outcome is close to random on real scenes.
+  void Add(uint8_t r, uint8_t g, uint8_t b) {
+    constexpr uint32_t kThreshold16 = static_cast<uint16_t>(0.9f * 255);
+    const uint32_t min_rgb = std::min(r, std::min(g, b));
+    const uint32_t max_rgb = std::max(r, std::max(g, b));
+    const uint32_t keep = -static_cast<uint32_t>(
+        (max_rgb - min_rgb) * 255 <= kThreshold16 * max_rgb);
+    r_sum += r & keep;
+    g_sum += g & keep;
+    b_sum += b & keep;
+  }
+};
+
+// Columns of raw row `y` that produce pixels with the given filter. The
+// nearest-neighbor filter works on staggered 2x2 cells, so its window
+// shifts by one column on odd rows.
+constexpr int FirstColumn(CameraFilterMethod filter, int y) {
+  return filter == CameraFilterMethod::kBilinear ? 1 : 2 + (y & 1);
+}
+
+constexpr int EndColumn(CameraFilterMethod filter, int y) {
+  return filter == CameraFilterMethod::kBilinear ? kRawWidth - 1
+                                                 : kRawWidth - 2 + (y & 1);
+}
+
+// Columns that produce pixels on any row.
+constexpr int FirstBoxColumn(CameraFilterMethod filter) {
+  return std::min(FirstColumn(filter, 0), FirstColumn(filter, 1));
+}
+
+constexpr int EndBoxColumn(CameraFilterMethod filter) {
+  return std::max(EndColumn(filter, 0), EndColumn(filter, 1));
+}
+
+// Demosaics the pixel reported at (x, y). The bilinear filter interpolates
+// around raw pixel (x, y - 1); the nearest-neighbor filter picks samples from
+// the 2x2 cell starting at raw pixel (x, y).
+template <CameraFilterMethod Filter>
+inline void Demosaic(const uint8_t* raw, int x, int y, uint8_t* r, uint8_t* g,
+                     uint8_t* b);
+
+template <>
+inline void Demosaic<CameraFilterMethod::kBilinear>(const uint8_t* raw, int x,
+                                                    int y, uint8_t* r,
+                                                    uint8_t* g, uint8_t* b) {
+  constexpr int s = kRawWidth;
+  const uint8_t* p = raw + (y - 2) * s + (x - 1);
+  const bool odd_row = y & 1;
+  if ((x + y) & 1) {
+    // Red or blue site: the other one sits on the diagonals.
+    uint8_t corners = (static_cast<uint32_t>(p[0]) + p[2] + p[2 * s] +
+                       p[2 * s + 2] + 2) >>
+                      2;
+    uint8_t center = p[s + 1];
+    *g = (static_cast<uint32_t>(p[1]) + p[s] + p[s + 2] + p[2 * s + 1] + 2) >>
+         2;
+    *r = odd_row ? corners : center;
+    *b = odd_row ? center : corners;
+  } else {
+    // Green site: red and blue sit above/below and left/right.
+    uint8_t vertical = (static_cast<uint32_t>(p[1]) + p[2 * s + 1] + 1) >> 1;
+    uint8_t horizontal = (static_cast<uint32_t>(p[s]) + p[s + 2] + 1) >> 1;
+    *g = p[s + 1];
+    *r = odd_row ? vertical : horizontal;
+    *b = odd_row ? horizontal : vertical;
+  }
+}
+
+template <>
+inline void Demosaic<CameraFilterMethod::kNearestNeighbor>(
+    const uint8_t* raw, int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+  constexpr int s = kRawWidth;
+  const uint8_t* p = raw + y * s + x;
+  const bool odd_row = y & 1;
+  if (((x + y) & 1) == 0) {
+    *g = p[1];
+    *r = odd_row ? p[0] : p[s + 1];
+    *b = odd_row ? p[s + 1] : p[0];
+  } else {
+    *g = p[s + 1];
+    *r = odd_row ? p[1] : p[s];
+    *b = odd_row ? p[s] : p[1];
+  }
+}
+
+// Per-channel terms of `255 * (kr * r^2 + kg * g^2 + kb * b^2)` with r, g
+// and b normalized to [0, 1], in fixed point. Built at compile time so luma
+// is three loads and two adds, with no floating point on the M4.
+struct LumaTable {
+  uint32_t r[256];
+  uint32_t g[256];
+  uint32_t b[256];
+};
+
+constexpr LumaTable MakeLumaTable() {
+  LumaTable table{};
+  for (int i = 0; i < 256; ++i) {
+    const float square = static_cast<float>(i * i) / 255;
+    constexpr float kOne = 1 << kLumaFractionBits;
+    table.r[i] = static_cast<uint32_t>(kRedCoefficient * square * kOne + 0.5f);
+    table.g[i] =
+        static_cast<uint32_t>(kGreenCoefficient * square * kOne + 0.5f);
+    table.b[i] = static_cast<uint32_t>(kBlueCoefficient * square * kOne + 0.5f);
+  }
+  return table;
+}
+
+constexpr LumaTable kLumaTable = MakeLumaTable();
+
+inline uint8_t Luma(uint8_t r, uint8_t g, uint8_t b) {
+  return (kLumaTable.r[r] + kLumaTable.g[g] + kLumaTable.b[b]) >>
+         kLumaFractionBits;
+}
+
+// Returns the first rotated coordinate of sensor range [begin, end).
+int RotatedStart(int origin, int step, int begin, int end) {
+  return step > 0 ? origin + begin : origin - (end - 1);
+}
+
+// Returns true if `plan` converts the whole sensor rather than a crop.
+bool CoversSensor(const Plan& plan) {
+  return plan.x_begin == 0 && plan.x_end == kRawWidth && plan.y_begin == 0 &&
+         plan.y_end == kRawHeight;
+}
+
+Plan MakePlan(const CameraFrameFormat& fmt, const CameraRect& roi, int bpp) {
+  Plan plan;
+  plan.x_begin = roi.x;
+  plan.x_end = roi.x + roi.width;
+  plan.y_begin = roi.y;
+  plan.y_end = roi.y + roi.height;
+
+  // Rotating about the center of the frame: sensor columns become output
+  // rows when the rotation is 90 or 270 degrees.
+  const int row_stride = fmt.width * bpp;
+  bool transposed = false;
+  switch (fmt.rotation) {
+    case CameraRotation::k90:
+      transposed = true;
+      plan.inner_origin = 0;
+      plan.inner_step = 1;
+      plan.outer_origin = kRawHeight - 1;
+      plan.outer_step = -1;
+      break;
+    case CameraRotation::k180:
+      plan.inner_origin = kRawWidth - 1;
+      plan.inner_step = -1;
+      plan.outer_origin = kRawHeight - 1;
+      plan.outer_step = -1;
+      break;
+    case CameraRotation::k270:
+      transposed = true;
+      plan.inner_origin = kRawWidth - 1;
+      plan.inner_step = -1;
+      plan.outer_origin = 0;
+      plan.outer_step = 1;
+      break;
+    case CameraRotation::k0:
+    default:
+      plan.inner_origin = 0;
+      plan.inner_step = 1;
+      plan.outer_origin = 0;
+      plan.outer_step = 1;
+      break;
+  }
+  plan.inner_stride = transposed ? row_stride : bpp;
+  plan.outer_stride = transposed ? bpp : row_stride;
+
+  // Same scaled size, and therefore the same letterboxing, as resizing the
+  // rotated window with nearest-neighbor sampling.
+  const int window_w = transposed ? roi.height : roi.width;
+  const int window_h = transposed ? roi.width : roi.height;
+  float ratio_src = static_cast<float>(window_w) / window_h;
+  float ratio_dst = static_cast<float>(fmt.width) / fmt.height;
+  int scaled_w = fmt.width;
+  int scaled_h = fmt.height;
+  if (fmt.preserve_ratio) {
+    if (ratio_dst > ratio_src) {
+      scaled_w = window_w * static_cast<float>(fmt.height) / window_h;
+    } else {
+      scaled_h = window_h * static_cast<float>(fmt.width) / window_w;
+    }
+  }
+  ResampleAxis x_axis{fmt.width, scaled_w, window_w, 0,
+                      static_cast<float>(window_w) / scaled_w};
+  ResampleAxis y_axis{fmt.height, scaled_h, window_h, 0,
+                      static_cast<float>(window_h) / scaled_h};
+  plan.inner = transposed ? y_axis : x_axis;
+  plan.outer = transposed ? x_axis : y_axis;
+  plan.inner.offset = RotatedStart(plan.inner_origin, plan.inner_step,
+                                   plan.x_begin, plan.x_end);
+  plan.outer.offset = RotatedStart(plan.outer_origin, plan.outer_step,
+                                   plan.y_begin, plan.y_end);
+  return plan;
+}
+
+// Returns the half-open range of output indices along `axis` that sample
+// rotated coordinates `origin + step * [begin, end)`.
+void CoveredRange(const ResampleAxis& axis, int origin, int step, int begin,
+                  int end, int* first, int* last) {
+  if (begin >= end) {
+    *first = *last = 0;
+    return;
+  }
+  int a = origin + step * begin;
+  int b = origin + step * (end - 1);
+  *first = axis.First(std::min(a, b));
+  *last = axis.First(std::max(a, b) + 1);
+}
+
+// Sets every output byte outside inner indices [inner_begin, inner_end) and
+// outer indices [outer_begin, outer_end), i.e. everything the conversion
+// pass never writes, to `black`.
+void ClearBorder(const CameraFrameFormat& fmt, int bpp, uint8_t black,
+                 int inner_begin, int inner_end, int outer_begin,
+                 int outer_end) {
+  int row_begin = outer_begin, row_end = outer_end;
+  int col_begin = inner_begin, col_end = inner_end;
+  if (fmt.rotation == CameraRotation::k90 ||
+      fmt.rotation == CameraRotation::k270) {
+    std::swap(row_begin, col_begin);
+    std::swap(row_end, col_end);
+  }
+  const int row_bytes = fmt.width * bpp;
+  uint8_t* dst = fmt.buffer;
+  std::memset(dst, black, row_begin * row_bytes);
+  for (int y = row_begin; y < row_end; ++y) {
+    uint8_t* row = dst + y * row_bytes;
+    std::memset(row, black, col_begin * bpp);
+    std::memset(row + col_end * bpp, black, (fmt.width - col_end) * bpp);
+  }
+  std::memset(dst + row_end * row_bytes, black,
+              (fmt.height - row_end) * row_bytes);
+}
+
+// Output pixel writers.
+struct RgbWriter {
+  static constexpr int kBpp = 3;
+
+  void Write(uint8_t* p, uint8_t r, uint8_t g, uint8_t b) const {
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
+  }
+};
+
+// Writes RGB with white balance gains applied.
+struct BalancedRgbWriter {
+  static constexpr int kBpp = 3;
+
+  WhiteBalance::Gains gains;
+
+  void Write(uint8_t* p, uint8_t r, uint8_t g, uint8_t b) const {
+    p[0] = std::min<uint32_t>(255, (r * gains.r) >> 8);
+    p[1] = std::min<uint32_t>(255, (g * gains.g) >> 8);
+    p[2] = std::min<uint32_t>(255, (b * gains.b) >> 8);
+  }
+};
+
+struct LumaWriter {
+  static constexpr int kBpp = 1;
+
+  void Write(uint8_t* p, uint8_t r, uint8_t g, uint8_t b) const {
+    *p = Luma(r, g, b);
+  }
+};
+
+// Maps the output of another writer through a lookup table, which quantizes
+// it for a tensor.
+template <typename Writer>
+struct TensorWriter {
+  static constexpr int kBpp = Writer::kBpp;
+
+  Writer writer;
+  uint8_t lut[256];
+
+  TensorWriter(const Writer& writer, const uint8_t* lut) : writer(writer) {
+    std::memcpy(this->lut, lut, sizeof(this->lut));
+  }
+
+  void Write(uint8_t* p, uint8_t r, uint8_t g, uint8_t b) const {
+    uint8_t value[kBpp];
+    writer.Write(value, r, g, b);
+    for (int c = 0; c < kBpp; ++c) p[c] = lut[value[c]];
+  }
+};
+
+// Returns the byte `writer` writes for black, which is the same in every
+// channel.
+template <typename Writer>
+uint8_t BlackByte(const Writer& writer) {
+  uint8_t black[Writer::kBpp];
+  writer.Write(black, 0, 0, 0);
+  return black[0];
+}
+
+// Calls `f` with the writer for `fmt`: luma or RGB, with `gains` if not
+// nullptr, and through `lut` if not nullptr.
+template <typename F>
+void WithWriter(const CameraFrameFormat& fmt, const WhiteBalance::Gains* gains,
+                const uint8_t* lut, F&& f) {
+  if (fmt.fmt == CameraFormat::kY8) {
+    if (lut) {
+      f(TensorWriter<LumaWriter>(LumaWriter(), lut));
+    } else {
+      f(LumaWriter());
+    }
+  } else if (gains) {
+    if (lut) {
+      f(TensorWriter<BalancedRgbWriter>(BalancedRgbWriter{*gains}, lut));
+    } else {
+      f(BalancedRgbWriter{*gains});
+    }
+  } else {
+    if (lut) {
+      f(TensorWriter<RgbWriter>(RgbWriter(), lut));
+    } else {
+      f(RgbWriter());
+    }
+  }
+}
+
+// Fills `lut` with the tensor value of each channel value of `fmt`:
+// normalized with `fmt.mean` and `fmt.stddev`, then quantized with the
+// tensor's scale and zero point, rounding to nearest and saturating.
+void MakeTensorLut(const CameraFrameFormat& fmt, uint8_t* lut) {
+  const TfLiteTensor& tensor = *fmt.tensor;
+  float scale = tensor.params.scale;
+  int zero_point = tensor.params.zero_point;
+  if (scale <= 0) {
+    scale = 1;
+    zero_point = 0;
+  }
+  const bool is_signed = tensor.type == kTfLiteInt8;
+  const float min = is_signed ? -128 : 0;
+  const float max = is_signed ? 127 : 255;
+  const float multiplier = 1 / (fmt.stddev * scale);
+  for (int v = 0; v < 256; ++v) {
+    const float q = std::round((v - fmt.mean) * multiplier) + zero_point;
+    lut[v] = static_cast<uint8_t>(
+        static_cast<int>(std::min(max, std::max(min, q))));
+  }
+}
+
+// Points `fmt.buffer` at the data of `fmt.tensor`, if it has a tensor.
+// Returns false if the tensor cannot hold the image.
+bool ResolveTensor(CameraFrameFormat* fmt) {
+  const TfLiteTensor* tensor = fmt->tensor;
+  if (!tensor) {
+    return true;
+  }
+  if ((tensor->type != kTfLiteUInt8 && tensor->type != kTfLiteInt8) ||
+      !tensor->data.raw || fmt->width <= 0 || fmt->height <= 0 ||
+      fmt->stddev == 0 ||
+      tensor->bytes != static_cast<size_t>(fmt->width * fmt->height *
+                                           CameraFormatBpp(fmt->fmt))) {
+    return false;
+  }
+  fmt->buffer = reinterpret_cast<uint8_t*>(tensor->data.raw);
+  return true;
+}
+
+// Writes one color to output pixels [o_begin, o_end) x [i_begin, i_end),
+// indexed along the outer and inner axes.
+template <typename Writer>
+inline void WriteBlock(const Writer& writer, uint8_t* dst, const Plan& plan,
+                       int o_begin, int o_end, int i_begin, int i_end,
+                       uint8_t r, uint8_t g, uint8_t b) {
+  for (int o = o_begin; o < o_end; ++o) {
+    uint8_t* line = dst + o * plan.outer_stride;
+    for (int i = i_begin; i < i_end; ++i) {
+      writer.Write(line + i * plan.inner_stride, r, g, b);
+    }
+  }
+}
+
+// Fills `inner_first` with the first output index sampling each rotated
+// coordinate along the inner axis, so the nearest-neighbor scatter costs two
+// table lookups per sensor pixel.
+void MakeInnerFirst(const Plan& plan, uint16_t* inner_first) {
+  for (int r = 0; r <= kMaxRawDim; ++r) {
+    inner_first[r] = plan.inner.First(r);
+  }
+}
+
+// Blacks out everything the nearest-neighbor scatter will not write,
+// including letterboxing.
+void ClearUncovered(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+                    uint8_t black) {
+  int inner_begin, inner_end, outer_begin, outer_end;
+  CoveredRange(plan.inner, plan.inner_origin, plan.inner_step,
+               std::max(FirstBoxColumn(fmt.filter), plan.x_begin),
+               std::min(EndBoxColumn(fmt.filter), plan.x_end), &inner_begin,
+               &inner_end);
+  CoveredRange(plan.outer, plan.outer_origin, plan.outer_step,
+               std::max(kFirstRow, plan.y_begin),
+               std::min(kEndRow, plan.y_end), &outer_begin, &outer_end);
+  ClearBorder(fmt, bpp, black, inner_begin, inner_end, outer_begin,
+              outer_end);
+}
+
+// Streams the raw frame row by row, demosaicing each pixel at most once and
+// writing it to every output pixel that samples it. Pixels that no output
+// pixel samples are only demosaiced when white balance statistics are needed.
+//
+// This is the fast path for a single nearest-neighbor output; it needs no
+// memory beyond `inner_first`.
+template <CameraFilterMethod Filter, bool kCollectStats, typename Writer>
+void ConvertRows(const uint8_t* raw, const Plan& plan,
+                 const uint16_t* inner_first, const Writer& writer,
+                 uint8_t* dst, AwbStats* stats) {
+  const int box_begin = std::max(FirstBoxColumn(Filter), plan.x_begin);
+  const int box_end = std::min(EndBoxColumn(Filter), plan.x_end);
+  const int y_begin = std::max(kFirstRow, plan.y_begin);
+  const int y_end = std::min(kEndRow, plan.y_end);
+  for (int y = y_begin; y < y_end; ++y) {
+    const int ro = plan.outer_origin + plan.outer_step * y;
+    const int o_begin = plan.outer.First(ro);
+    const int o_end = plan.outer.First(ro + 1);
+    const int x_begin = std::max(FirstColumn(Filter, y), box_begin);
+    const int x_end = std::min(EndColumn(Filter, y), box_end);
+    if (o_begin == o_end) {
+      if (kCollectStats) {
+        for (int x = x_begin; x < x_end; ++x) {
+          uint8_t r, g, b;
+          Demosaic<Filter>(raw, x, y, &r, &g, &b);
+          stats->Add(r, g, b);
+        }
+      }
+      continue;
+    }
+
+    int ri = plan.inner_origin + plan.inner_step * box_begin;
+    for (int x = box_begin; x < box_end; ++x, ri += plan.inner_step) {
+      const int i_begin = inner_first[ri];
+      const int i_end = inner_first[ri + 1];
+      const bool sampled = i_begin != i_end;
+      if (!sampled && !kCollectStats) continue;
+
+      uint8_t r = 0, g = 0, b = 0;
+      if (x >= x_begin && x < x_end) {
+        Demosaic<Filter>(raw, x, y, &r, &g, &b);
+        if (kCollectStats) stats->Add(r, g, b);
+      }
+      if (!sampled) continue;
+      WriteBlock(writer, dst, plan, o_begin, o_end, i_begin, i_end, r, g, b);
+    }
+  }
+}
+
+template <CameraFilterMethod Filter, typename Writer>
+void ConvertRows(const uint8_t* raw, const Plan& plan,
+                 const uint16_t* inner_first, const Writer& writer,
+                 uint8_t* dst, AwbStats* stats) {
+  if (stats) {
+    ConvertRows<Filter, true>(raw, plan, inner_first, writer, dst, stats);
+  } else {
+    ConvertRows<Filter, false>(raw, plan, inner_first, writer, dst, stats);
+  }
+}
+
+template <typename Writer>
+void ConvertRows(const uint8_t* raw, CameraFilterMethod filter,
+                 const Plan& plan, const uint16_t* inner_first,
+                 const Writer& writer, uint8_t* dst, AwbStats* stats) {
+  if (filter == CameraFilterMethod::kNearestNeighbor) {
+    ConvertRows<CameraFilterMethod::kNearestNeighbor>(raw, plan, inner_first,
+                                                      writer, dst, stats);
+  } else {
+    ConvertRows<CameraFilterMethod::kBilinear>(raw, plan, inner_first, writer,
+                                               dst, stats);
+  }
+}
+
+// Bilinear weights are 1.7 fixed point, so an interpolated channel still fits
+// in a signed halfword for the dual 16-bit multiplies.
+constexpr int kBilinearBits = 7;
+constexpr uint32_t kBilinearOne = 1 << kBilinearBits;
+
+// Returns `a * (kBilinearOne - w) + b * w`, with `weights` holding
+// `kBilinearOne - w` in its low halfword and `w` in its high halfword.
+inline uint32_t Lerp(uint32_t a, uint32_t b, uint32_t weights) {
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+  return __SMUAD(__PKHBT(a, b, 16), weights);
+#else
+  return a * (weights & 0xFFFF) + b * (weights >> 16);
+#endif
+}
+
+// Adds up each channel of `count` packed RGB pixels, up to `kMaxRawDim`.
+inline void SumRgb(const uint8_t* rgb, int count, uint32_t* sum) {
+  uint32_t r = 0, g = 0, b = 0;
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+  // Four pixels are three words. Unpacking bytes 0 and 2 of each word, as is
+  // and rotated by a byte, accumulates two channels per instruction; with at
+  // most kMaxRawDim / 4 additions the halfword lanes cannot overflow.
+  uint32_t acc[6] = {};
+  for (; count >= 4; count -= 4, rgb += 12) {
+    uint32_t w[3];
+    std::memcpy(w, rgb, sizeof(w));
+    acc[0] = __UXTAB16(acc[0], w[0]);               // R0, B0
+    acc[1] = __UXTAB16(acc[1], __ROR(w[0], 8));     // G0, R1
+    acc[2] = __UXTAB16(acc[2], w[1]);               // G1, R2
+    acc[3] = __UXTAB16(acc[3], __ROR(w[1], 8));     // B1, G2
+    acc[4] = __UXTAB16(acc[4], w[2]);               // B2, G3
+    acc[5] = __UXTAB16(acc[5], __ROR(w[2], 8));     // R3, B3
+  }
+  r = (acc[0] & 0xFFFF) + (acc[1] >> 16) + (acc[2] >> 16) + (acc[5] & 0xFFFF);
+  g = (acc[1] & 0xFFFF) + (acc[2] & 0xFFFF) + (acc[3] >> 16) + (acc[4] >> 16);
+  b = (acc[0] >> 16) + (acc[3] & 0xFFFF) + (acc[4] & 0xFFFF) + (acc[5] >> 16);
+#endif
+  for (; count > 0; --count, rgb += 3) {
+    r += rgb[0];
+    g += rgb[1];
+    b += rgb[2];
+  }
+  sum[0] = r;
+  sum[1] = g;
+  sum[2] = b;
+}
+
+// Bilinear sample of output index `o`: source pixels `first` and `second`,
+// blended with packed weights (see `Lerp()`). Pixel centers are aligned.
+struct BilinearTap {
+  uint16_t first;
+  uint16_t second;
+  uint32_t weights;
+};
+
+void MakeBilinearTaps(const ResampleAxis& axis, BilinearTap* taps) {
+  const int n = axis.source;
+  for (int o = 0; o < axis.scaled; ++o) {
+    // ((o + 0.5) * n / scaled - 0.5) in 1.7 fixed point, rounded.
+    int pos = ((2 * o + 1) * n * static_cast<int>(kBilinearOne) + axis.scaled) /
+                  (2 * axis.scaled) -
+              static_cast<int>(kBilinearOne) / 2;
+    pos = std::max(pos, 0);
+    int first = pos >> kBilinearBits;
+    uint32_t w = pos & (kBilinearOne - 1);
+    if (first >= n - 1) {
+      first = n - 1;
+      w = 0;
+    }
+    taps[o].first = first;
+    taps[o].second = std::min(first + 1, n - 1);
+    taps[o].weights = (kBilinearOne - w) | (w << 16);
+  }
+}
+
+// Area sample of output index `o`, which covers source pixels
+// [first, last]. In units where each output pixel is `source` long and each
+// source pixel is `scaled` long, the end pixels are covered by `first_weight`
+// and `last_weight` and the ones in between fully, so the weights always add
+// up to `source`.
+struct AreaTap {
+  uint16_t first;
+  uint16_t last;
+  uint16_t first_weight;
+  uint16_t last_weight;
+};
+
+void MakeAreaTaps(const ResampleAxis& axis, AreaTap* taps) {
+  const int n = axis.source;
+  const int scaled = axis.scaled;
+  for (int o = 0; o < scaled; ++o) {
+    const int begin = o * n;
+    const int end = begin + n;
+    const int first = begin / scaled;
+    const int last = (end - 1) / scaled;
+    taps[o].first = first;
+    taps[o].last = last;
+    taps[o].first_weight = std::min((first + 1) * scaled, end) - begin;
+    taps[o].last_weight = end - std::max(last * scaled, begin);
+  }
+}
+
+// Constructs a T in `workspace`. Objects in a workspace are never destroyed,
+// so they must not own memory outside of it.
+template <typename T, typename... Args>
+T* New(Workspace* workspace, Args&&... args) {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "Objects in a workspace are never destroyed");
+  return new (workspace->Allocate(sizeof(T), alignof(T)))
+      T(std::forward<Args>(args)...);
+}
+
+// Allocates `count` value-initialized T in `workspace`.
+template <typename T>
+T* NewArray(Workspace* workspace, size_t count) {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "Objects in a workspace are never destroyed");
+  auto* array =
+      static_cast<T*>(workspace->Allocate(count * sizeof(T), alignof(T)));
+  for (size_t i = 0; i < count; ++i) new (&array[i]) T();
+  return array;
+}
+
+// Gives a workspace back when a conversion returns.
+class WorkspaceScope {
+ public:
+  explicit WorkspaceScope(Workspace* workspace) : workspace_(workspace) {}
+  ~WorkspaceScope() { workspace_->Reset(); }
+  WorkspaceScope(const WorkspaceScope&) = delete;
+  WorkspaceScope& operator=(const WorkspaceScope&) = delete;
+
+ private:
+  Workspace* workspace_;
+};
+
+// One row of the sensor for the shared pass, demosaiced on demand so that
+// each pixel is demosaiced at most once however many outputs sample it.
+// Pixels the filter cannot produce read as black.
+//
+// Columns that some output reads all of are demosaiced together the first
+// time the row is read, which skips the per-pixel bookkeeping.
+class SensorRow {
+ public:
+  SensorRow(const uint8_t* raw, CameraFilterMethod filter)
+      : raw_(raw), filter_(filter) {
+    std::fill(std::begin(stamp_), std::end(stamp_), -1);
+  }
+
+  // Adds columns [begin, end) to those demosaiced together.
+  void AddDense(int begin, int end) {
+    if (begin >= end) return;
+    if (dense_begin_ >= dense_end_) {
+      dense_begin_ = begin;
+      dense_end_ = end;
+    } else {
+      dense_begin_ = std::min(dense_begin_, begin);
+      dense_end_ = std::max(dense_end_, end);
+    }
+  }
+
+  // Moves to sensor row `y`. Rows must be visited in increasing order.
+  void Start(int y) {
+    y_ = y;
+    const bool valid = y >= kFirstRow && y < kEndRow;
+    begin_ = valid ? FirstColumn(filter_, y) : 0;
+    end_ = valid ? EndColumn(filter_, y) : 0;
+  }
+
+  CameraFilterMethod filter() const { return filter_; }
+  // Columns of the current row that produce pixels.
+  int begin() const { return begin_; }
+  int end() const { return end_; }
+
+  // Returns pixel `x` of the current row as packed RGB.
+  const uint8_t* Get(int x) { return Get(x, x + 1); }
+
+  // Returns pixels [begin, end) of the current row as packed RGB.
+  const uint8_t* Get(int begin, int end) {
+    if (begin >= dense_begin_ && end <= dense_end_) {
+      if (dense_y_ != y_) {
+        dense_y_ = y_;
+        FillDense();
+      }
+    } else if (filter_ == CameraFilterMethod::kBilinear) {
+      Fill<CameraFilterMethod::kBilinear>(begin, end);
+    } else {
+      Fill<CameraFilterMethod::kNearestNeighbor>(begin, end);
+    }
+    return rgb_ + 3 * begin;
+  }
+
+ private:
+  template <CameraFilterMethod Filter>
+  void Fill(int begin, int end) {
+    for (int x = begin; x < end; ++x) {
+      if (stamp_[x] == y_) continue;
+      stamp_[x] = y_;
+      uint8_t* p = rgb_ + 3 * x;
+      if (x < begin_ || x >= end_) {
+        p[0] = p[1] = p[2] = 0;
+      } else {
+        Demosaic<Filter>(raw_, x, y_, &p[0], &p[1], &p[2]);
+      }
+    }
+  }
+
+  void FillDense() {
+    const int begin = std::min(std::max(dense_begin_, begin_), dense_end_);
+    const int end = std::max(begin, std::min(dense_end_, end_));
+    std::memset(rgb_ + 3 * dense_begin_, 0, 3 * (begin - dense_begin_));
+    if (filter_ == CameraFilterMethod::kBilinear) {
+      FillRange<CameraFilterMethod::kBilinear>(begin, end);
+    } else {
+      FillRange<CameraFilterMethod::kNearestNeighbor>(begin, end);
+    }
+    std::memset(rgb_ + 3 * end, 0, 3 * (dense_end_ - end));
+    std::fill(stamp_ + dense_begin_, stamp_ + dense_end_, y_);
+  }
+
+  template <CameraFilterMethod Filter>
+  void FillRange(int begin, int end) {
+    // Local copies, since the compiler cannot tell that writing the pixels
+    // leaves the members alone.
+    const uint8_t* raw = raw_;
+    const int y = y_;
+    uint8_t* p = rgb_ + 3 * begin;
+    for (int x = begin; x < end; ++x, p += 3) {
+      Demosaic<Filter>(raw, x, y, &p[0], &p[1], &p[2]);
+    }
+  }
+
+  const uint8_t* raw_;
+  CameraFilterMethod filter_;
+  int y_ = -1;
+  int begin_ = 0;
+  int end_ = 0;
+  int dense_begin_ = 0;
+  int dense_end_ = 0;
+  int dense_y_ = -1;
+  uint8_t rgb_[kRawWidth * 3];
+  int16_t stamp_[kRawWidth];
+};
+
+// White balance statistics over one sensor window, shared by every output
+// that converts the same window with the same demosaic filter.
+struct StatsWindow {
+  SensorRow* row;
+  int x_begin;
+  int x_end;
+  int y_begin;
+  int y_end;
+  AwbStats stats;
+
+  bool Matches(const SensorRow* other_row, const Plan& plan) const {
+    return row == other_row && x_begin == plan.x_begin &&
+           x_end == plan.x_end && y_begin == plan.y_begin &&
+           y_end == plan.y_end;
+  }
+
+  void AddRow(int y) {
+    if (y < y_begin || y >= y_end) return;
+    const int begin = std::max(row->begin(), x_begin);
+    const int end = std::min(row->end(), x_end);
+    if (begin >= end) return;
+    const uint8_t* p = row->Get(begin, end);
+    for (int x = begin; x < end; ++x, p += 3) stats.Add(p[0], p[1], p[2]);
+  }
+};
+
+// One output of the shared pass. Each target is handed the sensor rows in
+// increasing order and writes its part of the output as they arrive.
+//
+// Targets and their buffers live in the conversion's workspace.
+class Target {
+ public:
+  Target(const CameraFrameFormat& fmt, const Plan& plan, SensorRow* row,
+         int window)
+      : fmt_(fmt), plan_(plan), row_(row), window_(window) {}
+
+  const CameraFrameFormat& fmt() const { return fmt_; }
+  const Plan& plan() const { return plan_; }
+  // Index of the shared white balance statistics, or -1 for none.
+  int window() const { return window_; }
+
+  // Consumes sensor row `y`, which `row` is positioned at.
+  virtual void AddRow(int y) = 0;
+
+ protected:
+  const CameraFrameFormat& fmt_;
+  const Plan plan_;
+  SensorRow* row_;
+  int window_;
+};
+
+template <typename Writer>
+class NearestTarget : public Target {
+ public:
+  NearestTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+                SensorRow* row, int window, const Writer& writer,
+                Workspace* workspace)
+      : Target(fmt, plan, row, window),
+        writer_(writer),
+        y_begin_(std::max(kFirstRow, plan.y_begin)),
+        y_end_(std::min(kEndRow, plan.y_end)) {
+    // Only the columns that some output pixel samples are visited.
+    const int box_begin = std::max(FirstBoxColumn(fmt.filter), plan.x_begin);
+    const int box_end = std::min(EndBoxColumn(fmt.filter), plan.x_end);
+    columns_ = NewArray<Column>(workspace, std::max(0, box_end - box_begin));
+    int ri = plan.inner_origin + plan.inner_step * box_begin;
+    for (int x = box_begin; x < box_end; ++x, ri += plan.inner_step) {
+      const int i_begin = plan.inner.First(ri);
+      const int i_end = plan.inner.First(ri + 1);
+      if (i_begin != i_end) {
+        columns_[column_count_++] = {static_cast<uint16_t>(x),
+                                     static_cast<uint16_t>(i_begin),
+                                     static_cast<uint16_t>(i_end)};
+      }
+    }
+    // When most columns are sampled, demosaic the rows in one go.
+    dense_ = 2 * column_count_ >= box_end - box_begin;
+    if (dense_) row->AddDense(box_begin, box_end);
+    ClearUncovered(fmt, plan, bpp, BlackByte(writer));
+  }
+
+  // Same scatter as `ConvertRows()`, with pixels from the shared row.
+  void AddRow(int y) override {
+    if (y < y_begin_ || y >= y_end_ || column_count_ == 0) return;
+    const int ro = plan_.outer_origin + plan_.outer_step * y;
+    const int o_begin = plan_.outer.First(ro);
+    const int o_end = plan_.outer.First(ro + 1);
+    if (o_begin == o_end) return;
+
+    // Local copies, since the compiler cannot tell that writing the output
+    // leaves the members alone.
+    const Plan plan = plan_;
+    const Writer writer = writer_;
+    uint8_t* dst = fmt_.buffer;
+    uint8_t* line = dst + o_begin * plan.outer_stride;
+    const bool one_row = o_end - o_begin == 1;
+    const uint8_t* rgb = nullptr;
+    if (dense_) {
+      const int begin = columns_[0].x;
+      rgb = row_->Get(begin, columns_[column_count_ - 1].x + 1) - 3 * begin;
+    }
+    for (int c = 0; c < column_count_; ++c) {
+      const Column& column = columns_[c];
+      const uint8_t* p = rgb ? rgb + 3 * column.x : row_->Get(column.x);
+      if (one_row && column.i_end - column.i_begin == 1) {
+        // Most pixels when not upscaling.
+        writer.Write(line + column.i_begin * plan.inner_stride, p[0], p[1],
+                     p[2]);
+      } else {
+        WriteBlock(writer, dst, plan, o_begin, o_end, column.i_begin,
+                   column.i_end, p[0], p[1], p[2]);
+      }
+    }
+  }
+
+ private:
+  // A sampled sensor column, and the output indices along the inner axis
+  // that sample it.
+  struct Column {
+    uint16_t x;
+    uint16_t i_begin;
+    uint16_t i_end;
+  };
+
+  Writer writer_;
+  int y_begin_;
+  int y_end_;
+  bool dense_;
+  Column* columns_;
+  int column_count_ = 0;
+};
+
+// Base for the separable resize methods, which work on whole rows of the
+// window in sensor order. Output index u along the inner axis and v along the
+// outer axis count in the same direction as sensor x and y, so a rotation
+// that flips an axis flips the output addressing instead, via `origin_` and
+// the signed strides.
+//
+// In a pyramid, each level after the first is resampled from the output rows
+// of the level before it rather than from the window: `plan.inner.source` and
+// `plan.outer.source` are then the size of that level's image.
+class ResizeTarget : public Target {
+ public:
+  ResizeTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+               SensorRow* row, int window, uint8_t black)
+      : Target(fmt, plan, row, window),
+        width_(plan.inner.scaled),
+        inner_stride_(plan.inner_step * plan.inner_stride),
+        outer_stride_(plan.outer_step * plan.outer_stride) {
+    if (row) row->AddDense(plan.x_begin, plan.x_end);
+    origin_ = fmt.buffer;
+    if (plan.inner_step < 0) {
+      origin_ += (plan.inner.scaled - 1) * plan.inner_stride;
+    }
+    if (plan.outer_step < 0) {
+      origin_ += (plan.outer.scaled - 1) * plan.outer_stride;
+    }
+    // Only letterboxing is left black.
+    ClearBorder(fmt, bpp, black, 0, plan.inner.scaled, 0, plan.outer.scaled);
+  }
+
+  void AddRow(int y) final {
+    const int v = y - plan_.y_begin;
+    if (v < 0 || v >= plan_.outer.source || !Needs(v)) return;
+    AddLine(v, row_->Get(plan_.x_begin, plan_.x_end));
+  }
+
+  // Returns false if source row `v` does not contribute to any output row
+  // that is still to be written.
+  virtual bool Needs(int v) const = 0;
+
+  // Consumes source row `v`, as packed RGB. Rows arrive in increasing order,
+  // though rows that `Needs()` rejects may be skipped.
+  virtual void AddLine(int v, const uint8_t* line) = 0;
+
+  // Hands every output row to `level` as well, as its source rows.
+  void Feed(ResizeTarget* level, Workspace* workspace) {
+    next_level_ = level;
+    level_line_ = NewArray<uint8_t>(workspace, 3 * width_);
+  }
+
+ protected:
+  // Writes output row `v`, where `pixel(i, rgb)` computes the RGB of pixel
+  // `i`, and passes the row on to the next level, if any.
+  template <typename Writer, typename F>
+  void EmitRow(const Writer& writer, int v, F&& pixel) {
+    uint8_t* out = OutputRow(v);
+    uint8_t scratch[3];
+    uint8_t* rgb = next_level_ ? level_line_ : scratch;
+    const int step = next_level_ ? 3 : 0;
+    for (int i = 0; i < width_; ++i, rgb += step) {
+      pixel(i, rgb);
+      writer.Write(out + i * inner_stride_, rgb[0], rgb[1], rgb[2]);
+    }
+    if (next_level_ && next_level_->Needs(v)) {
+      next_level_->AddLine(v, level_line_);
+    }
+  }
+
+  uint8_t* OutputRow(int v) { return origin_ + v * outer_stride_; }
+
+  int width_;
+  int inner_stride_;
+  int outer_stride_;
+  uint8_t* origin_;
+  ResizeTarget* next_level_ = nullptr;
+  uint8_t* level_line_ = nullptr;
+};
+
+// Nearest-neighbor resize of whole rows, sampling at pixel centers. Only
+// pyramids use it, since their levels need whole output rows to pass on;
+// otherwise `NearestTarget` does the same without a row cache.
+template <typename Writer>
+class NearestRowTarget : public ResizeTarget {
+ public:
+  NearestRowTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+                   SensorRow* row, int window, const Writer& writer,
+                   Workspace* workspace)
+      : ResizeTarget(fmt, plan, bpp, row, window, BlackByte(writer)),
+        writer_(writer),
+        inner_taps_(NewArray<uint16_t>(workspace, plan.inner.scaled)),
+        outer_taps_(NewArray<uint16_t>(workspace, plan.outer.scaled)) {
+    MakeNearestTaps(plan.inner, inner_taps_);
+    MakeNearestTaps(plan.outer, outer_taps_);
+  }
+
+  bool Needs(int v) const override {
+    return next_ < plan_.outer.scaled && v >= outer_taps_[next_];
+  }
+
+  void AddLine(int v, const uint8_t* line) override {
+    const uint16_t* taps = inner_taps_;
+    for (; next_ < plan_.outer.scaled && outer_taps_[next_] == v; ++next_) {
+      EmitRow(writer_, next_, [line, taps](int i, uint8_t* rgb) {
+        std::memcpy(rgb, line + 3 * taps[i], 3);
+      });
+    }
+  }
+
+ private:
+  static void MakeNearestTaps(const ResampleAxis& axis, uint16_t* taps) {
+    for (int o = 0; o < axis.scaled; ++o) {
+      taps[o] = (2 * o + 1) * axis.source / (2 * axis.scaled);
+    }
+  }
+
+  Writer writer_;
+  uint16_t* inner_taps_;
+  uint16_t* outer_taps_;
+  int next_ = 0;
+};
+
+template <typename Writer>
+class BilinearTarget : public ResizeTarget {
+ public:
+  BilinearTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+                 SensorRow* row, int window, const Writer& writer,
+                 Workspace* workspace)
+      : ResizeTarget(fmt, plan, bpp, row, window, BlackByte(writer)),
+        writer_(writer),
+        inner_taps_(NewArray<BilinearTap>(workspace, plan.inner.scaled)),
+        outer_taps_(NewArray<BilinearTap>(workspace, plan.outer.scaled)),
+        rows_(NewArray<uint32_t>(workspace, 2 * 3 * plan.inner.scaled)) {
+    MakeBilinearTaps(plan.inner, inner_taps_);
+    MakeBilinearTaps(plan.outer, outer_taps_);
+  }
+
+  // Only the rows that output rows blend are needed.
+  bool Needs(int v) const override {
+    return next_ < plan_.outer.scaled && v >= outer_taps_[next_].first;
+  }
+
+  // Horizontally resamples the row, keeping the last two, and emits each
+  // output row once both of its rows are in.
+  void AddLine(int v, const uint8_t* line) override {
+    uint32_t* h = Slot(v);
+    for (int i = 0; i < width_; ++i) {
+      const BilinearTap& tap = inner_taps_[i];
+      const uint8_t* a = line + 3 * tap.first;
+      const uint8_t* b = line + 3 * tap.second;
+      for (int c = 0; c < 3; ++c) {
+        h[3 * i + c] = Lerp(a[c], b[c], tap.weights);
+      }
+    }
+    for (; next_ < plan_.outer.scaled && outer_taps_[next_].second <= v;
+         ++next_) {
+      Emit(next_);
+    }
+  }
+
+ private:
+  uint32_t* Slot(int v) { return rows_ + (v & 1) * 3 * width_; }
+
+  void Emit(int v) {
+    constexpr int kShift = 2 * kBilinearBits;
+    constexpr uint32_t kRound = 1 << (kShift - 1);
+    const uint32_t weights = outer_taps_[v].weights;
+    const uint32_t* top = Slot(outer_taps_[v].first);
+    const uint32_t* bottom = Slot(outer_taps_[v].second);
+    EmitRow(writer_, v, [top, bottom, weights](int i, uint8_t* rgb) {
+      for (int c = 0; c < 3; ++c) {
+        rgb[c] = (Lerp(top[3 * i + c], bottom[3 * i + c], weights) + kRound) >>
+                 kShift;
+      }
+    });
+  }
+
+  Writer writer_;
+  BilinearTap* inner_taps_;
+  BilinearTap* outer_taps_;
+  uint32_t* rows_;
+  int next_ = 0;
+};
+
+template <typename Writer>
+class AreaTarget : public ResizeTarget {
+ public:
+  AreaTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+             SensorRow* row, int window, const Writer& writer,
+             Workspace* workspace)
+      : ResizeTarget(fmt, plan, bpp, row, window, BlackByte(writer)),
+        writer_(writer),
+        inner_taps_(NewArray<AreaTap>(workspace, plan.inner.scaled)),
+        outer_taps_(NewArray<AreaTap>(workspace, plan.outer.scaled)),
+        row_sums_(NewArray<uint32_t>(workspace, 3 * plan.inner.scaled)),
+        acc_(NewArray<uint32_t>(workspace, 3 * plan.inner.scaled)),
+        divisor_(plan.inner.source * plan.outer.source) {
+    MakeAreaTaps(plan.inner, inner_taps_);
+    MakeAreaTaps(plan.outer, outer_taps_);
+  }
+
+  bool Needs(int v) const override { return next_ < plan_.outer.scaled; }
+
+  // Horizontal sums are at most 255 * inner.source, and the vertical sums of
+  // those at most 255 * inner.source * outer.source, which fits in 32 bits.
+  void AddLine(int v, const uint8_t* line) override {
+    uint32_t* h = row_sums_;
+    for (int i = 0; i < width_; ++i) {
+      const AreaTap& tap = inner_taps_[i];
+      const uint8_t* first = line + 3 * tap.first;
+      uint32_t* sum = h + 3 * i;
+      if (tap.first == tap.last) {
+        for (int c = 0; c < 3; ++c) sum[c] = tap.first_weight * first[c];
+        continue;
+      }
+      const uint8_t* last = line + 3 * tap.last;
+      SumRgb(first + 3, tap.last - tap.first - 1, sum);
+      for (int c = 0; c < 3; ++c) {
+        sum[c] = sum[c] * plan_.inner.scaled + tap.first_weight * first[c] +
+                 tap.last_weight * last[c];
+      }
+    }
+
+    // Each row adds to the pending output row, and completes it if it is
+    // that row's last; when upscaling, it may complete several.
+    uint32_t* acc = acc_;
+    while (next_ < plan_.outer.scaled) {
+      const AreaTap& tap = outer_taps_[next_];
+      if (v < tap.first) break;
+      const uint32_t weight = v == tap.first  ? tap.first_weight
+                              : v == tap.last ? tap.last_weight
+                                              : plan_.outer.scaled;
+      for (int k = 0; k < 3 * width_; ++k) acc[k] += weight * h[k];
+      if (v < tap.last) break;
+
+      const uint32_t divisor = divisor_;
+      EmitRow(writer_, next_, [acc, divisor](int i, uint8_t* rgb) {
+        for (int c = 0; c < 3; ++c) {
+          rgb[c] = (acc[3 * i + c] + divisor / 2) / divisor;
+        }
+      });
+      std::memset(acc, 0, 3 * width_ * sizeof(acc[0]));
+      ++next_;
+    }
+  }
+
+ private:
+  Writer writer_;
+  AreaTap* inner_taps_;
+  AreaTap* outer_taps_;
+  uint32_t* row_sums_;
+  uint32_t* acc_;
+  uint32_t divisor_;
+  int next_ = 0;
+};
+
+// Returns the resize method actually needed: any method is an identity
+// mapping when the window is not scaled, and nearest-neighbor does that
+// fastest.
+CameraResizeMethod EffectiveResize(const CameraFrameFormat& fmt,
+                                   const Plan& plan) {
+  if (plan.inner.scaled == plan.inner.source &&
+      plan.outer.scaled == plan.outer.source) {
+    return CameraResizeMethod::kNearestNeighbor;
+  }
+  return fmt.resize;
+}
+
+template <typename Writer>
+Target* MakeTarget(const CameraFrameFormat& fmt, const Plan& plan, int bpp,
+                   SensorRow* row, int window, const Writer& writer,
+                   Workspace* workspace) {
+  switch (EffectiveResize(fmt, plan)) {
+    case CameraResizeMethod::kBilinear:
+      return New<BilinearTarget<Writer>>(workspace, fmt, plan, bpp, row,
+                                         window, writer, workspace);
+    case CameraResizeMethod::kArea:
+      return New<AreaTarget<Writer>>(workspace, fmt, plan, bpp, row, window,
+                                     writer, workspace);
+    case CameraResizeMethod::kNearestNeighbor:
+    default:
+      return New<NearestTarget<Writer>>(workspace, fmt, plan, bpp, row,
+                                        window, writer, workspace);
+  }
+}
+
+// Returns the target for one level of a pyramid, which always resamples
+// whole rows so that it can feed the next level.
+template <typename Writer>
+ResizeTarget* MakeLevel(const CameraFrameFormat& fmt, const Plan& plan,
+                        int bpp, SensorRow* row, int window,
+                        const Writer& writer, Workspace* workspace) {
+  switch (EffectiveResize(fmt, plan)) {
+    case CameraResizeMethod::kBilinear:
+      return New<BilinearTarget<Writer>>(workspace, fmt, plan, bpp, row,
+                                         window, writer, workspace);
+    case CameraResizeMethod::kArea:
+      return New<AreaTarget<Writer>>(workspace, fmt, plan, bpp, row, window,
+                                     writer, workspace);
+    case CameraResizeMethod::kNearestNeighbor:
+    default:
+      return New<NearestRowTarget<Writer>>(workspace, fmt, plan, bpp, row,
+                                           window, writer, workspace);
+  }
+}
+
+// Rewrites `pixels` RGB pixels in place with `writer`.
+template <typename Writer>
+void Rewrite(const Writer& writer, uint8_t* rgb, int pixels) {
+  for (int i = 0; i < pixels; ++i, rgb += 3) {
+    writer.Write(rgb, rgb[0], rgb[1], rgb[2]);
+  }
+}
+
+// White balance of one frame. Outputs are written with the gains from the
+// previous frames if there are any; the first frame has to be balanced with
+// its own gains, which takes a second pass over each output (and delays any
+// tensor quantization to that pass). The statistics of the first balanced
+// output that covers the whole sensor update the gains for the next frame;
+// those of a crop would steer the gains of every other output toward the
+// colors of the crop.
+class FrameBalance {
+ public:
+  explicit FrameBalance(const WhiteBalance* white_balance)
+      : enabled_(white_balance != nullptr),
+        has_gains_(enabled_ && white_balance->valid()),
+        gains_(has_gains_ ? white_balance->gains() : WhiteBalance::Gains()) {}
+
+  // Returns true if `fmt` is to be white balanced.
+  bool Applies(const CameraFrameFormat& fmt) const {
+    return enabled_ && fmt.white_balance && fmt.fmt == CameraFormat::kRgb;
+  }
+
+  // Calls `f` with the writer for `fmt`.
+  template <typename F>
+  void WithWriter(const CameraFrameFormat& fmt, F&& f) const {
+    const bool balanced = Applies(fmt);
+    // Outputs balanced by `Finish()` are quantized there too.
+    uint8_t lut[256];
+    const bool quantized = fmt.tensor && (!balanced || has_gains_);
+    if (quantized) MakeTensorLut(fmt, lut);
+    camera::WithWriter(fmt, balanced && has_gains_ ? &gains_ : nullptr,
+                       quantized ? lut : nullptr, f);
+  }
+
+  // Completes a balanced output, given the statistics of its window and
+  // whether that window is the whole sensor.
+  void Finish(const AwbStats& stats, bool full_sensor,
+              const CameraFrameFormat& fmt) {
+    if (full_sensor && !has_stats_) {
+      stats_ = stats;
+      has_stats_ = true;
+    }
+    if (has_gains_) {
+      return;
+    }
+    const BalancedRgbWriter writer{
+        WhiteBalance::FrameGains(stats.r_sum, stats.g_sum, stats.b_sum)};
+    const int pixels = fmt.width * fmt.height;
+    if (fmt.tensor) {
+      uint8_t lut[256];
+      MakeTensorLut(fmt, lut);
+      Rewrite(TensorWriter<BalancedRgbWriter>(writer, lut), fmt.buffer,
+              pixels);
+    } else {
+      Rewrite(writer, fmt.buffer, pixels);
+    }
+  }
+
+  // Moves `white_balance` toward this frame's gains.
+  void Update(WhiteBalance* white_balance) const {
+    if (white_balance && has_stats_) {
+      white_balance->Update(stats_.r_sum, stats_.g_sum, stats_.b_sum);
+    }
+  }
+
+ private:
+  bool enabled_;
+  bool has_gains_;
+  WhiteBalance::Gains gains_;
+  bool has_stats_ = false;
+  AwbStats stats_;
+};
+
+bool IsConvertible(const CameraFrameFormat& fmt) {
+  return fmt.fmt == CameraFormat::kRgb || fmt.fmt == CameraFormat::kY8;
+}
+
+// Validates `fmt` and works out where each sensor pixel goes.
+bool MakePlan(const CameraFrameFormat& fmt, Plan* plan, int* bpp) {
+  if (!fmt.buffer || fmt.width <= 0 || fmt.height <= 0) {
+    return false;
+  }
+  if (!IsConvertible(fmt)) {
+    return false;
+  }
+  CameraRect roi = fmt.roi;
+  if (roi.width <= 0 || roi.height <= 0) {
+    roi = {0, 0, kRawWidth, kRawHeight};
+  } else if (roi.x < 0 || roi.y < 0 || roi.x + roi.width > kRawWidth ||
+             roi.y + roi.height > kRawHeight) {
+    return false;
+  }
+  *bpp = CameraFormatBpp(fmt.fmt);
+  *plan = MakePlan(fmt, roi, *bpp);
+  return plan->inner.scaled > 0 && plan->outer.scaled > 0;
+}
+
+// Returns true if converting `fmts` in one pass over the sensor rows saves
+// work over converting each on its own. That is the case when two of them
+// demosaic the same window with the same filter, whatever their resize
+// methods, or when more than one is resampled from a row cache.
+//
+// Only the windows of the first `kMaxSources` formats are remembered, which
+// covers any sensible request; later formats are only compared with those.
+bool IsWorthSharing(const CameraFrameFormat* fmts, size_t count) {
+  constexpr size_t kMaxSources = 8;
+  struct Source {
+    CameraFilterMethod filter;
+    int x_begin;
+    int x_end;
+    int y_begin;
+    int y_end;
+  };
+  Source sources[kMaxSources];
+  size_t source_count = 0;
+  int resampled = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const CameraFrameFormat& fmt = fmts[i];
+    Plan plan;
+    int bpp;
+    if (!MakePlan(fmt, &plan, &bpp)) continue;
+    if (EffectiveResize(fmt, plan) != CameraResizeMethod::kNearestNeighbor) {
+      ++resampled;
+    }
+    const Source source{fmt.filter, plan.x_begin, plan.x_end, plan.y_begin,
+                        plan.y_end};
+    for (size_t j = 0; j < source_count; ++j) {
+      const Source& other = sources[j];
+      if (other.filter == source.filter &&
+          other.x_begin == source.x_begin && other.x_end == source.x_end &&
+          other.y_begin == source.y_begin && other.y_end == source.y_end) {
+        return true;
+      }
+    }
+    if (source_count < kMaxSources) sources[source_count++] = source;
+  }
+  return resampled > 1;
+}
+
+// Converts every RGB and Y8 format in one pass over the sensor rows. Formats
+// that use the same demosaic filter share the demosaiced pixels, and those
+// that also cover the same window share the white balance statistics.
+bool ConvertShared(const uint8_t* raw, const CameraFrameFormat* fmts,
+                   size_t count, FrameBalance* balance, Workspace* workspace) {
+  bool ret = true;
+  SensorRow* rows[2] = {};
+  StatsWindow* windows = NewArray<StatsWindow>(workspace, count);
+  size_t window_count = 0;
+  Target** targets = NewArray<Target*>(workspace, count);
+  size_t target_count = 0;
+  int y_begin = kRawHeight;
+  int y_end = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const CameraFrameFormat& fmt = fmts[i];
+    if (!IsConvertible(fmt)) continue;
+    Plan plan;
+    int bpp;
+    if (!MakePlan(fmt, &plan, &bpp)) {
+      ret = false;
+      continue;
+    }
+
+    SensorRow*& row =
+        rows[fmt.filter == CameraFilterMethod::kBilinear ? 0 : 1];
+    if (!row) row = New<SensorRow>(workspace, raw, fmt.filter);
+    int window = -1;
+    if (balance->Applies(fmt)) {
+      for (size_t w = 0; w < window_count; ++w) {
+        if (windows[w].Matches(row, plan)) window = w;
+      }
+      if (window < 0) {
+        window = window_count++;
+        windows[window] = {row,
+                           plan.x_begin,
+                           plan.x_end,
+                           std::max(kFirstRow, plan.y_begin),
+                           std::min(kEndRow, plan.y_end),
+                           AwbStats()};
+        row->AddDense(plan.x_begin, plan.x_end);
+      }
+    }
+    balance->WithWriter(fmt, [&](const auto& writer) {
+      targets[target_count++] =
+          MakeTarget(fmt, plan, bpp, row, window, writer, workspace);
+    });
+    y_begin = std::min(y_begin, plan.y_begin);
+    y_end = std::max(y_end, plan.y_end);
+  }
+
+  for (int y = y_begin; y < y_end; ++y) {
+    for (SensorRow* row : rows) {
+      if (row) row->Start(y);
+    }
+    for (size_t w = 0; w < window_count; ++w) windows[w].AddRow(y);
+    for (size_t t = 0; t < target_count; ++t) targets[t]->AddRow(y);
+  }
+
+  for (size_t t = 0; t < target_count; ++t) {
+    const Target* target = targets[t];
+    if (target->window() < 0) continue;
+    balance->Finish(windows[target->window()].stats,
+                    CoversSensor(target->plan()), target->fmt());
+  }
+  return ret;
+}
+
+// Converts a single format, on the fast path if it is nearest-neighbor.
+bool ConvertFormat(const uint8_t* raw, const CameraFrameFormat& fmt,
+                   FrameBalance* balance, Workspace* workspace) {
+  Plan plan;
+  int bpp;
+  if (!MakePlan(fmt, &plan, &bpp)) {
+    return false;
+  }
+  if (EffectiveResize(fmt, plan) != CameraResizeMethod::kNearestNeighbor) {
+    return ConvertShared(raw, &fmt, 1, balance, workspace);
+  }
+
+  uint16_t inner_first[kMaxRawDim + 1];
+  MakeInnerFirst(plan, inner_first);
+  AwbStats stats;
+  const bool balanced = balance->Applies(fmt);
+  AwbStats* stats_ptr = balanced ? &stats : nullptr;
+  balance->WithWriter(fmt, [&](const auto& writer) {
+    ClearUncovered(fmt, plan, bpp, BlackByte(writer));
+    ConvertRows(raw, fmt.filter, plan, inner_first, writer, fmt.buffer,
+                stats_ptr);
+  });
+  if (balanced) {
+    balance->Finish(stats, CoversSensor(plan), fmt);
+  }
+  return true;
+}
+
+// Converts a pyramid in one pass over the sensor rows. Only the first level
+// reads the window; each later level is resampled from the rows of the level
+// before it as they are written. Every level shares the statistics of the
+// window.
+bool ConvertPyramid(const uint8_t* raw, const CameraFrameFormat* levels,
+                    size_t count, FrameBalance* balance,
+                    Workspace* workspace) {
+  if (count == 0) {
+    return true;
+  }
+  Plan first_plan;
+  int bpp;
+  if (!MakePlan(levels[0], &first_plan, &bpp)) {
+    return false;
+  }
+  const CameraRect roi{first_plan.x_begin, first_plan.y_begin,
+                       first_plan.x_end - first_plan.x_begin,
+                       first_plan.y_end - first_plan.y_begin};
+
+  // Every level is checked before any is written.
+  Plan* plans = NewArray<Plan>(workspace, count);
+  for (size_t i = 0; i < count; ++i) {
+    const CameraFrameFormat& fmt = levels[i];
+    if (!fmt.buffer || fmt.width <= 0 || fmt.height <= 0 ||
+        !IsConvertible(fmt)) {
+      return false;
+    }
+    Plan& plan = plans[i];
+    plan = MakePlan(fmt, roi, CameraFormatBpp(fmt.fmt));
+    if (plan.inner.scaled <= 0 || plan.outer.scaled <= 0) {
+      return false;
+    }
+    if (i > 0) {
+      // Levels only ever shrink, so each has all the detail it needs.
+      const Plan& parent = plans[i - 1];
+      if (plan.inner.scaled > parent.inner.scaled ||
+          plan.outer.scaled > parent.outer.scaled) {
+        return false;
+      }
+      plan.inner.source = parent.inner.scaled;
+      plan.outer.source = parent.outer.scaled;
+    }
+  }
+
+  SensorRow* row = New<SensorRow>(workspace, raw, levels[0].filter);
+  StatsWindow window{row,
+                     first_plan.x_begin,
+                     first_plan.x_end,
+                     std::max(kFirstRow, first_plan.y_begin),
+                     std::min(kEndRow, first_plan.y_end),
+                     AwbStats()};
+  bool balanced = false;
+  ResizeTarget** targets = NewArray<ResizeTarget*>(workspace, count);
+  for (size_t i = 0; i < count; ++i) {
+    const CameraFrameFormat& fmt = levels[i];
+    const bool applies = balance->Applies(fmt);
+    balanced |= applies;
+    balance->WithWriter(fmt, [&](const auto& writer) {
+      targets[i] = MakeLevel(fmt, plans[i], CameraFormatBpp(fmt.fmt),
+                             i == 0 ? row : nullptr, applies ? 0 : -1, writer,
+                             workspace);
+    });
+    if (i > 0) targets[i - 1]->Feed(targets[i], workspace);
+  }
+
+  for (int y = first_plan.y_begin; y < first_plan.y_end; ++y) {
+    row->Start(y);
+    if (balanced) window.AddRow(y);
+    targets[0]->AddRow(y);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (targets[i]->window() < 0) continue;
+    balance->Finish(window.stats, CoversSensor(first_plan),
+                    targets[i]->fmt());
+  }
+  return true;
+}
+}  // namespace
+
+Workspace::Workspace(size_t size)
+    : buffer_(size ? std::make_unique<uint8_t[]>(size) : nullptr),
+      size_(size) {}
+
+Workspace::~Workspace() = default;
+
+void* Workspace::Allocate(size_t size, size_t alignment) {
+  const uintptr_t base = reinterpret_cast<uintptr_t>(buffer_.get());
+  const uintptr_t aligned = (base + used_ + alignment - 1) & ~(alignment - 1);
+  const size_t end = aligned - base + size;
+  if (buffer_ && end <= size_) {
+    needed_ += end - used_;
+    used_ = end;
+    return reinterpret_cast<void*>(aligned);
+  }
+  // Out of room: this conversion takes the rest from the heap.
+  overflow_.push_back(std::make_unique<uint8_t[]>(size + alignment - 1));
+  needed_ += size + alignment - 1;
+  const uintptr_t block = reinterpret_cast<uintptr_t>(overflow_.back().get());
+  return reinterpret_cast<void*>((block + alignment - 1) & ~(alignment - 1));
+}
+
+void Workspace::Reset() {
+  peak_ = std::max(peak_, needed_);
+  // Keeps growing from the heap if the workspace started empty, which is
+  // what conversions without a workspace use.
+  if (!overflow_.empty() && size_ > 0) {
+    overflow_.clear();
+    buffer_.reset();
+    buffer_ = std::make_unique<uint8_t[]>(peak_);
+    size_ = peak_;
+  }
+  overflow_.clear();
+  used_ = 0;
+  needed_ = 0;
+}
+
+WhiteBalance::Gains WhiteBalance::FrameGains(uint32_t r_sum, uint32_t g_sum,
+                                             uint32_t b_sum) {
+  float r_sum_f = static_cast<float>(r_sum);
+  float g_sum_f = static_cast<float>(g_sum);
+  float b_sum_f = static_cast<float>(b_sum);
+  float max_channel = std::max(r_sum_f, std::max(g_sum_f, b_sum_f));
+  float epsilon = 0.1;
+  float r_gain_f = r_sum_f < epsilon ? 0.0f : max_channel / r_sum_f;
+  float g_gain_f = g_sum_f < epsilon ? 0.0f : max_channel / g_sum_f;
+  float b_gain_f = b_sum_f < epsilon ? 0.0f : max_channel / b_sum_f;
+  return {ToFixedGain(r_gain_f), ToFixedGain(g_gain_f), ToFixedGain(b_gain_f)};
+}
+
+void WhiteBalance::set_rate(float rate) {
+  rate_ = std::min(1.0f, std::max(kMinRate, rate));
+}
+
+WhiteBalance::Gains WhiteBalance::gains() const {
+  return {ToFixedGain(gains_[0]), ToFixedGain(gains_[1]),
+          ToFixedGain(gains_[2])};
+}
+
+void WhiteBalance::Update(uint32_t r_sum, uint32_t g_sum, uint32_t b_sum) {
+  // A frame missing a channel (such as a black one) says nothing about the
+  // light, and would drag the gains to zero.
+  if (r_sum == 0 || g_sum == 0 || b_sum == 0) {
+    return;
+  }
+  const float max_channel = std::max(r_sum, std::max(g_sum, b_sum));
+  const float target[3] = {max_channel / r_sum, max_channel / g_sum,
+                           max_channel / b_sum};
+  for (int c = 0; c < 3; ++c) {
+    gains_[c] = valid_ ? gains_[c] + rate_ * (target[c] - gains_[c])
+                       : target[c];
+  }
+  valid_ = true;
+}
+
+uint32_t WhiteBalance::ToFixedGain(float gain) {
+  return static_cast<uint16_t>(std::min(gain * (1 << 8), 65535.0f));
+}
+
+bool ConvertBayer(const uint8_t* raw, const CameraFrameFormat& fmt,
+                  WhiteBalance* white_balance, Workspace* workspace) {
+  CameraFrameFormat resolved = fmt;
+  if (!raw || !ResolveTensor(&resolved)) {
+    return false;
+  }
+  Workspace local(0);
+  if (!workspace) workspace = &local;
+  WorkspaceScope scope(workspace);
+  FrameBalance balance(white_balance);
+  if (!ConvertFormat(raw, resolved, &balance, workspace)) {
+    return false;
+  }
+  balance.Update(white_balance);
+  return true;
+}
+
+bool ConvertBayer(const uint8_t* raw,
+                  const std::vector<CameraFrameFormat>& fmts,
+                  WhiteBalance* white_balance, Workspace* workspace) {
+  if (!raw) {
+    return false;
+  }
+  Workspace local(0);
+  if (!workspace) workspace = &local;
+  WorkspaceScope scope(workspace);
+
+  // Tensor outputs are written straight into their tensors.
+  const size_t count = fmts.size();
+  const CameraFrameFormat* outputs = fmts.data();
+  if (std::any_of(fmts.begin(), fmts.end(),
+                  [](const auto& fmt) { return fmt.tensor != nullptr; })) {
+    auto* resolved = NewArray<CameraFrameFormat>(workspace, count);
+    for (size_t i = 0; i < count; ++i) {
+      resolved[i] = fmts[i];
+      // A format without a buffer fails to convert.
+      if (!ResolveTensor(&resolved[i])) resolved[i].buffer = nullptr;
+    }
+    outputs = resolved;
+  }
+
+  FrameBalance balance(white_balance);
+  bool ret = true;
+  if (IsWorthSharing(outputs, count)) {
+    ret = ConvertShared(raw, outputs, count, &balance, workspace);
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      if (IsConvertible(outputs[i])) {
+        ret &= ConvertFormat(raw, outputs[i], &balance, workspace);
+      }
+    }
+  }
+  balance.Update(white_balance);
+  return ret;
+}
+
+bool ConvertPyramid(const uint8_t* raw,
+                    const std::vector<CameraFrameFormat>& levels,
+                    WhiteBalance* white_balance, Workspace* workspace) {
+  if (!raw) {
+    return false;
+  }
+  Workspace local(0);
+  if (!workspace) workspace = &local;
+  WorkspaceScope scope(workspace);
+  auto* resolved = NewArray<CameraFrameFormat>(workspace, levels.size());
+  for (size_t i = 0; i < levels.size(); ++i) {
+    resolved[i] = levels[i];
+    if (!ResolveTensor(&resolved[i])) {
+      return false;
+    }
+  }
+  FrameBalance balance(white_balance);
+  if (!ConvertPyramid(raw, resolved, levels.size(), &balance, workspace)) {
+    return false;
+  }
+  balance.Update(white_balance);
+  return true;
+}
+
+}  // namespace camera
+
+int CameraFormatBpp(CameraFormat fmt) {
+  switch (fmt) {
+    case CameraFormat::kRgb:
+      return 3;
+    case CameraFormat::kRaw:
+    case CameraFormat::kY8:
+      return 1;
+  }
+  return 0;
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_CAMERA_CAMERA_PIPELINE_H_
+#define LIBS_CAMERA_CAMERA_PIPELINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "libs/camera/camera_format.h"
+
+namespace coralmicro {
+namespace camera {
+
+// Auto white balance gains carried from one frame to the next.
+//
+// Each white balanced conversion gathers the channel sums of its window while
+// demosaicing, and writes the pixels with the gains of the previous frames,
+// so the output is only written once. The gains follow the scene with an
+// exponential moving average, which also keeps them from flickering between
+// frames. Until a frame has set them, outputs are balanced with the gains of
+// their own frame instead, as a second pass.
+//
+// Only outputs of the whole sensor update the gains, so a crop is balanced
+// like the rest of the frame rather than for its own colors.
+//
+// This class is not thread-safe.
+class WhiteBalance {
+ public:
+  // Per-channel gains, in 8.8 fixed point.
+  struct Gains {
+    uint32_t r;
+    uint32_t g;
+    uint32_t b;
+  };
+
+  // Default for `set_rate()`.
+  static constexpr float kDefaultRate = 0.25f;
+  // Smallest rate accepted by `set_rate()`.
+  static constexpr float kMinRate = 0.01f;
+
+  explicit WhiteBalance(float rate = kDefaultRate) { set_rate(rate); }
+
+  // Sets how fast the gains converge: each frame moves them this fraction of
+  // the way to the gains that balance it, from `kMinRate` to 1 (which
+  // follows the previous frame only).
+  void set_rate(float rate);
+  float rate() const { return rate_; }
+
+  // Forgets the gains, so the next frame is balanced with its own.
+  void Reset() { valid_ = false; }
+
+  // Returns true once a frame has set the gains.
+  bool valid() const { return valid_; }
+
+  // Returns the current gains.
+  Gains gains() const;
+
+  // Moves the gains toward those that balance the given channel sums. Sums
+  // missing a channel are ignored.
+  void Update(uint32_t r_sum, uint32_t g_sum, uint32_t b_sum);
+
+  // Returns the gains that balance the given channel sums on their own.
+  static Gains FrameGains(uint32_t r_sum, uint32_t g_sum, uint32_t b_sum);
+
+ private:
+  static uint32_t ToFixedGain(float gain);
+
+  float rate_;
+  bool valid_ = false;
+  float gains_[3] = {};
+};
+
+// Scratch memory for the conversions below: the demosaiced sensor rows, the
+// resize taps and row buffers, and the bookkeeping of each output.
+//
+// A conversion takes all it needs from the workspace and gives it back when
+// it returns. If a conversion needs more than the workspace holds, the rest
+// comes from the heap, and the workspace grows to fit before the next one, so
+// converting the same formats frame after frame allocates nothing once the
+// first frame is through.
+//
+// This class is not thread-safe; a workspace serves one conversion at a time.
+class Workspace {
+ public:
+  // Default size, enough for a few outputs up to the size of the sensor.
+  static constexpr size_t kDefaultSize = 32 * 1024;
+
+  // @param size Bytes to allocate up front. A workspace of size 0 allocates
+  //   everything from the heap, as conversions without a workspace do.
+  explicit Workspace(size_t size = kDefaultSize);
+  ~Workspace();
+  Workspace(const Workspace&) = delete;
+  Workspace& operator=(const Workspace&) = delete;
+
+  // Bytes the workspace holds.
+  size_t size() const { return size_; }
+  // Most bytes any conversion has needed, alignment padding included.
+  size_t peak() const { return peak_; }
+
+  // @cond Do not generate docs
+  // Returns `size` bytes aligned to `alignment`, a power of two, which stay
+  // valid until `Reset()`.
+  void* Allocate(size_t size, size_t alignment);
+  // Gives back everything allocated, and grows the workspace to fit if the
+  // heap had to be used.
+  void Reset();
+  // @endcond
+
+ private:
+  std::unique_ptr<uint8_t[]> buffer_;
+  size_t size_;
+  size_t used_ = 0;
+  // Bytes allocated since `Reset()`, in the buffer and on the heap.
+  size_t needed_ = 0;
+  size_t peak_ = 0;
+  std::vector<std::unique_ptr<uint8_t[]>> overflow_;
+};
+
+// Converts one raw Bayer frame from the sensor into `fmt.buffer`.
+//
+// Demosaicing, rotation, resizing and the white balance statistics are done
+// in a single streaming pass over the raw frame, writing straight into the
+// caller's buffer. No intermediate frame is allocated.
+//
+// @param raw The raw frame, `CameraTask::kWidth` x `CameraTask::kHeight`.
+// @param fmt The output format. Only `kRgb` and `kY8` are supported. If it
+//   has a `tensor`, the image is quantized into the tensor instead.
+// @param white_balance The white balance state to apply if
+//   `fmt.white_balance` is set (it only applies to `kRgb`), and to update if
+//   `fmt` also covers the whole sensor, or nullptr to skip white balancing.
+// @param workspace The scratch memory to convert in, or nullptr to allocate
+//   it for this call only.
+// @return True on success, false if `fmt` cannot be produced.
+bool ConvertBayer(const uint8_t* raw, const CameraFrameFormat& fmt,
+                  WhiteBalance* white_balance,
+                  Workspace* workspace = nullptr);
+
+// Converts one raw Bayer frame into every `kRgb` and `kY8` format in `fmts`.
+// Other formats are skipped.
+//
+// When two formats demosaic the same sensor window with the same filter, or
+// more than one is resized with bilinear or area sampling, all formats are
+// produced in one pass over the raw frame: formats with the same demosaic
+// filter share the demosaiced pixels, and those that also cover the same
+// sensor window share the white balance statistics. Otherwise each format is
+// converted on its own, which is faster for a single nearest-neighbor format.
+//
+// @param raw The raw frame, `CameraTask::kWidth` x `CameraTask::kHeight`.
+// @param fmts The output formats.
+// @param white_balance The white balance state, or nullptr to skip white
+//   balancing for every format. Every balanced format is written with the
+//   same gains, and the state is updated once, from the first of them that
+//   covers the whole sensor.
+// @param workspace The scratch memory to convert in, or nullptr to allocate
+//   it for this call only.
+// @return True if every format was produced, false otherwise.
+bool ConvertBayer(const uint8_t* raw,
+                  const std::vector<CameraFrameFormat>& fmts,
+                  WhiteBalance* white_balance,
+                  Workspace* workspace = nullptr);
+
+// Converts one raw Bayer frame into an image pyramid, in one pass over the raw
+// frame.
+//
+// `levels[0]` is resampled from the sensor window like any other format, and
+// each later level from the image of the level before it, as its rows are
+// written, so the frame is demosaiced once and each level reads a smaller
+// image than the last. Later levels may differ slightly from converting the
+// same format on its own, as with any pyramid.
+//
+// @param raw The raw frame, `CameraTask::kWidth` x `CameraTask::kHeight`.
+// @param levels The levels, largest first. Each must be `kRgb` or `kY8`, and
+//   no larger than the previous level's image (excluding letterboxing) in
+//   either dimension. The demosaic filter and `roi` of the first level apply
+//   to every level; those of later levels are ignored. Levels may differ in
+//   format, rotation, resize method, letterboxing and white balance, and may
+//   have a `tensor`.
+// @param white_balance The white balance state, as for `ConvertBayer()`.
+// @param workspace The scratch memory to convert in, or nullptr to allocate
+//   it for this call only.
+// @return True if every level was produced, false if any level is invalid,
+//   in which case none is written.
+bool ConvertPyramid(const uint8_t* raw,
+                    const std::vector<CameraFrameFormat>& levels,
+                    WhiteBalance* white_balance,
+                    Workspace* workspace = nullptr);
+
+}  // namespace camera
+}  // namespace coralmicro
+
+#endif  // LIBS_CAMERA_CAMERA_PIPELINE_H_
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace coralmicro {
+namespace {
+// Starts each block allocated from the heap, followed by its memory.
+struct alignas(std::max_align_t) HeapBlock {
+  HeapBlock* previous;
+};
+}  // namespace
+
+void* EdgeTpuArena::Allocate(size_t size, size_t alignment) {
+  if (on_heap()) {
+    if (alignment > alignof(HeapBlock) ||
+        size > SIZE_MAX - sizeof(HeapBlock)) {
+      return nullptr;
+    }
+    auto* block = static_cast<HeapBlock*>(malloc(sizeof(HeapBlock) + size));
+    if (!block) {
+      return nullptr;
+    }
+    block->previous = static_cast<HeapBlock*>(last_block_);
+    last_block_ = block;
+    used_ += size;
+    peak_ = std::max(peak_, used_);
+    return block + 1;
+  }
+
+  const auto begin = reinterpret_cast<uintptr_t>(buffer_);
+  const uintptr_t start = (begin + used_ + alignment - 1) & ~(alignment - 1);
+  if (start - begin > size_ || size > size_ - (start - begin)) {
+    return nullptr;
+  }
+  used_ = start - begin + size;
+  peak_ = std::max(peak_, used_);
+  return reinterpret_cast<void*>(start);
+}
+
+void EdgeTpuArena::Release(const Mark& mark) {
+  while (last_block_ != mark.last_block) {
+    auto* block = static_cast<HeapBlock*>(last_block_);
+    last_block_ = block->previous;
+    free(block);
+  }
+  used_ = mark.used;
+}
+
+}  // namespace coralmicro
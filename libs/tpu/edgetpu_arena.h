@@ -0,0 +1,104 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_ARENA_H_
+#define LIBS_TPU_EDGETPU_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace coralmicro {
+
+// @cond Do not generate docs
+// Memory the state of registered Edge TPU packages is allocated from.
+//
+// An arena over a buffer hands out memory from the start of the buffer
+// onwards, and takes it back by rolling back to an earlier mark. An arena
+// without a buffer allocates each block from the heap instead, and frees the
+// blocks allocated after a mark when rolled back to it, or when destroyed.
+//
+// Objects in an arena are never destroyed, so they must not own memory
+// outside of it.
+class EdgeTpuArena {
+ public:
+  // Everything allocated up to a point, from `mark()`.
+  struct Mark {
+    size_t used;
+    void* last_block;
+  };
+
+  EdgeTpuArena() = default;
+  EdgeTpuArena(uint8_t* buffer, size_t size) : buffer_(buffer), size_(size) {}
+  ~EdgeTpuArena() { Release({0, nullptr}); }
+  EdgeTpuArena(const EdgeTpuArena&) = delete;
+  EdgeTpuArena& operator=(const EdgeTpuArena&) = delete;
+
+  // Returns `size` bytes aligned to `alignment`, a power of two, or nullptr
+  // if the arena is full.
+  void* Allocate(size_t size, size_t alignment);
+
+  // Constructs a T in the arena, or returns nullptr if the arena is full.
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Objects in an arena are never destroyed");
+    void* memory = Allocate(sizeof(T), alignof(T));
+    return memory ? new (memory) T(std::forward<Args>(args)...) : nullptr;
+  }
+
+  // Allocates `count` value-initialized T, or returns nullptr if the arena is
+  // full.
+  template <typename T>
+  T* NewArray(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Objects in an arena are never destroyed");
+    if (count > SIZE_MAX / sizeof(T)) return nullptr;
+    auto* array = static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+    if (array) {
+      for (size_t i = 0; i < count; ++i) new (&array[i]) T();
+    }
+    return array;
+  }
+
+  Mark mark() const { return {used_, last_block_}; }
+  // Frees everything allocated since `mark`.
+  void Release(const Mark& mark);
+
+  // Returns true if the arena allocates from the heap.
+  bool on_heap() const { return buffer_ == nullptr; }
+  // Size of the buffer, or 0 if the arena allocates from the heap.
+  size_t size() const { return size_; }
+  // Bytes allocated, and the most ever allocated at once, alignment padding
+  // included.
+  size_t used() const { return used_; }
+  size_t peak() const { return peak_; }
+
+ private:
+  uint8_t* buffer_ = nullptr;
+  size_t size_ = 0;
+  size_t used_ = 0;
+  size_t peak_ = 0;
+  // The heap block allocated last, which starts a list of all of them.
+  void* last_block_ = nullptr;
+};
+// @endcond
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_ARENA_H_
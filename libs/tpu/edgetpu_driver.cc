@@ -17,39 +17,76 @@
 #include "libs/tpu/edgetpu_driver.h"
 
 #include <cassert>
+#include <cstring>
 
 #include "libs/base/check.h"
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/config/beagle_csr_helper.h"
 #include "libs/tpu/darwinn/driver/config/common_csr_helper.h"
-#include "third_party/freertos_kernel/include/FreeRTOS.h"
-#include "third_party/freertos_kernel/include/semphr.h"
-#include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
-#include "third_party/nxp/rt1176-sdk/middleware/usb/include/usb_spec.h"
 
 namespace coralmicro {
 namespace {
-constexpr uint8_t kSingleBulkOutEndpoint = 1;
-constexpr uint8_t kEventInEndpoint = 2;
-constexpr uint8_t kInterruptInEndpoint = 3;
-constexpr uint32_t kMaxBulkBufferSize = 32 * 1024;
-uint8_t BulkTransferBuffer[kMaxBulkBufferSize];
-
-struct UsbTransferMetadata {
-  SemaphoreHandle_t sema;
-  usb_status_t status;
-  size_t bytes_transferred;
-};
+// Time a transfer has to complete once it is at the head of its pipe.
+constexpr uint32_t kTransferTimeoutMs = 200;
+// Time a CSR polled for a state change has to reach it, not counting the
+// reads, and the pause between reads.
+constexpr uint32_t kCsrPollTimeoutUs = 100 * 1000;
+constexpr uint32_t kCsrPollIntervalUs = 100;
+
+// Bulk transfers are split into chunks, and up to kBulkSlotCount chunks are
+// queued on the transport at once, so that the host controller moves straight
+// on to the next chunk instead of idling while the previous one is completed
+// and the next one is set up. A chunk fits in one EHCI transfer descriptor.
+constexpr int kBulkSlotCount = 4;
+constexpr uint32_t kBulkChunkSize = 8 * 1024;
+
+// The bounce buffer of each slot. The host controller driver cleans and
+// invalidates the cache around each transfer, so the buffers are cache line
+// aligned to keep that from touching anything else.
+alignas(32) uint8_t bulk_buffers[kBulkSlotCount][kBulkChunkSize];
+
+// CSR accesses are queued on the control pipe the same way, so a run of
+// writes doesn't wait for each one in turn. A control transfer takes three of
+// the eight EHCI transfer descriptors, so only two are queued at once.
+constexpr int kCsrSlotCount = 2;
+// The register value of each slot, a cache line each as for bulk_buffers.
+alignas(32) uint8_t csr_buffers[kCsrSlotCount][32];
+
+// Reads of the event the device sends at the end of each inference are
+// queued on the event pipe, so the next inference can start before the event
+// of the previous one is in.
+constexpr int kEventSlotCount = 2;
+constexpr uint32_t kEventSizeBytes = 16;
+// The event of each slot, a cache line each as for bulk_buffers.
+alignas(32) uint8_t event_buffers[kEventSlotCount][32];
+
+// Copies `length` bytes from `src` to `dest`, XORing each 32-bit word with
+// `mask`. `dest` is word aligned; `src` need not be.
+void CopyWithMask(uint8_t *dest, const uint8_t *src, uint32_t length,
+                  uint32_t mask) {
+  auto *dest_words = reinterpret_cast<uint32_t *>(dest);
+  const uint32_t words = length / sizeof(uint32_t);
+  for (uint32_t i = 0; i < words; ++i) {
+    uint32_t word;
+    memcpy(&word, src + i * sizeof(word), sizeof(word));
+    dest_words[i] = word ^ mask;
+  }
+  for (uint32_t i = words * sizeof(uint32_t); i < length; ++i) {
+    dest[i] = src[i] ^ static_cast<uint8_t>(mask >> (8 * (i % 4)));
+  }
+}
 }  // namespace
 
 namespace registers = platforms::darwinn::driver::config::registers;
 
-bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
+bool TpuDriver::Initialize(EdgeTpuTransport *transport,
                            PerformanceMode mode) {
-  if (usb_instance == nullptr) {
+  if (transport == nullptr) {
     return false;
   }
-  usb_instance_ = usb_instance;
+  transport_ = transport;
+  // The chip may have been powered off since the last time.
+  csr_shadow_.clear();
 
   // Check chip id and test write
   uint32_t omc0_00_reg;
@@ -73,35 +110,76 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   scu_ctrl_0.set_rg_pcie_inact_phy_mode(0);
   scu_ctrl_0.set_rg_usb_inact_phy_mode(0);
   CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, scu_ctrl_0.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, &scu_ctrl_0_reg));
 
+  return Reset(mode);
+}
+
+bool TpuDriver::SetPerformanceMode(PerformanceMode mode) {
+  if (transport_ == nullptr || event_head_ != event_tail_) {
+    return false;
+  }
+  if (!DoRunControl(platforms::darwinn::driver::RunControl::kMoveToHalt)) {
+    return false;
+  }
+  return Reset(mode);
+}
+
+bool TpuDriver::PollCsr(uint64_t reg, RegisterSize reg_size,
+                        const std::function<bool(uint64_t)>& done) {
+  for (uint32_t waited = 0;; waited += kCsrPollIntervalUs) {
+    uint64_t value;
+    if (!ReadCsr(reg, reg_size, &value)) return false;
+    if (done(value)) return true;
+    if (waited >= kCsrPollTimeoutUs) return false;
+    transport_->DelayMicros(kCsrPollIntervalUs);
+  }
+}
+
+bool TpuDriver::Reset(PerformanceMode mode) {
   // Disable clock gating
   uint32_t scu_ctrl_2_reg;
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
+  if (!Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg)) {
+    return false;
+  }
   registers::ScuCtrl2 scu_ctrl_2(scu_ctrl_2_reg);
   scu_ctrl_2.set_rg_gated_gcb(0x2);
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
+  if (!Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw())) {
+    return false;
+  }
 
   // Go into reset, if we're not there
   uint32_t scu_ctrl_3_reg;
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
+  if (!Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg)) {
+    return false;
+  }
   registers::ScuCtrl3 scu_ctrl_3(scu_ctrl_3_reg);
   if (scu_ctrl_3.rg_force_sleep() != 0x3) {
     scu_ctrl_3.set_rg_force_sleep(0x3);
-    CHECK(
-        Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
-    do {
-      CHECK(
-          Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-      scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-    } while (scu_ctrl_3.cur_pwr_state() != 0x2);
-    CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0xF));
-    CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0x0));
+    if (!Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3,
+                 scu_ctrl_3.raw()) ||
+        !PollCsr(chip_config_.GetScuCsrOffsets().scu_ctrl_3,
+                 RegisterSize::kRegSize32, [](uint64_t value) {
+                   return registers::ScuCtrl3(value).cur_pwr_state() == 0x2;
+                 })) {
+      return false;
+    }
+    if (!Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0xF) ||
+        !Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0x0)) {
+      return false;
+    }
+    // Reset restores the registers of the core, so the shadow of the values
+    // written before is stale.
+    if (!FlushCsrWrites()) {
+      return false;
+    }
+    csr_shadow_.clear();
   }
 
   // Set performance mode and exit reset.
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
+  if (!ReadCached32(chip_config_.GetScuCsrOffsets().scu_ctrl_3,
+                    &scu_ctrl_3_reg)) {
+    return false;
+  }
   scu_ctrl_3.set_raw(scu_ctrl_3_reg);
   scu_ctrl_3.set_rg_force_sleep(0x2);
   switch (mode) {
@@ -130,143 +208,198 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
           registers::ScuCtrl3::Usb8051Clock::k250MHZ);
       break;
   }
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
-
-  do {
-    CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-    scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-  } while (scu_ctrl_3.cur_pwr_state() != 0x0);
+  if (!Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()) ||
+      !PollCsr(chip_config_.GetScuCsrOffsets().scu_ctrl_3,
+               RegisterSize::kRegSize32, [](uint64_t value) {
+                 return registers::ScuCtrl3(value).cur_pwr_state() == 0x0;
+               })) {
+    return false;
+  }
 
   // Check a known register to verify reset exit.
-  uint64_t scalar_core_run_control;
-  do {
-    CHECK(Read64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
-                 &scalar_core_run_control));
-  } while (scalar_core_run_control != 0);
+  if (!PollCsr(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
+               RegisterSize::kRegSize64,
+               [](uint64_t value) { return value == 0; })) {
+    return false;
+  }
 
   registers::IdleRegister idle_reg;
   idle_reg.set_enable();
   idle_reg.set_counter(1);
-  CHECK(Write64(chip_config_.GetMiscCsrOffsets().idleRegister, idle_reg.raw()));
+  if (!Write64(chip_config_.GetMiscCsrOffsets().idleRegister,
+               idle_reg.raw())) {
+    return false;
+  }
 
   registers::TileConfig<7> tile_config;
   tile_config.set_broadcast();
-  CHECK(Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                tile_config.raw()));
-
-  uint64_t tile_config_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tile_config_reg));
-  } while (tile_config.raw() != tile_config_reg);
+  const uint64_t tile_config_value = tile_config.raw();
+  if (!Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+               tile_config_value) ||
+      !PollCsr(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+               RegisterSize::kRegSize64, [tile_config_value](uint64_t value) {
+                 return value == tile_config_value;
+               })) {
+    return false;
+  }
 
   registers::DeepSleep deep_sleep_reg;
   deep_sleep_reg.set_to_sleep_delay(2);
   deep_sleep_reg.set_to_wake_delay(30);
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().deepSleep,
-                deep_sleep_reg.raw()));
+  if (!Write64(chip_config_.GetTileCsrOffsets().deepSleep,
+               deep_sleep_reg.raw())) {
+    return false;
+  }
 
   // Enable clock gating
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
+  if (!ReadCached32(chip_config_.GetScuCsrOffsets().scu_ctrl_2,
+                    &scu_ctrl_2_reg)) {
+    return false;
+  }
   scu_ctrl_2.set_raw(scu_ctrl_2_reg);
   scu_ctrl_2.set_rg_gated_gcb(1);
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
+  if (!Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw())) {
+    return false;
+  }
 
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().descr_ep, 0xF0));
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().multi_bo_ep, 0));
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().outfeed_chunk_length, 0x20));
+  if (!Write64(chip_config_.GetUsbCsrOffsets().descr_ep, 0xF0) ||
+      !Write64(chip_config_.GetUsbCsrOffsets().multi_bo_ep, 0) ||
+      !Write64(chip_config_.GetUsbCsrOffsets().outfeed_chunk_length, 0x20)) {
+    return false;
+  }
 
   uint32_t omc0_d0_reg, omc0_d8_reg, omc0_dc_reg;
 
   // Enables tempsense clock.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_d0, &omc0_d0_reg));
+  if (!Read32(chip_config_.GetApexCsrOffsets().omc0_d0, &omc0_d0_reg)) {
+    return false;
+  }
   registers::Omc0D0 omc0_d0(omc0_d0_reg);
   omc0_d0.set_clk_en(0x1);
   omc0_d0.set_adr(0xC);
   omc0_d0.set_tref(0);
   omc0_d0.set_tslope(0);
   omc0_d0.set_t_setting(0);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_d0, omc0_d0.raw()));
+  if (!Write32(chip_config_.GetApexCsrOffsets().omc0_d0, omc0_d0.raw())) {
+    return false;
+  }
 
   // Enables tempsense input ports.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_d8, &omc0_d8_reg));
+  if (!Read32(chip_config_.GetApexCsrOffsets().omc0_d8, &omc0_d8_reg)) {
+    return false;
+  }
   registers::Omc0D8 omc0_d8(omc0_d8_reg);
   omc0_d8.set_enbg(0x1);
   omc0_d8.set_envr(0x1);
   omc0_d8.set_enad(0x1);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_d8, omc0_d8.raw()));
+  if (!Write32(chip_config_.GetApexCsrOffsets().omc0_d8, omc0_d8.raw())) {
+    return false;
+  }
 
   // Wait 100 us before enabling tempsense flow.
-  SDK_DelayAtLeastUs(100, CLOCK_GetFreq(kCLOCK_CpuClk));
+  if (!FlushCsrWrites()) {
+    return false;
+  }
+  transport_->DelayMicros(100);
 
   // Enables tempsense flow.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_dc, &omc0_dc_reg));
+  if (!Read32(chip_config_.GetApexCsrOffsets().omc0_dc, &omc0_dc_reg)) {
+    return false;
+  }
   registers::Omc0DC omc0_dc(omc0_dc_reg);
   omc0_dc.set_enthmc(0x1);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_dc, omc0_dc.raw()));
-
-  CHECK(DoRunControl(platforms::darwinn::driver::RunControl::kMoveToRun));
+  if (!Write32(chip_config_.GetApexCsrOffsets().omc0_dc, omc0_dc.raw())) {
+    return false;
+  }
 
-  return true;
+  return DoRunControl(platforms::darwinn::driver::RunControl::kMoveToRun) &&
+         FlushCsrWrites();
 }
 
-bool TpuDriver::CSRTransfer(uint64_t reg, void *data, bool read,
-                            RegisterSize reg_size) {
-  bool ret = false;
-  usb_status_t control_status;
-  usb_setup_struct_t setup_packet;
-  setup_packet.bmRequestType =
-      USB_REQUEST_TYPE_TYPE_VENDOR | USB_REQUEST_TYPE_RECIPIENT_DEVICE;
-  setup_packet.bmRequestType |=
-      read ? USB_REQUEST_TYPE_DIR_IN : USB_REQUEST_TYPE_DIR_OUT;
-  switch (reg_size) {
-    case RegisterSize::kRegSize32:
-      setup_packet.bRequest = 1;
-      setup_packet.wLength = 4;
-      break;
-    case RegisterSize::kRegSize64:
-      setup_packet.bRequest = 0;
-      setup_packet.wLength = 8;
-      break;
+bool TpuDriver::SubmitCsr(uint64_t reg, bool read, RegisterSize reg_size,
+                          uint64_t value) {
+  if (csr_head_ - csr_tail_ == kCsrSlotCount && !WaitCsr()) {
+    return false;
   }
 
-  setup_packet.wValue = 0xFFFF & reg;
-  setup_packet.wIndex = 0xFFFF & (reg >> 16);
+  EdgeTpuControlSetup setup;
+  setup.read = read;
+  setup.request = reg_size == RegisterSize::kRegSize32 ? 1 : 0;
+  setup.length = CsrLength(reg_size);
+  setup.value = 0xFFFF & reg;
+  setup.index = 0xFFFF & (reg >> 16);
 
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
+  uint8_t *buffer = csr_buffers[csr_head_ % kCsrSlotCount];
+  memcpy(buffer, &value, setup.length);
+  if (!transport_->SubmitControl(setup, buffer)) {
+    return false;
+  }
+  ++csr_head_;
+  return true;
+}
 
-  control_status = USB_HostEdgeTpuControl(
-      usb_instance_, &setup_packet, (uint8_t *)data,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
-      },
-      sema);
-  if (control_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuControl failed\r\n");
-    goto exit;
+bool TpuDriver::WaitCsr() {
+  uint32_t transferred;
+  EdgeTpuTransferStatus status = transport_->Wait(
+      EdgeTpuPipe::kControl, kTransferTimeoutMs, &transferred);
+  if (status == EdgeTpuTransferStatus::kTimeout) {
+    printf("%s timed out\r\n", __func__);
+    transport_->Cancel(EdgeTpuPipe::kControl);
+    csr_tail_ = csr_head_;
+    csr_shadow_.clear();
+    return false;
   }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    ret = false;
-    printf("%s didn't get semaphore\r\n", __func__);
-    goto exit;
+  ++csr_tail_;
+  if (status != EdgeTpuTransferStatus::kSuccess) {
+    // Some write may not have reached the chip.
+    csr_shadow_.clear();
+    return false;
   }
+  return true;
+}
 
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
+bool TpuDriver::FlushCsrWrites() {
+  bool ret = true;
+  while (csr_tail_ != csr_head_) {
+    if (!WaitCsr()) {
+      ret = false;
+    }
+  }
   return ret;
 }
 
+bool TpuDriver::ReadCsr(uint64_t reg, RegisterSize reg_size, uint64_t *val) {
+  const int index = csr_head_ % kCsrSlotCount;
+  if (!SubmitCsr(reg, true, reg_size, 0) || !FlushCsrWrites()) {
+    return false;
+  }
+  *val = 0;
+  memcpy(val, csr_buffers[index], CsrLength(reg_size));
+  csr_shadow_[reg] = *val;
+  return true;
+}
+
+bool TpuDriver::WriteCsr(uint64_t reg, RegisterSize reg_size, uint64_t val) {
+  auto it = csr_shadow_.find(reg);
+  if (it != csr_shadow_.end() && it->second == val) {
+    return true;
+  }
+  if (!SubmitCsr(reg, false, reg_size, val)) {
+    csr_shadow_.erase(reg);
+    return false;
+  }
+  csr_shadow_[reg] = val;
+  return true;
+}
+
 bool TpuDriver::SendData(DescriptorTag tag, const uint8_t *data,
-                         uint32_t length) const {
+                         uint32_t length, uint32_t mask) const {
   if (!WriteHeader(tag, length)) {
     printf("WriteHeader failed\r\n");
     return false;
   }
 
-  if (!BulkOutTransfer(data, length)) {
+  if (!BulkOutTransfer(data, length, mask)) {
     printf("BulkOutTransfer failed\r\n");
     return false;
   }
@@ -277,144 +410,150 @@ bool TpuDriver::SendParameters(const uint8_t *data, uint32_t length) const {
   return SendData(DescriptorTag::kParameters, data, length);
 }
 
-bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length) const {
-  return SendData(DescriptorTag::kInputActivations, data, length);
+bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length,
+                           uint32_t mask) const {
+  return SendData(DescriptorTag::kInputActivations, data, length, mask);
 }
 
 bool TpuDriver::SendInstructions(const uint8_t *data, uint32_t length) const {
   return SendData(DescriptorTag::kInstructions, data, length);
 }
 
-bool TpuDriver::GetOutputs(uint8_t *data, uint32_t length) const {
-  return BulkInTransfer(data, length);
+bool TpuDriver::GetOutputs(uint32_t length, const BulkInSink &sink) const {
+  return BulkInTransfer(length, sink);
 }
 
 bool TpuDriver::Read32(uint64_t reg, uint32_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize32);
+  uint64_t value;
+  if (!ReadCsr(reg, RegisterSize::kRegSize32, &value)) {
+    return false;
+  }
+  *val = static_cast<uint32_t>(value);
+  return true;
 }
 
 bool TpuDriver::Read64(uint64_t reg, uint64_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize64);
+  return ReadCsr(reg, RegisterSize::kRegSize64, val);
+}
+
+bool TpuDriver::ReadCached32(uint64_t reg, uint32_t *val) {
+  auto it = csr_shadow_.find(reg);
+  if (it == csr_shadow_.end()) {
+    return Read32(reg, val);
+  }
+  *val = static_cast<uint32_t>(it->second);
+  return true;
 }
 
 bool TpuDriver::Write32(uint64_t reg, uint32_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize32);
+  return WriteCsr(reg, RegisterSize::kRegSize32, val);
 }
 
 bool TpuDriver::Write64(uint64_t reg, uint64_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize64);
+  return WriteCsr(reg, RegisterSize::kRegSize64, val);
 }
 
-ssize_t TpuDriver::BulkOutTransferInternal(uint8_t endpoint,
-                                           const uint8_t *data,
-                                           uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
-  meta.status = kStatus_USB_Error;
-
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkOutSend(
-      usb_instance_, endpoint, (uint8_t *)data, data_length,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
-        meta->bytes_transferred = data_length;
-        meta->status = status;
-        xSemaphoreGive(meta->sema);
-      },
-      &meta);
-
-  if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkOutSend failed\r\n");
-    goto exit;
-  }
-
-  if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    printf("%s didn't get semaphore\r\n", __func__);
-  };
-
-exit:
-  vSemaphoreDelete(meta.sema);
-
-  if (meta.status == kStatus_USB_Success) {
-    return meta.bytes_transferred;
-  } else {
-    return -meta.status;
-  }
-}
+bool TpuDriver::BulkTransfer(EdgeTpuPipe pipe, const uint8_t *out_data,
+                             const BulkInSink *in_sink, uint32_t data_length,
+                             uint32_t out_mask) const {
+  // Chunks on one pipe complete in the order they were queued, so the ring
+  // is filled at `head` and drained at `tail`. `requested` counts the bytes
+  // of every chunk queued so far, less what short chunks did not move, so
+  // the chunks in flight always add up to what is left to transfer.
+  //
+  // Chunks of data to send are handed to the transport in place when the
+  // device can reach them, and only copied through the bounce buffers
+  // otherwise. That is decided chunk by chunk, so a tail the transport can't
+  // take in place, such as one that ends inside a cache line, is the only
+  // part copied. Data received always lands in the bounce buffers: a short
+  // chunk leaves a gap before the chunks queued behind it, which are already
+  // bound to their destination. Data sent with a mask is always copied, as
+  // the mask is applied to the copy. Chunks are a whole number of words, so
+  // every chunk starts on a word of the mask.
+  uint32_t lengths[kBulkSlotCount];
+  int head = 0;
+  int tail = 0;
+  uint32_t requested = 0;
+  uint32_t transferred = 0;
+  bool ret = true;
+  while (transferred < data_length) {
+    for (; head - tail < kBulkSlotCount && requested < data_length; ++head) {
+      uint8_t *buffer = bulk_buffers[head % kBulkSlotCount];
+      const uint32_t length = std::min(kBulkChunkSize, data_length - requested);
+      if (out_data && out_mask == 0 &&
+          transport_->CanSendInPlace(out_data + requested, length)) {
+        // The chunk is read from memory, so whatever the CPU wrote to it
+        // must reach the device first. The caller does not touch it again
+        // until the transfer returns.
+        buffer = const_cast<uint8_t *>(out_data + requested);
+        transport_->FlushForDevice(buffer, length);
+      } else if (out_data && out_mask != 0) {
+        CopyWithMask(buffer, out_data + requested, length, out_mask);
+      } else if (out_data) {
+        memcpy(buffer, out_data + requested, length);
+      }
+      if (!transport_->SubmitBulk(pipe, buffer, length)) {
+        ret = false;
+        break;
+      }
+      lengths[head % kBulkSlotCount] = length;
+      requested += length;
+    }
+    if (!ret || head == tail) {
+      ret = false;
+      break;
+    }
 
-bool TpuDriver::BulkOutTransfer(const uint8_t *data,
-                                uint32_t data_length) const {
-  uint8_t *current_chunk = const_cast<uint8_t *>(data);
-  uint32_t bytes_left = data_length;
-
-  while (bytes_left > 0) {
-    uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
-    memcpy(BulkTransferBuffer, current_chunk, chunk_size);
-    ssize_t bytes_sent = BulkOutTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
-    if (bytes_sent > 0) {
-      current_chunk += bytes_sent;
-      bytes_left -= bytes_sent;
-    } else {
-      printf("Bad BulkOutTransferInternal\r\n");
-      return false;
+    const uint32_t length = lengths[tail % kBulkSlotCount];
+    uint32_t chunk;
+    EdgeTpuTransferStatus status =
+        transport_->Wait(pipe, kTransferTimeoutMs, &chunk);
+    if (status == EdgeTpuTransferStatus::kTimeout) {
+      printf("%s timed out\r\n", __func__);
+      ret = false;
+      break;
+    }
+    if (status != EdgeTpuTransferStatus::kSuccess || chunk == 0) {
+      ++tail;
+      ret = false;
+      break;
+    }
+    if (chunk < length && pipe == EdgeTpuPipe::kBulkOut) {
+      // The chunks queued behind it already hold the data that follows.
+      printf("Short bulk out transfer\r\n");
+      ++tail;
+      ret = false;
+      break;
     }
+    if (in_sink) {
+      (*in_sink)(bulk_buffers[tail % kBulkSlotCount], transferred, chunk);
+    }
+    transferred += chunk;
+    requested -= length - chunk;
+    ++tail;
   }
 
-  return true;
-}
-
-ssize_t TpuDriver::BulkInTransferInternal(uint8_t endpoint, uint8_t *data,
-                                          uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
-  meta.status = kStatus_USB_Error;
-
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, endpoint, data, data_length,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
-        meta->bytes_transferred = data_length;
-        meta->status = status;
-        xSemaphoreGive(meta->sema);
-      },
-      &meta);
-
-  if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkInRecv failed\r\n");
-    goto exit;
+  if (head != tail) {
+    transport_->Cancel(pipe);
   }
+  return ret;
+}
 
-  if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    printf("%s didn't get semaphore\r\n", __func__);
-  };
-
-exit:
-  vSemaphoreDelete(meta.sema);
-
-  if (meta.status == kStatus_USB_Success) {
-    return meta.bytes_transferred;
-  } else {
-    return -meta.status;
+bool TpuDriver::BulkOutTransfer(const uint8_t *data, uint32_t data_length,
+                                uint32_t mask) const {
+  if (!BulkTransfer(EdgeTpuPipe::kBulkOut, data, nullptr, data_length,
+                    mask)) {
+    printf("Bad BulkOutTransfer\r\n");
+    return false;
   }
+  return true;
 }
 
-bool TpuDriver::BulkInTransfer(uint8_t *data, uint32_t data_length) const {
-  uint8_t *current_chunk = data;
-  uint32_t bytes_left = data_length;
-  while (bytes_left > 0) {
-    uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
-    ssize_t bytes_received = BulkInTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
-    if (bytes_received > 0) {
-      memcpy(current_chunk, BulkTransferBuffer, chunk_size);
-      current_chunk += bytes_received;
-      bytes_left -= bytes_received;
-    } else {
-      printf("Bad BulkInTransferInternal\r\n");
-      return false;
-    }
+bool TpuDriver::BulkInTransfer(uint32_t data_length,
+                               const BulkInSink &sink) const {
+  if (!BulkTransfer(EdgeTpuPipe::kBulkIn, nullptr, &sink, data_length, 0)) {
+    printf("Bad BulkInTransfer\r\n");
+    return false;
   }
   return true;
 }
@@ -427,7 +566,7 @@ std::vector<uint8_t> TpuDriver::PrepareHeader(DescriptorTag tag,
   std::fill(header_packet.begin(), header_packet.end(), 0);
   memcpy(header_packet.data(), &length, kLengthSizeInBytes);
 
-  *(header_packet.data() + sizeof(kLengthSizeInBytes)) =
+  *(header_packet.data() + kLengthSizeInBytes) =
       (static_cast<uint8_t>(tag) & 0xF);
 
   return header_packet;
@@ -438,222 +577,113 @@ bool TpuDriver::WriteHeader(DescriptorTag tag, uint32_t length) const {
   return BulkOutTransfer(header_packet.data(), header_packet.size());
 }
 
-bool TpuDriver::ReadEvent() const {
-  bool ret = false;
-  constexpr size_t kEventSizeBytes = 16;
-  uint8_t *buf = (uint8_t *)OSA_MemoryAllocate(kEventSizeBytes);
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, kEventInEndpoint, buf, kEventSizeBytes,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        uint32_t len;
-        uint64_t address;
-        uint8_t tag;
-        memcpy(&address, data, sizeof(address));
-        memcpy(&len, data + sizeof(address), sizeof(len));
-        tag = *(data + sizeof(address) + sizeof(len)) & 0xF;
-        // For now, we don't do anything with these events we've read back.
-        (void)tag;
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
-      },
-      sema);
-  if (bulk_status != kStatus_USB_Success) {
+bool TpuDriver::SubmitEvent() const {
+  if (event_head_ - event_tail_ == kEventSlotCount) {
+    printf("Too many event reads queued\r\n");
+    return false;
+  }
+
+  if (!transport_->SubmitBulk(EdgeTpuPipe::kEvent,
+                              event_buffers[event_head_ % kEventSlotCount],
+                              kEventSizeBytes)) {
     printf("ReadEvent failed\r\n");
-    goto exit;
-  }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    goto exit;
-  };
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
-  OSA_MemoryFree(buf);
-  return ret;
+    return false;
+  }
+  ++event_head_;
+  return true;
 }
 
+bool TpuDriver::WaitEvent() const {
+  if (event_head_ == event_tail_) {
+    return false;
+  }
+
+  // The event holds the address, length and tag of the last transfer, which
+  // nothing needs for now.
+  uint32_t transferred;
+  EdgeTpuTransferStatus status =
+      transport_->Wait(EdgeTpuPipe::kEvent, kTransferTimeoutMs, &transferred);
+  if (status == EdgeTpuTransferStatus::kTimeout) {
+    transport_->Cancel(EdgeTpuPipe::kEvent);
+    event_tail_ = event_head_;
+    return false;
+  }
+  ++event_tail_;
+  return status == EdgeTpuTransferStatus::kSuccess;
+}
+
+bool TpuDriver::ReadEvent() const { return SubmitEvent() && WaitEvent(); }
+
 bool TpuDriver::DoRunControl(platforms::darwinn::driver::RunControl run_state) {
   const uint64_t run_state_value = static_cast<uint64_t>(run_state);
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().avDataPopRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().parameterPopRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().infeedRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().outfeedRunControl,
-                run_state_value));
+  const auto& scalar_core = chip_config_.GetScalarCoreCsrOffsets();
+  for (uint64_t reg :
+       {scalar_core.scalarCoreRunControl, scalar_core.avDataPopRunControl,
+        scalar_core.parameterPopRunControl, scalar_core.infeedRunControl,
+        scalar_core.outfeedRunControl}) {
+    if (!Write64(reg, run_state_value)) {
+      return false;
+    }
+  }
 
   registers::TileConfig<7> helper;
   helper.set_broadcast();
-  CHECK(Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                helper.raw()));
+  const uint64_t helper_value = helper.raw();
+  if (!Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+               helper_value)) {
+    return false;
+  }
 
   // Wait until tileconfig0 is set correctly. Subsequent writes are going to
   // tiles, but hardware does not guarantee correct ordering with previous
   // write.
-  uint64_t tileconfig0_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tileconfig0_reg));
-  } while (tileconfig0_reg != helper.raw());
-
-  if (chip_config_.GetTileCsrOffsets().opRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_7,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_7,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_7,
-                  run_state_value));
-  }
-
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus0RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus1RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus2RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus3RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusConsumer0RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusConsumer1RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusProducerRunControl,
-                run_state_value));
-  if (chip_config_.GetTileCsrOffsets().narrowToNarrowRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToNarrowRunControl,
-                  run_state_value));
+  if (!PollCsr(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+               RegisterSize::kRegSize64, [helper_value](uint64_t value) {
+                 return value == helper_value;
+               })) {
+    return false;
+  }
+
+  // Run controls the chip does not have are at offset -1.
+  const auto& tile = chip_config_.GetTileCsrOffsets();
+  for (uint64_t reg : {tile.opRunControl,
+                       tile.opRunControl_0,
+                       tile.opRunControl_1,
+                       tile.opRunControl_2,
+                       tile.opRunControl_3,
+                       tile.opRunControl_4,
+                       tile.opRunControl_5,
+                       tile.opRunControl_6,
+                       tile.opRunControl_7,
+                       tile.narrowToWideRunControl,
+                       tile.narrowToWideRunControl_0,
+                       tile.narrowToWideRunControl_1,
+                       tile.narrowToWideRunControl_2,
+                       tile.narrowToWideRunControl_3,
+                       tile.narrowToWideRunControl_4,
+                       tile.narrowToWideRunControl_5,
+                       tile.narrowToWideRunControl_6,
+                       tile.narrowToWideRunControl_7,
+                       tile.wideToNarrowRunControl,
+                       tile.wideToNarrowRunControl_0,
+                       tile.wideToNarrowRunControl_1,
+                       tile.wideToNarrowRunControl_2,
+                       tile.wideToNarrowRunControl_3,
+                       tile.wideToNarrowRunControl_4,
+                       tile.wideToNarrowRunControl_5,
+                       tile.wideToNarrowRunControl_6,
+                       tile.wideToNarrowRunControl_7,
+                       tile.meshBus0RunControl,
+                       tile.meshBus1RunControl,
+                       tile.meshBus2RunControl,
+                       tile.meshBus3RunControl,
+                       tile.ringBusConsumer0RunControl,
+                       tile.ringBusConsumer1RunControl,
+                       tile.ringBusProducerRunControl,
+                       tile.narrowToNarrowRunControl}) {
+    if (reg != static_cast<uint64_t>(-1) && !Write64(reg, run_state_value)) {
+      return false;
+    }
   }
 
   return true;
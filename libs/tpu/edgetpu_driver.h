@@ -18,11 +18,13 @@
 #define LIBS_TPU_EDGETPU_DRIVER_H_
 
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <vector>
 
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/hardware_structures.h"
-#include "libs/tpu/usb_host_edgetpu.h"
+#include "libs/tpu/edgetpu_transport.h"
 
 namespace coralmicro {
 
@@ -47,16 +49,38 @@ enum class DescriptorTag {
 
 class TpuDriver {
  public:
+  // Receives the `length` bytes at `data` that belong at `offset` in a bulk
+  // in transfer. Bytes arrive in order.
+  using BulkInSink = std::function<void(const uint8_t* data, uint32_t offset,
+                                        uint32_t length)>;
+
   TpuDriver() = default;
   TpuDriver(const TpuDriver&) = delete;
   TpuDriver& operator=(const TpuDriver&) = delete;
-  bool Initialize(usb_host_edgetpu_instance_t* usb_instance,
-                  PerformanceMode mode);
+  // Brings up the Edge TPU behind `transport`, which must outlive the driver.
+  bool Initialize(EdgeTpuTransport* transport, PerformanceMode mode);
+  // Switches the clock rates of the initialized Edge TPU to those of `mode`.
+  // The Edge TPU must be idle, with no event reads queued. The clocks only
+  // change in reset, so this puts the Edge TPU through it, which drops the
+  // parameters cached on it, and takes a few milliseconds.
+  bool SetPerformanceMode(PerformanceMode mode);
   bool SendParameters(const uint8_t* data, uint32_t length) const;
-  bool SendInputs(const uint8_t* data, uint32_t length) const;
+  // Sends input activations. If `mask` is not zero, each 32-bit word of the
+  // data is XORed with it on the way to the device, leaving `data` as it is.
+  bool SendInputs(const uint8_t* data, uint32_t length,
+                  uint32_t mask = 0) const;
   bool SendInstructions(const uint8_t* data, uint32_t length) const;
-  bool GetOutputs(uint8_t* data, uint32_t length) const;
+  // Reads `length` bytes of output activations, handing them to `sink` as
+  // each chunk arrives.
+  bool GetOutputs(uint32_t length, const BulkInSink& sink) const;
+  // Reads the event the device sends at the end of an inference. Event reads
+  // queued with `SubmitEvent()` must have been waited for first.
   bool ReadEvent() const;
+  // Queues a read of the event the device sends at the end of an inference,
+  // so the next inference can start before it is in. Up to two reads can be
+  // queued. `WaitEvent()` waits for the oldest.
+  bool SubmitEvent() const;
+  bool WaitEvent() const;
   float GetTemperature();
 
  private:
@@ -65,26 +89,65 @@ class TpuDriver {
     kRegSize64,
   };
 
-  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length) const;
-  ssize_t BulkOutTransferInternal(uint8_t endpoint, const uint8_t* data,
-                                  uint32_t data_length) const;
-  bool BulkInTransfer(uint8_t* data, uint32_t data_length) const;
-  ssize_t BulkInTransferInternal(uint8_t endpoint, uint8_t* data,
-                                 uint32_t data_length) const;
+  // Puts the Edge TPU through reset at the clock rates of `mode`, and readies
+  // it to run.
+  // Returns false if a CSR access fails or the chip does not reach a state
+  // in time.
+  bool Reset(PerformanceMode mode);
+  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length,
+                       uint32_t mask = 0) const;
+  bool BulkInTransfer(uint32_t data_length, const BulkInSink& sink) const;
+  // Moves `data_length` bytes from `out_data` or into `in_sink` over `pipe`,
+  // with several chunks in flight at once. `out_data` is sent without a copy
+  // when the transport can send it in place and `out_mask` is zero;
+  // otherwise each of its words is XORed with `out_mask` as it is copied.
+  bool BulkTransfer(EdgeTpuPipe pipe, const uint8_t* out_data,
+                    const BulkInSink* in_sink, uint32_t data_length,
+                    uint32_t out_mask) const;
 
-  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length) const;
+  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length,
+                uint32_t mask = 0) const;
   bool WriteHeader(DescriptorTag tag, uint32_t length) const;
   std::vector<uint8_t> PrepareHeader(DescriptorTag tag, uint32_t length) const;
 
-  bool CSRTransfer(uint64_t reg, void* data, bool read, RegisterSize reg_size);
+  // CSR accesses are queued on the control pipe. Writes return once they are
+  // queued, and their errors are reported by the next read or
+  // `FlushCsrWrites()`, which wait for every access queued before them.
+  //
+  // The driver keeps a shadow of the value last read from or written to each
+  // CSR. Writes of the value a CSR already holds are skipped, and
+  // `ReadCached32()` answers from the shadow when it can. Registers the chip
+  // changes on its own must be read with `Read32()` or `Read64()`, which
+  // always read the chip.
+  static uint16_t CsrLength(RegisterSize reg_size) {
+    return reg_size == RegisterSize::kRegSize32 ? 4 : 8;
+  }
+  bool SubmitCsr(uint64_t reg, bool read, RegisterSize reg_size,
+                 uint64_t value);
+  bool WaitCsr();
+  bool FlushCsrWrites();
+  bool ReadCsr(uint64_t reg, RegisterSize reg_size, uint64_t* val);
+  bool WriteCsr(uint64_t reg, RegisterSize reg_size, uint64_t val);
+  // Reads `reg` until `done` accepts its value. Returns false if a read fails
+  // or `done` has not accepted a value within a timeout.
+  bool PollCsr(uint64_t reg, RegisterSize reg_size,
+               const std::function<bool(uint64_t)>& done);
   bool Read32(uint64_t reg, uint32_t* val);
   bool Read64(uint64_t reg, uint64_t* val);
+  bool ReadCached32(uint64_t reg, uint32_t* val);
   bool Write32(uint64_t reg, uint32_t val);
   bool Write64(uint64_t reg, uint64_t val);
   bool DoRunControl(platforms::darwinn::driver::RunControl run_state);
 
   platforms::darwinn::driver::config::BeagleChipConfig chip_config_;
-  usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  EdgeTpuTransport* transport_ = nullptr;
+  std::map<uint64_t, uint64_t> csr_shadow_;
+  // CSR accesses queued and completed so far.
+  int csr_head_ = 0;
+  int csr_tail_ = 0;
+  // Event reads queued and completed so far.
+  mutable int event_head_ = 0;
+  mutable int event_tail_ = 0;
 };
 
 }  // namespace coralmicro
@@ -16,9 +16,22 @@
 
 #include "libs/tpu/edgetpu_executable.h"
 
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "libs/base/timer.h"
+#include "third_party/flatbuffers/include/flatbuffers/flatbuffers.h"
+#include "third_party/flatbuffers/include/flatbuffers/flexbuffers.h"
 #include "tensorflow/lite/micro/kernels/kernel_util.h"
+#include "tensorflow/lite/micro/memory_helpers.h"
 
 namespace {
+constexpr char kKeyVersion[] = "1";
+constexpr char kKeyChipName[] = "2";
+constexpr char kKeyParamCache_DEPRECATED[] = "3";
+constexpr char kKeyExecutable[] = "4";
+
 int TensorDataTypeSize(platforms::darwinn::DataType data_type) {
   switch (data_type) {
     case platforms::darwinn::DataType_FIXED_POINT8:
@@ -40,24 +53,144 @@ int TensorDataTypeSize(platforms::darwinn::DataType data_type) {
       return 0;
   }
 }
+
+// Returns the mask that flips the most significant bit of each value of
+// `data_type_size` bytes when XORed with the 32-bit words of a stream that
+// starts `offset` bytes into the tensor. Bytes are stored little endian.
+uint32_t SignBitMask(int data_type_size, uint32_t offset) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < sizeof(mask); ++i) {
+    if ((offset + i) % data_type_size == data_type_size - 1) {
+      mask |= 0x80u << (8 * i);
+    }
+  }
+  return mask;
+}
+
+// Time and bytes of each phase of one inference.
+struct PhaseTimes {
+  uint64_t us[coralmicro::kEdgeTpuPhaseCount] = {};
+  uint64_t bytes[coralmicro::kEdgeTpuPhaseCount] = {};
+  bool seen[coralmicro::kEdgeTpuPhaseCount] = {};
+
+  void Add(coralmicro::EdgeTpuPhase phase, uint64_t us, uint64_t bytes) {
+    int i = static_cast<int>(phase);
+    this->us[i] += us;
+    this->bytes[i] += bytes;
+    seen[i] = true;
+  }
+};
 }  // namespace
 
 namespace coralmicro {
 
-EdgeTpuExecutable::EdgeTpuExecutable(const platforms::darwinn::Executable* exe)
-    : executable_(exe) {
-  if (executable_->output_layers()) {
-    for (const auto* output_layer : *(executable_->output_layers())) {
-      output_layers_[output_layer->name()->c_str()] =
-          new OutputLayer(output_layer);
+bool ParseEdgeTpuPackage(
+    const char* package_content, size_t length,
+    const platforms::darwinn::Executable** inference_exe,
+    const platforms::darwinn::Executable** parameter_caching_exe) {
+  auto flexbuffer_map =
+      flexbuffers::GetRoot((const uint8_t*)package_content, length).AsMap();
+  auto package_binary = flexbuffer_map[kKeyExecutable].AsString();
+  flatbuffers::Verifier package_verifier((const uint8_t*)package_binary.c_str(),
+                                         package_binary.length());
+  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
+    printf("Package verification failed.\r\n");
+    return false;
+  }
+
+  auto* package =
+      flatbuffers::GetRoot<platforms::darwinn::Package>(package_binary.c_str());
+  if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
+    printf("No executables to register.\r\n");
+    return false;
+  }
+
+  auto* multi_executable =
+      flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
+          package->serialized_multi_executable()->data());
+  flatbuffers::Verifier multi_executable_verifier(
+      package->serialized_multi_executable()->data(),
+      flatbuffers::VectorLength(package->serialized_multi_executable()));
+  if (!multi_executable_verifier
+           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
+    printf("MultiExecutable verification failed.\r\n");
+    return false;
+  }
+
+  *inference_exe = nullptr;
+  *parameter_caching_exe = nullptr;
+
+  for (const auto* executable_serialized :
+       *(multi_executable->serialized_executables())) {
+    flatbuffers::Verifier verifier(
+        (const uint8_t*)executable_serialized->c_str(),
+        executable_serialized->size());
+    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
+      printf("Executable verification failed.\r\n");
+      return false;
     }
+
+    const auto* executable =
+        flatbuffers::GetRoot<platforms::darwinn::Executable>(
+            (const uint8_t*)executable_serialized->c_str());
+    if (executable->type() ==
+            platforms::darwinn::ExecutableType_EXECUTION_ONLY ||
+        executable->type() == platforms::darwinn::ExecutableType_STAND_ALONE) {
+      *inference_exe = executable;
+    } else if (executable->type() ==
+               platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
+      *parameter_caching_exe = executable;
+    }
+  }
+
+  if (*inference_exe == nullptr) {
+    printf("Package does not have inference executable.\r\n");
+    return false;
   }
+
+  return true;
 }
 
-EdgeTpuExecutable::~EdgeTpuExecutable() {
-  for (auto entry : output_layers_) {
-    delete entry.second;
+EdgeTpuExecutable* EdgeTpuExecutable::Create(
+    EdgeTpuArena* arena, const platforms::darwinn::Executable* exe) {
+  static_assert(std::is_trivially_destructible<EdgeTpuExecutable>::value,
+                "Objects in an arena are never destroyed");
+  void* memory = arena->Allocate(sizeof(EdgeTpuExecutable),
+                                 alignof(EdgeTpuExecutable));
+  if (!memory) {
+    return nullptr;
+  }
+  auto* executable = new (memory) EdgeTpuExecutable(exe);
+  const int count = flatbuffers::VectorLength(exe->output_layers());
+  if (count == 0) {
+    return executable;
   }
+  executable->output_layers_ = arena->NewArray<OutputLayer*>(count);
+  if (!executable->output_layers_) {
+    return nullptr;
+  }
+  for (int i = 0; i < count; ++i) {
+    auto* layer = OutputLayer::Create(arena, exe->output_layers()->Get(i), i);
+    if (!layer) {
+      return nullptr;
+    }
+    executable->output_layers_[i] = layer;
+  }
+  executable->output_layer_count_ = count;
+  std::sort(executable->output_layers_, executable->output_layers_ + count,
+            [](const OutputLayer* a, const OutputLayer* b) {
+              return strcmp(a->name(), b->name()) < 0;
+            });
+  return executable;
+}
+
+const OutputLayer* EdgeTpuExecutable::FindOutputLayer(const char* name) const {
+  auto* end = output_layers_ + output_layer_count_;
+  auto* it = std::lower_bound(output_layers_, end, name,
+                              [](const OutputLayer* layer, const char* name) {
+                                return strcmp(layer->name(), name) < 0;
+                              });
+  return it != end && strcmp((*it)->name(), name) == 0 ? *it : nullptr;
 }
 
 #define RETURN_IF_ERROR(expr) \
@@ -73,16 +206,72 @@ TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
                                        TfLiteNode* node) {
   const TfLiteEvalTensor* input_tensor =
       tflite::micro::GetEvalInput(context, node, 0);
-  const int input_size = tflite::micro::GetTensorShape(input_tensor).FlatSize();
-  if (!input_tensor) {
+  size_t input_size;
+  if (!input_tensor ||
+      tflite::TfLiteEvalTensorByteLength(input_tensor, &input_size) !=
+          kTfLiteOk) {
+    return kTfLiteError;
+  }
+
+  return Invoke(tpu_driver, input_tensor->data.uint8, input_size,
+                [context, node](int index, size_t size) -> uint8_t* {
+                  if (index >= node->outputs->size) {
+                    return nullptr;
+                  }
+                  TfLiteEvalTensor* output_tensor =
+                      tflite::micro::GetEvalOutput(context, node, index);
+                  size_t output_size;
+                  if (!output_tensor ||
+                      tflite::TfLiteEvalTensorByteLength(
+                          output_tensor, &output_size) != kTfLiteOk ||
+                      output_size < size) {
+                    return nullptr;
+                  }
+                  return output_tensor->data.uint8;
+                });
+}
+
+TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
+                                       const uint8_t* input, size_t input_size,
+                                       const OutputBufferFn& output_buffer) {
+  TfLiteStatus status = Submit(tpu_driver, input, input_size, output_buffer);
+  if (status != kTfLiteOk) {
+    return status;
+  }
+  if (!WaitEvent(tpu_driver)) {
+    printf("Edge TPU did not report the inference done\r\n");
     return kTfLiteError;
   }
+  return kTfLiteOk;
+}
 
+bool EdgeTpuExecutable::WaitEvent(const TpuDriver& tpu_driver) {
+  const uint64_t start = TimerMicros();
+  bool ret = tpu_driver.WaitEvent();
+  if (profile_ && executable_->type() !=
+                      platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
+    const uint64_t us = TimerMicros() - start;
+    profile_->phase(EdgeTpuPhase::kEvent).Record(us, 0);
+    profile_->total_us += us;
+  }
+  return ret;
+}
+
+TfLiteStatus EdgeTpuExecutable::Submit(const TpuDriver& tpu_driver,
+                                       const uint8_t* input, size_t input_size,
+                                       const OutputBufferFn& output_buffer) {
   const platforms::darwinn::DmaDescriptorHint* dma_hint;
   const char* name;
+  const OutputLayer* output_layer;
   uint8_t* output;
   int32_t ins_idx;
+  uint32_t sign_mask;
   const flatbuffers::Vector<uint8_t>* bitstream;
+  PhaseTimes times;
+  const uint64_t start = TimerMicros();
+  uint64_t phase_start;
+  uint64_t first_chunk;
+  uint64_t relayout_us;
 
   for (const auto* hint : *(executable_->dma_hints()->hints())) {
     switch (hint->any_hint_type()) {
@@ -90,38 +279,73 @@ TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
         dma_hint = hint->any_hint_as_DmaDescriptorHint();
         switch (dma_hint->meta()->desc()) {
           case platforms::darwinn::Description_BASE_ADDRESS_PARAMETER:
+            phase_start = TimerMicros();
             RETURN_IF_ERROR(tpu_driver.SendParameters(
                 executable_->parameters()->data() + dma_hint->offset_in_bytes(),
                 dma_hint->size_in_bytes()));
+            times.Add(EdgeTpuPhase::kParameters, TimerMicros() - phase_start,
+                      dma_hint->size_in_bytes());
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_INPUT_ACTIVATION:
             name = dma_hint->meta()->name()->c_str();
+            if (!input || input_size < dma_hint->offset_in_bytes() +
+                                           dma_hint->size_in_bytes()) {
+              printf("Input too small for %s\r\n", name);
+              return kTfLiteError;
+            }
+            // Signed inputs are converted as they are sent, so the tensor is
+            // left as the caller wrote it.
+            sign_mask = 0;
             if (executable_->input_layers()) {
               for (const auto* input_layer : *(executable_->input_layers())) {
-                if (!strcmp(input_layer->name()->c_str(), name)) {
-                  if (OutputLayer::SignedDataType(input_layer->data_type())) {
-                    OutputLayer::TransformSignedDataType(
-                        input_tensor->data.uint8, input_size,
-                        TensorDataTypeSize(input_layer->data_type()),
-                        input_layer->x_dim(), input_layer->y_dim(),
-                        input_layer->z_dim());
-                  }
+                if (!strcmp(input_layer->name()->c_str(), name) &&
+                    OutputLayer::SignedDataType(input_layer->data_type())) {
+                  sign_mask =
+                      SignBitMask(TensorDataTypeSize(input_layer->data_type()),
+                                  dma_hint->offset_in_bytes());
                 }
               }
             }
+            phase_start = TimerMicros();
             RETURN_IF_ERROR(tpu_driver.SendInputs(
-                input_tensor->data.uint8 + dma_hint->offset_in_bytes(),
-                dma_hint->size_in_bytes()));
+                input + dma_hint->offset_in_bytes(),
+                dma_hint->size_in_bytes(), sign_mask));
+            times.Add(EdgeTpuPhase::kInputs, TimerMicros() - phase_start,
+                      dma_hint->size_in_bytes());
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_OUTPUT_ACTIVATION:
             name = dma_hint->meta()->name()->c_str();
-            if (output_layers_.find(name) == output_layers_.end()) {
+            output_layer = FindOutputLayer(name);
+            if (!output_layer) {
               printf("Executable does not have output layer %s\r\n", name);
               break;
             }
-            output = output_layers_.at(name)->output_buffer();
-            RETURN_IF_ERROR(
-                tpu_driver.GetOutputs(output, dma_hint->size_in_bytes()));
+            output = output_buffer(output_layer->index(),
+                                   output_layer->ActualSizeBytes());
+            if (!output) {
+              printf("No output buffer large enough for %s\r\n", name);
+              return kTfLiteError;
+            }
+            // The output is relaid out into the buffer as it arrives. Until
+            // the first chunk comes in, the Edge TPU is computing it.
+            phase_start = TimerMicros();
+            first_chunk = 0;
+            relayout_us = 0;
+            RETURN_IF_ERROR(tpu_driver.GetOutputs(
+                dma_hint->size_in_bytes(),
+                [output_layer, output, &first_chunk, &relayout_us](
+                    const uint8_t* data, uint32_t offset, uint32_t length) {
+                  const uint64_t chunk_start = TimerMicros();
+                  if (offset == 0) first_chunk = chunk_start;
+                  output_layer->RelayoutChunk(data, offset, length, output);
+                  relayout_us += TimerMicros() - chunk_start;
+                }));
+            if (first_chunk == 0) first_chunk = phase_start;
+            times.Add(EdgeTpuPhase::kCompute, first_chunk - phase_start, 0);
+            times.Add(EdgeTpuPhase::kOutputs,
+                      TimerMicros() - first_chunk - relayout_us,
+                      dma_hint->size_in_bytes());
+            times.Add(EdgeTpuPhase::kRelayout, relayout_us, 0);
             break;
           default:
             break;
@@ -132,38 +356,35 @@ TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
             hint->any_hint_as_InstructionHint()->instruction_chunk_index();
         bitstream =
             executable_->instruction_bitstreams()->Get(ins_idx)->bitstream();
+        phase_start = TimerMicros();
         RETURN_IF_ERROR(
             tpu_driver.SendInstructions(bitstream->data(), bitstream->size()));
+        times.Add(EdgeTpuPhase::kInstructions, TimerMicros() - phase_start,
+                  bitstream->size());
         break;
       default:
         break;
     }
   }
 
-  tpu_driver.ReadEvent();
+  RETURN_IF_ERROR(tpu_driver.SubmitEvent());
 
-  if (!output_layers_.empty()) {
-    for (int i = 0; i < node->outputs->size; ++i) {
-      const TfLiteEvalTensor* output_tensor =
-          tflite::micro::GetEvalOutput(context, node, i);
-      const int output_size =
-          tflite::micro::GetTensorShape(output_tensor).FlatSize();
-      if (!output_tensor) {
-        return kTfLiteError;
-      }
-      name = executable_->output_layers()->Get(i)->name()->c_str();
-      if (output_layers_.find(name) == output_layers_.end()) {
-        printf("Executable does not have buffer for %s\r\n", name);
-        return kTfLiteError;
+  if (profile_) {
+    const uint64_t us = TimerMicros() - start;
+    if (executable_->type() ==
+        platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
+      profile_->phase(EdgeTpuPhase::kParameters)
+          .Record(us, times.bytes[static_cast<int>(EdgeTpuPhase::kParameters)]);
+    } else {
+      for (int i = 0; i < kEdgeTpuPhaseCount; ++i) {
+        if (times.seen[i]) {
+          profile_->phases[i].Record(times.us[i], times.bytes[i]);
+        }
       }
-      OutputLayer* output_layer = output_layers_[name];
-
-      output_layer->Relayout(output_tensor->data.uint8);
-      output_layer->TransformSignedDataType(output_tensor->data.uint8,
-                                            output_size);
+      ++profile_->inferences;
+      profile_->total_us += us;
     }
   }
-
   return kTfLiteOk;
 }
 
@@ -197,145 +418,248 @@ bool OutputLayer::SignedDataType(platforms::darwinn::DataType type) {
   return false;
 }
 
-void OutputLayer::Relayout(uint8_t* dest) const {
-  uint8_t* src = output_buffer_.get();
+OutputLayer* OutputLayer::Create(EdgeTpuArena* arena,
+                                 const platforms::darwinn::Layer* layer,
+                                 int index) {
+  static_assert(std::is_trivially_destructible<OutputLayer>::value,
+                "Objects in an arena are never destroyed");
+  void* memory = arena->Allocate(sizeof(OutputLayer), alignof(OutputLayer));
+  if (!memory) {
+    return nullptr;
+  }
+  auto* output_layer = new (memory) OutputLayer(layer, index);
+  return output_layer->BuildRelayoutPlan(arena) ? output_layer : nullptr;
+}
+
+template <typename Fn>
+void OutputLayer::ForEachRelayoutRun(Fn fn) const {
+  // Each row of the tensor is read from one run per tile it crosses. Runs
+  // that continue where the previous one ended, such as the rows of a single
+  // tile without padding, are merged.
+  const int z_bytes = element_bytes_;
+  const int data_type_size = DataTypeSize();
+  const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
+  const auto* x_tiles = layout->x_coordinate_to_linear_tile_id_map();
+  uint32_t dest_offset = 0;
+  RelayoutRun last;
+  bool has_last = false;
+  for (int y = 0; y < y_dim(); ++y) {
+    const auto y_buffer_index = GetYBufferIndex(y);
+    int tile_starting_x = 0;
+    while (tile_starting_x < x_dim()) {
+      int tile_end_x = tile_starting_x + 1;
+      while (tile_end_x < x_dim() &&
+             x_tiles->Get(tile_end_x) == x_tiles->Get(tile_starting_x)) {
+        ++tile_end_x;
+      }
+      RelayoutRun run;
+      run.src_offset =
+          GetBufferIndex(y_buffer_index, tile_starting_x, 0) * data_type_size;
+      run.dest_offset = dest_offset;
+      run.count = tile_end_x - tile_starting_x;
+      dest_offset += run.count * z_bytes;
+      tile_starting_x = tile_end_x;
+
+      if (has_last &&
+          last.src_offset + last.count * src_stride_ == run.src_offset) {
+        last.count += run.count;
+        continue;
+      }
+      if (has_last) fn(last);
+      last = run;
+      has_last = true;
+    }
+  }
+  if (has_last) fn(last);
+}
+
+bool OutputLayer::BuildRelayoutPlan(EdgeTpuArena* arena) {
   const auto data_type_size = DataTypeSize();
   const int z_bytes = z_dim() * data_type_size;
+  element_bytes_ = z_bytes;
+  sign_bytes_ = SignedDataType() ? data_type_size : 0;
 
+  RelayoutRun* runs;
   if (y_dim() == 1 && x_dim() == 1) {
-    // One dimensional output (only z-dimension).
-    if (src != dest) {
-      const int padded_size_bytes = PaddedSizeBytes();
-      const int actual_size_bytes = ActualSizeBytes();
-      const int executions = execution_count_per_inference();
-      if (executions == 1 || padded_size_bytes == actual_size_bytes) {
-        memcpy(dest, src, z_bytes * executions);
-      } else {
-        // Remove padding values at the end of each execution.
-        const int padded_size_per_execution =
-            (padded_size_bytes - actual_size_bytes) / executions;
-        for (int i = 0; i < executions; ++i) {
-          memcpy(dest, src, z_bytes);
-          dest += z_bytes;
-          src += z_bytes + padded_size_per_execution;
-        }
-      }
+    // One dimensional output (only z-dimension), with padding values at the
+    // end of each execution.
+    const int executions = execution_count_per_inference();
+    src_stride_ =
+        z_bytes + (PaddedSizeBytes() - ActualSizeBytes()) / executions;
+    if (executions == 1) {
+      src_stride_ = z_bytes;
     }
-  } else {
-    int z_bytes_padded;
-    if (x_dim() > 1) {
-      // If x-dim is > 1, padded-z-size can be deduced by looking at
-      // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
-      z_bytes_padded = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
-    } else {
-      // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
-      // padded-z-size can be deduced by looking at difference between
-      // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
-      z_bytes_padded = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+    runs = arena->NewArray<RelayoutRun>(1);
+    if (!runs) {
+      return false;
     }
-    z_bytes_padded *= data_type_size;
+    runs[0] = {0, 0, static_cast<uint32_t>(executions)};
+    runs_ = runs;
+    run_count_ = 1;
+    return true;
+  }
 
-    const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
-    int last_x = 0;
-    size_t active_tile_x_count = 0;
+  if (x_dim() > 1) {
+    // If x-dim is > 1, padded-z-size can be deduced by looking at
+    // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
+    src_stride_ = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
+  } else {
+    // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
+    // padded-z-size can be deduced by looking at difference between
+    // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
+    src_stride_ = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+  }
+  src_stride_ *= data_type_size;
+
+  // The runs are counted first, so the arena holds no more than they need.
+  uint32_t count = 0;
+  ForEachRelayoutRun([&count](const RelayoutRun&) { ++count; });
+  runs = arena->NewArray<RelayoutRun>(count);
+  if (!runs) {
+    return false;
+  }
+  uint32_t i = 0;
+  ForEachRelayoutRun([runs, &i](const RelayoutRun& run) { runs[i++] = run; });
+
+  // The output arrives in order, so each chunk is matched with the runs it
+  // covers by their offset in the output activations.
+  std::sort(runs, runs + count,
+            [](const RelayoutRun& a, const RelayoutRun& b) {
+              return a.src_offset < b.src_offset;
+            });
+  runs_ = runs;
+  run_count_ = count;
+  return true;
+}
 
-    int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+void OutputLayer::RelayoutChunk(const uint8_t* data, uint32_t offset,
+                                uint32_t length, uint8_t* dest) const {
+  const uint32_t chunk_end = offset + length;
+  const uint32_t element_bytes = element_bytes_;
+  const uint32_t stride = src_stride_;
+  const RelayoutRun* runs_end = runs_ + run_count_;
+  const RelayoutRun* run = std::partition_point(
+      runs_, runs_end,
+      [&](const RelayoutRun& run) { return RunEnd(run) <= offset; });
+  for (; run != runs_end && run->src_offset < chunk_end; ++run) {
+    if (run->src_offset >= offset && RunEnd(*run) <= chunk_end) {
+      // Most runs are wholly in one chunk.
+      CopyElements(data + (run->src_offset - offset), run->count, dest,
+                   run->dest_offset);
+      continue;
+    }
+    if (stride == element_bytes) {
+      // No padding between elements, so the run is a single copy.
+      const uint32_t begin = std::max(run->src_offset, offset);
+      const uint32_t end = std::min(RunEnd(*run), chunk_end);
+      CopyBytes(data + (begin - offset), end - begin, dest,
+                run->dest_offset + (begin - run->src_offset));
+      continue;
+    }
 
-    for (int x = 1; x < x_dim(); ++x) {
-      int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
-      if (cur_x_tile != last_x_tile) {
-        active_tile_x_sizes_[active_tile_x_count] = x - last_x;
-        active_tile_x_count++;
-        last_x_tile = cur_x_tile;
-        last_x = x;
+    // Elements [first, last) are whole in this chunk. The element before
+    // them and the one after them may be cut by the chunk boundaries.
+    uint32_t first = 0;
+    if (offset > run->src_offset) {
+      first = (offset - run->src_offset + stride - 1) / stride;
+    }
+    uint32_t last = 0;
+    if (chunk_end >= run->src_offset + element_bytes) {
+      last = std::min(
+          (chunk_end - run->src_offset - element_bytes) / stride + 1,
+          run->count);
+    }
+    if (first > 0) {
+      const uint32_t element = run->src_offset + (first - 1) * stride;
+      const uint32_t element_end =
+          std::min(element + element_bytes, chunk_end);
+      if (element_end > offset) {
+        CopyBytes(data, element_end - offset, dest,
+                  run->dest_offset + (first - 1) * element_bytes +
+                      (offset - element));
       }
     }
-    active_tile_x_sizes_[active_tile_x_count] = x_dim() - last_x;
-    active_tile_x_count++;
-
-    // When the num_z_bytes parameter is a compile-time constant, the
-    // conditions in the innermost loop will be replaced with a single
-    // optimized path, specialized for that value. Specialization is
-    // provided for num_z_bytes value of 1 and 3. We can also make this a
-    // helper function and still realize the benefits provided we have a
-    // guaranteed way of ensuring this function would be inlined so that the
-    // compiler optimizations based on compile-time-constants can kick in.
-#define RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(num_z_bytes, num_z_bytes_padded) \
-  do {                                                                        \
-    for (int y = 0; y < y_dim(); ++y) {                                       \
-      const auto y_buffer_index = GetYBufferIndex(y);                         \
-      int tile_starting_x = 0;                                                \
-      for (size_t x_tile = 0; x_tile < active_tile_x_count; ++x_tile) {       \
-        const unsigned char* source =                                         \
-            src + GetBufferIndex(y_buffer_index, tile_starting_x, 0) *        \
-                      data_type_size;                                         \
-        const int tile_x_size = active_tile_x_sizes_[x_tile];                 \
-        for (int local_offset_x = 0; local_offset_x < tile_x_size;            \
-             ++local_offset_x) {                                              \
-          if ((num_z_bytes) == 1) {                                           \
-            *dest = *source;                                                  \
-          } else if ((num_z_bytes) == 3) {                                    \
-            *(dest + 0) = *(source + 0);                                      \
-            *(dest + 1) = *(source + 1);                                      \
-            *(dest + 2) = *(source + 2);                                      \
-          } else {                                                            \
-            memcpy(dest, source, (num_z_bytes));                              \
-          }                                                                   \
-          dest += (num_z_bytes);                                              \
-          source += (num_z_bytes_padded);                                     \
-        }                                                                     \
-        tile_starting_x += tile_x_size;                                       \
-      }                                                                       \
-    }                                                                         \
-  } while (0)
-
-    if (z_bytes == 1) {
-      // Specialization for z_bytes = 1 (grayscale image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(1, 4);
-    } else if (z_bytes == 3) {
-      // Specialization for z_bytes = 3 (RGB image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(3, 4);
-    } else {
-      // Default.
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(z_bytes, z_bytes_padded);
+    if (last > first) {
+      CopyElements(data + (run->src_offset + first * stride - offset),
+                   last - first, dest,
+                   run->dest_offset + first * element_bytes);
     }
-
-#undef RELAYOUT_WITH_Z_BYTES_SPECIALIZATION
-  }
-}
-
-void OutputLayer::TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                          int data_type_size, int x_dim,
-                                          int y_dim, int z_dim) {
-  int buffer_index = 0;
-
-  for (int y = 0; y < y_dim; ++y) {
-    for (int x = 0; x < x_dim; ++x) {
-      for (int z = 0; z < z_dim; ++z) {
-        // XORing with 128 on the last byte of each entry will flip the
-        // MSB of each entry. Please note that bytes are stored little
-        // endian.
-        int msb_index = buffer_index + data_type_size - 1;
-        buffer[msb_index] = buffer[msb_index] ^ 128;
-        buffer_index += data_type_size;
+    const uint32_t cut = std::max(first, last);
+    if (cut < run->count) {
+      const uint32_t element = run->src_offset + cut * stride;
+      if (element < chunk_end) {
+        CopyBytes(data + (element - offset), chunk_end - element, dest,
+                  run->dest_offset + cut * element_bytes);
       }
     }
   }
 }
 
-void OutputLayer::TransformSignedDataType(uint8_t* buffer,
-                                          int buffer_size) const {
-  if (!SignedDataType()) {
+void OutputLayer::CopyElements(const uint8_t* src, uint32_t count,
+                               uint8_t* dest, uint32_t dest_offset) const {
+  if (src_stride_ == element_bytes_) {
+    CopyBytes(src, count * element_bytes_, dest, dest_offset);
     return;
   }
+  switch (element_bytes_) {
+    case 1:
+      // Grayscale images, and other single channel outputs.
+      CopyElementsOfSize<1>(src, count, dest, dest_offset);
+      break;
+    case 2:
+      CopyElementsOfSize<2>(src, count, dest, dest_offset);
+      break;
+    case 3:
+      // RGB images.
+      CopyElementsOfSize<3>(src, count, dest, dest_offset);
+      break;
+    case 4:
+      CopyElementsOfSize<4>(src, count, dest, dest_offset);
+      break;
+    default:
+      CopyElementsOfSize<0>(src, count, dest, dest_offset);
+      break;
+  }
+}
 
-  if (buffer_size < ActualSizeBytes()) {
-    printf("Provided buffer size is less than actual size_bytes.");
-    return;
+// When kElementBytes is a compile-time constant, the copy of each element is
+// replaced with a single optimized path, specialized for that value. Zero
+// reads the element size from element_bytes_ instead.
+template <int kElementBytes>
+void OutputLayer::CopyElementsOfSize(const uint8_t* src, uint32_t count,
+                                     uint8_t* dest,
+                                     uint32_t dest_offset) const {
+  const int element_bytes =
+      kElementBytes ? kElementBytes : element_bytes_;
+  const int src_stride = src_stride_;
+  uint8_t* target = dest + dest_offset;
+  for (uint32_t i = 0; i < count; ++i) {
+    memcpy(target, src, element_bytes);
+    target += element_bytes;
+    src += src_stride;
   }
+  FlipSignBits(dest, dest_offset, count * element_bytes);
+}
 
-  TransformSignedDataType(buffer, buffer_size, DataTypeSize(), x_dim(), y_dim(),
-                          z_dim());
+void OutputLayer::CopyBytes(const uint8_t* src, uint32_t length, uint8_t* dest,
+                            uint32_t dest_offset) const {
+  memcpy(dest + dest_offset, src, length);
+  FlipSignBits(dest, dest_offset, length);
+}
+
+void OutputLayer::FlipSignBits(uint8_t* dest, uint32_t dest_offset,
+                               uint32_t length) const {
+  if (sign_bytes_ == 0) {
+    return;
+  }
+  // XORing with 128 on the last byte of each entry will flip the MSB of each
+  // entry. Please note that bytes are stored little endian.
+  const uint32_t sign_bytes = sign_bytes_;
+  const uint32_t end = dest_offset + length;
+  for (uint32_t i = dest_offset + (sign_bytes - 1 - dest_offset % sign_bytes);
+       i < end; i += sign_bytes) {
+    dest[i] ^= 128;
+  }
 }
 
 // Used in GetBufferIndex(int y, int x, int z)
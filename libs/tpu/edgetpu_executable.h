@@ -18,10 +18,12 @@
 #define LIBS_TPU_EDGETPU_EXECUTABLE_H_
 
 #include <cstdlib>
-#include <cstring>
-#include <map>
+#include <functional>
+#include <vector>
 
+#include "libs/tpu/edgetpu_arena.h"
 #include "libs/tpu/edgetpu_driver.h"
+#include "libs/tpu/edgetpu_profile.h"
 #include "libs/tpu/executable_generated.h"
 #include "third_party/tflite-micro/tensorflow/lite/c/common.h"
 
@@ -29,20 +31,31 @@ namespace coralmicro {
 
 class OutputLayer {
  public:
-  explicit OutputLayer(const platforms::darwinn::Layer* layer)
-      : output_layer_(layer),
-        output_buffer_(std::make_unique<uint8_t[]>(layer->size_bytes())),
-        active_tile_x_sizes_(std::make_unique<int[]>(x_dim())) {}
+  // Creates the output layer and its relayout plan in `arena`, or returns
+  // nullptr if it is full. `index` is the position of the layer's tensor
+  // among the node's outputs.
+  static OutputLayer* Create(EdgeTpuArena* arena,
+                             const platforms::darwinn::Layer* layer,
+                             int index);
   OutputLayer(const OutputLayer&) = delete;
   OutputLayer& operator=(const OutputLayer&) = delete;
-  uint8_t* output_buffer() { return output_buffer_.get(); }
+  const char* name() const { return output_layer_->name()->c_str(); }
+  int index() const { return index_; }
+  // Number of elements the layer writes to its tensor.
+  int ElementCount() const {
+    return x_dim() * y_dim() * z_dim() * execution_count_per_inference();
+  }
+  // Number of bytes the layer writes to its tensor.
+  int ActualSizeBytes() const { return ElementCount() * DataTypeSize(); }
 
   static bool SignedDataType(platforms::darwinn::DataType type);
-  static void TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                      int data_type_size, int x_dim, int y_dim,
-                                      int z_dim);
-  void Relayout(uint8_t* dest) const;
-  void TransformSignedDataType(uint8_t* buffer, int buffer_size) const;
+  // Copies the `length` bytes at `data`, which are found at `offset` in the
+  // layer's output activations, into `dest` in the tensor's layout, following
+  // the plan built from the layer's layout when the layer was created.
+  // Signed values are converted as they are copied. Called with each chunk
+  // as it is received, so the activations are never stored whole.
+  void RelayoutChunk(const uint8_t* data, uint32_t offset, uint32_t length,
+                     uint8_t* dest) const;
 
  private:
   struct YBufferIndex {
@@ -51,6 +64,35 @@ class OutputLayer {
     // Holds local offset within a data chunk returned by a given tile.
     int local_y_coordinate;
   };
+  // Part of the relayout plan: `count` elements of the tensor, read from
+  // `src_offset` in the output activations, `src_stride_` bytes apart, and
+  // written back to back from `dest_offset`.
+  struct RelayoutRun {
+    uint32_t src_offset;
+    uint32_t dest_offset;
+    uint32_t count;
+  };
+  OutputLayer(const platforms::darwinn::Layer* layer, int index)
+      : output_layer_(layer), index_(index) {}
+  // Builds the relayout plan in `arena`. Returns false if it is full.
+  bool BuildRelayoutPlan(EdgeTpuArena* arena);
+  // Calls `fn` with each run of the plan, in the order of the tensor, with
+  // adjacent runs merged. The element sizes and stride must be set.
+  template <typename Fn>
+  void ForEachRelayoutRun(Fn fn) const;
+  uint32_t RunEnd(const RelayoutRun& run) const {
+    return run.src_offset + (run.count - 1) * src_stride_ + element_bytes_;
+  }
+  void CopyElements(const uint8_t* src, uint32_t count, uint8_t* dest,
+                    uint32_t dest_offset) const;
+  template <int kElementBytes>
+  void CopyElementsOfSize(const uint8_t* src, uint32_t count, uint8_t* dest,
+                          uint32_t dest_offset) const;
+  void CopyBytes(const uint8_t* src, uint32_t length, uint8_t* dest,
+                 uint32_t dest_offset) const;
+  void FlipSignBits(uint8_t* dest, uint32_t dest_offset,
+                    uint32_t length) const;
+
   YBufferIndex GetYBufferIndex(int y) const;
   int GetBufferIndex(int y, int x, int z) const;
   int GetBufferIndex(const YBufferIndex& y_buffer_index, int x, int z) const;
@@ -58,11 +100,6 @@ class OutputLayer {
   int execution_count_per_inference() const {
     return output_layer_->execution_count_per_inference();
   }
-  int ActualSizeBytes() const {
-    const int num_elements = x_dim() * y_dim() * z_dim();
-    return num_elements * DataTypeSize() * execution_count_per_inference();
-  }
-
   int PaddedSizeBytes() const {
     return output_layer_->size_bytes() * execution_count_per_inference();
   }
@@ -74,35 +111,86 @@ class OutputLayer {
   int z_dim() const { return output_layer_->z_dim(); }
 
   const platforms::darwinn::Layer* output_layer_;
-  std::unique_ptr<uint8_t[]> output_buffer_;
-  std::unique_ptr<int[]> active_tile_x_sizes_;
+  int index_;
+  // Runs of the relayout, in the arena, with adjacent runs merged, sorted by
+  // their offset in the output activations. They don't overlap there. Each
+  // element of the tensor is `element_bytes_` long.
+  const RelayoutRun* runs_ = nullptr;
+  uint32_t run_count_ = 0;
+  int element_bytes_ = 0;
+  int src_stride_ = 0;
+  // Size of the values whose sign bit is flipped, or 0 if unsigned.
+  int sign_bytes_ = 0;
 };
 
 class EdgeTpuExecutable {
  public:
-  explicit EdgeTpuExecutable(const platforms::darwinn::Executable* exe);
-  ~EdgeTpuExecutable();
+  // Returns the buffer for the output of the given index, which must hold
+  // `size` bytes, or nullptr if there is none.
+  using OutputBufferFn = std::function<uint8_t*(int index, size_t size)>;
+
+  // Creates the executable and its output layers in `arena`, or returns
+  // nullptr if it is full.
+  static EdgeTpuExecutable* Create(EdgeTpuArena* arena,
+                                   const platforms::darwinn::Executable* exe);
   EdgeTpuExecutable(const EdgeTpuExecutable&) = delete;
   EdgeTpuExecutable& operator=(const EdgeTpuExecutable&) = delete;
 
   TfLiteStatus Invoke(const TpuDriver& tpu_driver, TfLiteContext* context,
                       TfLiteNode* node);
+  // Runs the executable on the `input_size` bytes at `input`, writing its
+  // outputs to the buffers `output_buffer` returns, and waits for the device
+  // to finish.
+  TfLiteStatus Invoke(const TpuDriver& tpu_driver, const uint8_t* input,
+                      size_t input_size, const OutputBufferFn& output_buffer);
+  // As `Invoke()`, but returns once the outputs are in, leaving the read of
+  // the device's completion event queued. The caller waits for it with
+  // `WaitEvent()`.
+  TfLiteStatus Submit(const TpuDriver& tpu_driver, const uint8_t* input,
+                      size_t input_size, const OutputBufferFn& output_buffer);
+  // Waits for the completion event of the oldest inference submitted.
+  bool WaitEvent(const TpuDriver& tpu_driver);
+
+  // Sets the profile inferences are recorded in, or nullptr for none. The
+  // parameter uploads of a parameter caching executable are recorded as
+  // their parameters phase, and not as inferences.
+  void set_profile(EdgeTpuProfile* profile) { profile_ = profile; }
+
+  // Name the executable was compiled with, or nullptr.
+  const char* name() const {
+    return executable_->name() ? executable_->name()->c_str() : nullptr;
+  }
 
   uint64_t ParameterCachingToken() const {
     return executable_->parameter_caching_token();
   }
+  // Size of the parameters the executable sends to the device.
+  size_t ParameterSizeBytes() const {
+    return flatbuffers::VectorLength(executable_->parameters());
+  }
 
  private:
-  const platforms::darwinn::Executable* executable_;
+  explicit EdgeTpuExecutable(const platforms::darwinn::Executable* exe)
+      : executable_(exe) {}
+  // Returns the output layer named `name`, or nullptr.
+  const OutputLayer* FindOutputLayer(const char* name) const;
 
-  struct Less {
-    bool operator()(const char* a, const char* b) const {
-      return std::strcmp(a, b) < 0;
-    }
-  };
-  std::map<const char*, OutputLayer*, Less> output_layers_;
+  const platforms::darwinn::Executable* executable_;
+  EdgeTpuProfile* profile_ = nullptr;
+  // The output layers, in the arena, sorted by name.
+  OutputLayer** output_layers_ = nullptr;
+  int output_layer_count_ = 0;
 };
 
+// Verifies the Edge TPU package found in the `length` bytes of custom options
+// at `package_content`, and finds its executables. `parameter_caching_exe` is
+// set to nullptr if the package doesn't cache parameters. Returns false if
+// the package is invalid or has no inference executable.
+bool ParseEdgeTpuPackage(
+    const char* package_content, size_t length,
+    const platforms::darwinn::Executable** inference_exe,
+    const platforms::darwinn::Executable** parameter_caching_exe);
+
 }  // namespace coralmicro
 
 #endif  // LIBS_TPU_EDGETPU_EXECUTABLE_H_
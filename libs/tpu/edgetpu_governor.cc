@@ -0,0 +1,87 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_governor.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace coralmicro {
+
+float EdgeTpuGovernor::TripCelsius(PerformanceMode mode) const {
+  switch (mode) {
+    case PerformanceMode::kMax:
+      return config_.trip_celsius[0];
+    case PerformanceMode::kHigh:
+      return config_.trip_celsius[1];
+    case PerformanceMode::kMedium:
+      return config_.trip_celsius[2];
+    case PerformanceMode::kLow:
+      break;
+  }
+  return std::numeric_limits<float>::infinity();
+}
+
+PerformanceMode EdgeTpuGovernor::Update(PerformanceMode mode, float celsius,
+                                        float load, uint64_t now_ms) {
+  if (failures_ > 0 && now_ms < retry_ms_) {
+    return mode;
+  }
+
+  // Modes are ordered from the slowest to the fastest.
+  const int slowest = static_cast<int>(config_.slowest);
+  const int fastest = std::max(static_cast<int>(config_.fastest), slowest);
+  const int current = static_cast<int>(mode);
+  int level = std::clamp(current, slowest, fastest);
+
+  // Slows down past every trip point reached at once.
+  while (level > slowest &&
+         celsius >= TripCelsius(static_cast<PerformanceMode>(level))) {
+    --level;
+  }
+
+  // Speeds up one mode at a time, once the temperature is well below the
+  // trip point of the next mode and there is work to speed up.
+  if (level == current && level < fastest && load >= config_.raise_load &&
+      celsius < TripCelsius(static_cast<PerformanceMode>(level + 1)) -
+                    config_.hysteresis_celsius &&
+      (!changed_ || now_ms - changed_ms_ >= config_.min_dwell_ms)) {
+    ++level;
+  }
+
+  if (level != current) {
+    changed_ = true;
+    changed_ms_ = now_ms;
+  }
+  return static_cast<PerformanceMode>(level);
+}
+
+void EdgeTpuGovernor::Switched(bool ok, uint64_t now_ms) {
+  if (ok) {
+    failures_ = 0;
+    return;
+  }
+  uint64_t backoff_ms = config_.period_ms;
+  for (int i = 0; i < failures_ && backoff_ms < config_.min_dwell_ms; ++i) {
+    backoff_ms *= 2;
+  }
+  backoff_ms = std::max<uint64_t>(
+      std::min<uint64_t>(backoff_ms, config_.min_dwell_ms), config_.period_ms);
+  ++failures_;
+  retry_ms_ = now_ms + backoff_ms;
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_GOVERNOR_H_
+#define LIBS_TPU_EDGETPU_GOVERNOR_H_
+
+#include <cstdint>
+
+#include "libs/tpu/edgetpu_driver.h"
+
+namespace coralmicro {
+
+// Settings of the Edge TPU performance governor, which picks the
+// `PerformanceMode` of the Edge TPU at run time from its temperature and
+// load. See `EdgeTpuManager::StartGovernor()`.
+struct EdgeTpuGovernorConfig {
+  // Fastest and slowest modes the governor may pick.
+  PerformanceMode fastest = PerformanceMode::kMax;
+  PerformanceMode slowest = PerformanceMode::kLow;
+  // Temperatures, in degrees Celsius, from which the Edge TPU can no longer
+  // run at `kMax`, `kHigh` and `kMedium`, respectively. The governor slows
+  // the Edge TPU down as soon as one is reached.
+  float trip_celsius[3] = {85.0f, 90.0f, 95.0f};
+  // How far below the trip point of a faster mode the temperature must fall
+  // before the governor speeds the Edge TPU back up to it.
+  float hysteresis_celsius = 5.0f;
+  // Fraction of the time the Edge TPU must have been busy for the governor
+  // to speed it up. Below that, a faster clock gains little throughput.
+  float raise_load = 0.5f;
+  // How often the temperature and load are sampled, in milliseconds.
+  uint32_t period_ms = 1000;
+  // Shortest time between two speed-ups, in milliseconds. Each change of
+  // mode resets the Edge TPU and drops its cached parameters, so the mode
+  // shouldn't change more often than the temperature does. Slow-downs are
+  // never delayed.
+  uint32_t min_dwell_ms = 10000;
+};
+
+// State of the Edge TPU performance governor.
+struct EdgeTpuGovernorStats {
+  // True while the governor runs.
+  bool running;
+  // Mode the Edge TPU runs at.
+  PerformanceMode mode;
+  // Temperature and load at the last sample. The load is the fraction of
+  // the last period the Edge TPU was busy.
+  float celsius;
+  float load;
+  // Times the governor slowed the Edge TPU down for its temperature, and
+  // sped it back up.
+  uint32_t throttles;
+  uint32_t raises;
+  // Times switching the mode failed.
+  uint32_t failures;
+};
+
+// @cond Do not generate docs
+// Decides the mode of the Edge TPU from samples of its temperature and load.
+class EdgeTpuGovernor {
+ public:
+  explicit EdgeTpuGovernor(const EdgeTpuGovernorConfig& config)
+      : config_(config) {}
+
+  const EdgeTpuGovernorConfig& config() const { return config_; }
+
+  // Returns the mode to run at, given the current mode, the temperature in
+  // degrees Celsius, the load, and the time in milliseconds.
+  PerformanceMode Update(PerformanceMode mode, float celsius, float load,
+                         uint64_t now_ms);
+  // Reports whether switching to the mode `Update()` returned at `now_ms`
+  // worked. After a failure, `Update()` keeps the current mode for a period
+  // before trying again, and for twice as long after each failure in a row,
+  // up to `config.min_dwell_ms`.
+  void Switched(bool ok, uint64_t now_ms);
+
+ private:
+  // Highest temperature `mode` may run at.
+  float TripCelsius(PerformanceMode mode) const;
+
+  EdgeTpuGovernorConfig config_;
+  // When the mode last changed.
+  uint64_t changed_ms_ = 0;
+  bool changed_ = false;
+  // Failed switches in a row, and when the mode may next change after them.
+  int failures_ = 0;
+  uint64_t retry_ms_ = 0;
+};
+// @endcond
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_GOVERNOR_H_
@@ -16,23 +16,135 @@
 
 #include "libs/tpu/edgetpu_manager.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <type_traits>
 
 #include "libs/base/check.h"
 #include "libs/base/mutex.h"
+#include "libs/base/queue_task.h"
+#include "libs/base/tasks.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_op.h"
 #include "libs/tpu/edgetpu_task.h"
 #include "third_party/flatbuffers/include/flatbuffers/flatbuffers.h"
-#include "third_party/flatbuffers/include/flatbuffers/flexbuffers.h"
 #include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
+#include "third_party/tflite-micro/tensorflow/lite/schema/schema_generated.h"
 
 namespace coralmicro {
 namespace {
-constexpr char kKeyVersion[] = "1";
-constexpr char kKeyChipName[] = "2";
-constexpr char kKeyParamCache_DEPRECATED[] = "3";
-constexpr char kKeyExecutable[] = "4";
+// Completion events InvokeBatch() leaves queued, as many as the driver can
+// queue.
+constexpr size_t kMaxQueuedEvents = 2;
+
+// Output buffers of executables that only upload parameters.
+uint8_t* NoOutputs(int index, size_t size) { return nullptr; }
+
+struct SubmitRequest {
+  EdgeTpuInference* inference;
+};
+
+inline constexpr char kEdgeTpuSubmitTaskName[] = "edgetpu_submit";
+
+// Runs the inferences from EdgeTpuManager::Submit() in turn.
+class EdgeTpuSubmitTask
+    : public QueueTask<SubmitRequest, TfLiteStatus, kEdgeTpuSubmitTaskName,
+                       configMINIMAL_STACK_SIZE * 10, kEdgeTpuTaskPriority,
+                       /*QueueLength=*/4> {
+ public:
+  static EdgeTpuSubmitTask* GetSingleton() {
+    static EdgeTpuSubmitTask task;
+    return &task;
+  }
+
+  void Submit(EdgeTpuInference* inference) {
+    SubmitRequest req{inference};
+    SendRequestAsync(req);
+  }
+
+ private:
+  void RequestHandler(SubmitRequest* req) override {
+    EdgeTpuManager::GetSingleton()->RunSubmitted(req->inference);
+  }
+};
+
+// Adds the time from its creation to its destruction to `*total_us`.
+class BusyTimer {
+ public:
+  explicit BusyTimer(uint64_t* total_us)
+      : total_us_(total_us), start_us_(TimerMicros()) {}
+  ~BusyTimer() { *total_us_ += TimerMicros() - start_us_; }
+  BusyTimer(const BusyTimer&) = delete;
+  BusyTimer& operator=(const BusyTimer&) = delete;
+
+ private:
+  uint64_t* total_us_;
+  uint64_t start_us_;
+};
+
+void GovernorTaskMain(void* param) {
+  static_cast<EdgeTpuManager*>(param)->RunGovernor();
+  vTaskDelete(nullptr);
+}
+
+// Returns the index in `list` of the tensor `tensor`, or -1.
+int IndexOfTensor(const flatbuffers::Vector<int32_t>* list, int32_t tensor) {
+  for (size_t i = 0; i < list->size(); ++i) {
+    if (list->Get(i) == tensor) return i;
+  }
+  return -1;
+}
 }  // namespace
 
+EdgeTpuPackage* EdgeTpuPackage::Create(
+    EdgeTpuArena* arena, const platforms::darwinn::Executable* inference_exe,
+    const platforms::darwinn::Executable* parameter_caching_exe) {
+  static_assert(std::is_trivially_destructible<EdgeTpuPackage>::value,
+                "Objects in an arena are never destroyed");
+  void* memory =
+      arena->Allocate(sizeof(EdgeTpuPackage), alignof(EdgeTpuPackage));
+  if (!memory) {
+    return nullptr;
+  }
+  auto* package = new (memory) EdgeTpuPackage();
+  package->inference_ = EdgeTpuExecutable::Create(arena, inference_exe);
+  if (!package->inference_) {
+    return nullptr;
+  }
+  package->inference_->set_profile(&package->profile_);
+  if (parameter_caching_exe) {
+    package->parameter_caching_ =
+        EdgeTpuExecutable::Create(arena, parameter_caching_exe);
+    if (!package->parameter_caching_) {
+      return nullptr;
+    }
+    package->parameter_caching_->set_profile(&package->profile_);
+  }
+  return package;
+}
+
+EdgeTpuInference::EdgeTpuInference(EdgeTpuPackage* package,
+                                   EdgeTpuBatchItem item)
+    : package_(package), items_{std::move(item)} {
+  finished_ = xSemaphoreCreateBinaryStatic(&finished_storage_);
+  CHECK(finished_);
+}
+
+EdgeTpuInference::~EdgeTpuInference() { vSemaphoreDelete(finished_); }
+
+TfLiteStatus EdgeTpuInference::Wait(TickType_t timeout) {
+  if (xSemaphoreTake(finished_, timeout) != pdTRUE) {
+    return kTfLiteError;
+  }
+  // Leaves it given for the next wait.
+  xSemaphoreGive(finished_);
+  return status_;
+}
+
 EdgeTpuContext::EdgeTpuContext() {
   EdgeTpuTask::GetSingleton()->SetPower(true);
 }
@@ -53,7 +165,7 @@ void EdgeTpuManager::NotifyConnected(
 
   // The EdgeTPU has left the USB bus -- clean up state.
   if (!usb_instance_) {
-    current_parameter_caching_token_ = 0;
+    ClearParameterCache();
   }
 }
 
@@ -79,9 +191,11 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
   }
 
   // Got tpu usb instance, init the tpu driver.
-  if (!tpu_driver_.Initialize(usb_instance_, mode)) {
+  usb_transport_.set_usb_instance(usb_instance_);
+  if (!tpu_driver_.Initialize(&usb_transport_, mode)) {
     return nullptr;
   }
+  performance_mode_ = mode;
 
   context_ = context;
   return context;
@@ -90,104 +204,535 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
 EdgeTpuPackage* EdgeTpuManager::RegisterPackage(const char* package_content,
                                                 size_t length) {
   MutexLock lock(mutex_);
-  auto package_ptr = (uintptr_t)package_content;
-
-  if (packages_.find(package_ptr) != packages_.end()) {
-    return packages_[package_ptr];
+  if (auto* package = FindPackage(package_content)) {
+    ++package->references_;
+    return package;
   }
 
-  auto flexbuffer_map =
-      flexbuffers::GetRoot((const uint8_t*)package_ptr, length).AsMap();
-  auto package_binary = flexbuffer_map[kKeyExecutable].AsString();
-  flatbuffers::Verifier package_verifier((const uint8_t*)package_binary.c_str(),
-                                         package_binary.length());
-  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
-    printf("Package verification failed.\r\n");
+  const platforms::darwinn::Executable* inference_exe;
+  const platforms::darwinn::Executable* parameter_caching_exe;
+  if (!ParseEdgeTpuPackage(package_content, length, &inference_exe,
+                           &parameter_caching_exe)) {
     return nullptr;
   }
 
+  return NewPackage(package_content, inference_exe, parameter_caching_exe);
+}
+
+void EdgeTpuManager::UnregisterPackage(EdgeTpuPackage* package) {
+  if (!package) return;
+  MutexLock lock(mutex_);
+  if (package->references_ == 0 || --package->references_ > 0) {
+    return;
+  }
+  // Another package may be allocated where this one was, so its parameters
+  // must not be taken for those of the new package.
+  for (auto it = cached_packages_.begin(); it != cached_packages_.end();
+       ++it) {
+    if (it->package == package) {
+      EvictParameters(it);
+      break;
+    }
+  }
+  FreePackages();
+}
+
+bool EdgeTpuManager::SetPackageArena(uint8_t* arena, size_t size) {
+  MutexLock lock(mutex_);
+  if (packages_) {
+    printf("Can't set the package arena while packages are registered\r\n");
+    return false;
+  }
+  package_arena_ =
+      arena ? std::make_unique<EdgeTpuArena>(arena, size) : nullptr;
+  heap_package_peak_ = 0;
+  return true;
+}
+
+EdgeTpuPackageArenaStats EdgeTpuManager::GetPackageArenaStats() {
+  MutexLock lock(mutex_);
+  if (package_arena_) {
+    return {package_arena_->size(), package_arena_->used(),
+            package_arena_->peak()};
+  }
+  return {0, PackageBytes(), heap_package_peak_};
+}
+
+EdgeTpuPackage* EdgeTpuManager::FindPackage(const char* package_content) {
+  // Unregistered packages are skipped even if they are not freed yet, since
+  // their model may have been replaced by another at the same address.
+  for (auto* package = packages_; package; package = package->next_) {
+    if (package->references_ > 0 && package->content_ == package_content) {
+      return package;
+    }
+  }
+  return nullptr;
+}
+
+EdgeTpuPackage* EdgeTpuManager::NewPackage(
+    const char* package_content,
+    const platforms::darwinn::Executable* inference_exe,
+    const platforms::darwinn::Executable* parameter_caching_exe) {
+  std::unique_ptr<EdgeTpuArena> heap_arena;
+  EdgeTpuArena* arena = package_arena_.get();
+  if (!arena) {
+    heap_arena = std::make_unique<EdgeTpuArena>();
+    arena = heap_arena.get();
+  }
+  const auto mark = arena->mark();
   auto* package =
-      flatbuffers::GetRoot<platforms::darwinn::Package>(package_binary.c_str());
-  if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
-    printf("No executables to register.\r\n");
+      EdgeTpuPackage::Create(arena, inference_exe, parameter_caching_exe);
+  if (!package) {
+    printf("Out of memory for the Edge TPU package\r\n");
+    arena->Release(mark);
     return nullptr;
   }
+  package->content_ = package_content;
+  package->references_ = 1;
+  package->arena_mark_ = mark;
+  package->heap_arena_ = heap_arena.release();
 
-  auto* multi_executable =
-      flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
-          package->serialized_multi_executable()->data());
-  flatbuffers::Verifier multi_executable_verifier(
-      package->serialized_multi_executable()->data(),
-      flatbuffers::VectorLength(package->serialized_multi_executable()));
-  if (!multi_executable_verifier
-           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
-    printf("MultiExecutable verification failed.\r\n");
-    return nullptr;
+  auto** link = &packages_;
+  while (*link) link = &(*link)->next_;
+  *link = package;
+  if (package->heap_arena_) {
+    heap_package_peak_ = std::max(heap_package_peak_, PackageBytes());
+  }
+  return package;
+}
+
+void EdgeTpuManager::FreePackages() {
+  // Packages on the heap are freed at once. Those in the package arena are
+  // freed once they are all unregistered from some package to the end of the
+  // list, by rolling the arena back to where that package starts.
+  EdgeTpuPackage** unused_tail = nullptr;
+  for (auto** link = &packages_; *link;) {
+    EdgeTpuPackage* package = *link;
+    if (package->references_ > 0) {
+      unused_tail = nullptr;
+    } else if (package->heap_arena_) {
+      *link = package->next_;
+      // Frees the package itself too.
+      delete package->heap_arena_;
+      continue;
+    } else if (!unused_tail) {
+      unused_tail = link;
+    }
+    link = &package->next_;
   }
+  if (unused_tail) {
+    package_arena_->Release((*unused_tail)->arena_mark_);
+    *unused_tail = nullptr;
+  }
+}
 
-  const platforms::darwinn::Executable* inference_exe = nullptr;
-  const platforms::darwinn::Executable* parameter_caching_exe = nullptr;
+size_t EdgeTpuManager::PackageBytes() const {
+  if (package_arena_) {
+    return package_arena_->used();
+  }
+  size_t bytes = 0;
+  for (auto* package = packages_; package; package = package->next_) {
+    bytes += package->heap_arena_->used();
+  }
+  return bytes;
+}
+
+TfLiteStatus EdgeTpuManager::Invoke(EdgeTpuPackage* package,
+                                    TfLiteContext* context, TfLiteNode* node) {
+  EdgeTpuScheduler::Grant grant(&scheduler_,
+                                package->parameter_caching_token(),
+                                xTaskGetCurrentTaskHandle());
+  MutexLock lock(mutex_);
+  BusyTimer busy(&busy_us_);
+  if (!PrepareParameters(package)) {
+    return kTfLiteError;
+  }
+
+  return package->inference_exe()->Invoke(tpu_driver_, context, node);
+}
+
+TfLiteStatus EdgeTpuManager::InvokeBatch(
+    EdgeTpuPackage* package, const std::vector<EdgeTpuBatchItem>& items,
+    const EdgeTpuBatchCallback& callback) {
+  return RunBatch(package, items, callback, xTaskGetCurrentTaskHandle());
+}
+
+std::shared_ptr<EdgeTpuInference> EdgeTpuManager::Submit(
+    EdgeTpuPackage* package, const EdgeTpuBatchItem& item) {
+  auto inference = std::make_shared<EdgeTpuInference>(package, item);
+  inference->requester_ = xTaskGetCurrentTaskHandle();
+  inference->requester_priority_ = uxTaskPriorityGet(nullptr);
+  inference->self_ = inference;
+  {
+    MutexLock lock(mutex_);
+    if (!submit_task_started_) {
+      EdgeTpuSubmitTask::GetSingleton()->Init();
+      submit_task_started_ = true;
+    }
+  }
+  EdgeTpuSubmitTask::GetSingleton()->Submit(inference.get());
+  return inference;
+}
+
+std::shared_ptr<EdgeTpuInference> EdgeTpuManager::Submit(
+    const tflite::Model* model, tflite::MicroInterpreter* interpreter) {
+  if (!model->subgraphs() || model->subgraphs()->size() != 1) {
+    printf("Model must have one subgraph\r\n");
+    return nullptr;
+  }
+  const auto* subgraph = model->subgraphs()->Get(0);
+  if (!subgraph->operators() || subgraph->operators()->size() != 1) {
+    printf("Model must have a single operator\r\n");
+    return nullptr;
+  }
+  const auto* op = subgraph->operators()->Get(0);
+  const auto* op_code = model->operator_codes()->Get(op->opcode_index());
+  if (!op_code->custom_code() ||
+      strcmp(op_code->custom_code()->c_str(), kCustomOp) != 0 ||
+      !op->custom_options()) {
+    printf("Model operator is not %s\r\n", kCustomOp);
+    return nullptr;
+  }
+  // The interpreter registered the package when it allocated its tensors.
+  EdgeTpuPackage* package;
+  {
+    MutexLock lock(mutex_);
+    package = FindPackage(
+        reinterpret_cast<const char*>(op->custom_options()->data()));
+  }
+  if (!package) {
+    printf("Model package is not registered\r\n");
+    return nullptr;
+  }
 
-  for (const auto* executable_serialized :
-       *(multi_executable->serialized_executables())) {
-    flatbuffers::Verifier verifier(
-        (const uint8_t*)executable_serialized->c_str(),
-        executable_serialized->size());
-    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
-      printf("Executable verification failed.\r\n");
+  // The op reads its first input, and writes its outputs in its own order,
+  // which may not be the order of the model's outputs.
+  EdgeTpuBatchItem item;
+  int input = IndexOfTensor(subgraph->inputs(), op->inputs()->Get(0));
+  if (input < 0) {
+    printf("Operator input is not a model input\r\n");
+    return nullptr;
+  }
+  item.input = interpreter->input(input)->data.uint8;
+  item.input_size = interpreter->input(input)->bytes;
+  for (size_t i = 0; i < op->outputs()->size(); ++i) {
+    int output = IndexOfTensor(subgraph->outputs(), op->outputs()->Get(i));
+    if (output < 0) {
+      printf("Operator output is not a model output\r\n");
       return nullptr;
     }
+    TfLiteTensor* tensor = interpreter->output(output);
+    item.outputs.push_back({tensor->data.uint8, tensor->bytes});
+  }
+  return Submit(package, item);
+}
+
+void EdgeTpuManager::RunSubmitted(EdgeTpuInference* inference) {
+  // Takes over the reference the inference kept to itself.
+  std::shared_ptr<EdgeTpuInference> keep = std::move(inference->self_);
+  vTaskPrioritySet(nullptr, inference->requester_priority_);
+  inference->status_ = RunBatch(inference->package_, inference->items_, {},
+                                inference->requester_);
+  inference->done_ = true;
+  xSemaphoreGive(inference->finished_);
+}
+
+TfLiteStatus EdgeTpuManager::RunBatch(
+    EdgeTpuPackage* package, const std::vector<EdgeTpuBatchItem>& items,
+    const EdgeTpuBatchCallback& callback, TaskHandle_t requester) {
+  EdgeTpuScheduler::Grant grant(&scheduler_,
+                                package->parameter_caching_token(), requester);
+  std::optional<MutexLock> lock(std::in_place, mutex_);
+  std::optional<BusyTimer> busy(std::in_place, &busy_us_);
+  if (!PrepareParameters(package)) {
+    return kTfLiteError;
+  }
+
+  // The callback runs with the lock released, so it can call the getters of
+  // the manager. The grant keeps other inferences off the Edge TPU meanwhile.
+  auto report = [&](size_t index, TfLiteStatus item_status) {
+    if (!callback) return;
+    busy.reset();
+    lock.reset();
+    callback(index, item_status);
+    lock.emplace(mutex_);
+    busy.emplace(&busy_us_);
+  };
+
+  // Each item is sent as soon as the outputs of the one before it are in,
+  // while the read of that one's completion event is still queued.
+  auto* exe = package->inference_exe();
+  TfLiteStatus status = kTfLiteOk;
+  size_t sent = 0;
+  size_t done = 0;
+  // Waits for the completion event of the oldest item sent, and reports it.
+  auto finish_oldest = [&]() {
+    TfLiteStatus item_status =
+        exe->WaitEvent(tpu_driver_) ? kTfLiteOk : kTfLiteError;
+    report(done, item_status);
+    ++done;
+    if (item_status != kTfLiteOk) status = item_status;
+  };
+  for (const auto& item : items) {
+    TfLiteStatus submitted =
+        exe->Submit(tpu_driver_, item.input, item.input_size,
+                    [&item](int index, size_t size) -> uint8_t* {
+                      if (index >= static_cast<int>(item.outputs.size()) ||
+                          item.outputs[index].size < size) {
+                        return nullptr;
+                      }
+                      return item.outputs[index].data;
+                    });
+    if (submitted != kTfLiteOk) {
+      while (done < sent) finish_oldest();
+      report(sent, submitted);
+      return submitted;
+    }
+    ++sent;
+    if (sent - done == kMaxQueuedEvents) {
+      finish_oldest();
+      // The items already sent are still reported, but no more are sent.
+      if (status != kTfLiteOk) break;
+    }
+  }
+  while (done < sent) finish_oldest();
+  return status;
+}
 
-    const auto* executable =
-        flatbuffers::GetRoot<platforms::darwinn::Executable>(
-            (const uint8_t*)executable_serialized->c_str());
-    if (executable->type() ==
-            platforms::darwinn::ExecutableType_EXECUTION_ONLY ||
-        executable->type() == platforms::darwinn::ExecutableType_STAND_ALONE) {
-      inference_exe = executable;
-    } else if (executable->type() ==
-               platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
-      parameter_caching_exe = executable;
+bool EdgeTpuManager::PrepareParameters(EdgeTpuPackage* package) {
+  if (package->parameter_caching_exe()) {
+    return CacheParameters(package);
+  }
+  // The parameters of a stand-alone model overwrite the cache.
+  ClearParameterCache();
+  return true;
+}
+
+bool EdgeTpuManager::CacheParameters(EdgeTpuPackage* package) {
+  auto* exe = package->parameter_caching_exe();
+  ++cache_clock_;
+
+  // Models compiled apart place their parameters at the same addresses.
+  auto token = exe->ParameterCachingToken();
+  if (token != current_parameter_caching_token_) {
+    ClearParameterCache();
+  }
+
+  for (auto& cached : cached_packages_) {
+    if (cached.package == package) {
+      cached.used = cache_clock_;
+      ++cache_stats_.hits;
+      return true;
     }
   }
 
-  if (inference_exe == nullptr) {
-    printf("Package does not have inference executable.\r\n");
-    return nullptr;
+  ++cache_stats_.misses;
+  const size_t bytes = exe->ParameterSizeBytes();
+  if (bytes > cache_capacity_) {
+    // Doesn't fit even on its own, so it's sent without being remembered.
+    cache_stats_.upload_bytes += bytes;
+    return exe->Invoke(tpu_driver_, nullptr, 0, NoOutputs) == kTfLiteOk;
+  }
+  while (cached_bytes_ + bytes > cache_capacity_) {
+    EvictParameters(NextToEvict());
   }
 
-  auto* edgetpu_package =
-      new EdgeTpuPackage(inference_exe, parameter_caching_exe);
-  packages_[package_ptr] = edgetpu_package;
+  cache_stats_.upload_bytes += bytes;
+  if (exe->Invoke(tpu_driver_, nullptr, 0, NoOutputs) != kTfLiteOk) {
+    // Part of the cache may have been overwritten.
+    ClearParameterCache();
+    return false;
+  }
+  current_parameter_caching_token_ = token;
+  cached_packages_.push_back({package, bytes, cache_clock_, cache_clock_});
+  cached_bytes_ += bytes;
+  return true;
+}
 
-  return edgetpu_package;
+std::vector<EdgeTpuManager::CachedPackage>::iterator
+EdgeTpuManager::NextToEvict() {
+  auto victim = cached_packages_.begin();
+  for (auto it = cached_packages_.begin(); it != cached_packages_.end(); ++it) {
+    bool older = cache_policy_ == ParameterCachePolicy::kLeastRecentlyUsed
+                     ? it->used < victim->used
+                     : it->uploaded < victim->uploaded;
+    if (older) victim = it;
+  }
+  return victim;
 }
 
-TfLiteStatus EdgeTpuManager::Invoke(EdgeTpuPackage* package,
-                                    TfLiteContext* context, TfLiteNode* node) {
+void EdgeTpuManager::EvictParameters(
+    std::vector<CachedPackage>::iterator it) {
+  cached_bytes_ -= it->bytes;
+  cached_packages_.erase(it);
+  ++cache_stats_.evictions;
+}
+
+void EdgeTpuManager::ClearParameterCache() {
+  while (!cached_packages_.empty()) {
+    EvictParameters(cached_packages_.begin());
+  }
+  current_parameter_caching_token_ = 0;
+}
+
+void EdgeTpuManager::SetRequestOptions(const EdgeTpuRequestOptions& options) {
+  scheduler_.SetTaskOptions(xTaskGetCurrentTaskHandle(), options);
+}
+
+void EdgeTpuManager::ClearRequestOptions() {
+  scheduler_.ClearTaskOptions(xTaskGetCurrentTaskHandle());
+}
+
+EdgeTpuSchedulerStats EdgeTpuManager::GetSchedulerStats() {
+  return scheduler_.GetStats();
+}
+
+void EdgeTpuManager::ResetSchedulerStats() { scheduler_.ResetStats(); }
+
+std::vector<EdgeTpuPackageProfile> EdgeTpuManager::GetProfiles() {
   MutexLock lock(mutex_);
-  if (package->parameter_caching_exe()) {
-    auto token = package->parameter_caching_exe()->ParameterCachingToken();
-    if (token != current_parameter_caching_token_) {
-      cached_packages_.fill(nullptr);
-      package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-      current_parameter_caching_token_ = token;
-      cached_packages_[0] = package;
-    } else {
-      for (auto& cached_package : cached_packages_) {
-        if (cached_package == package) {
-          break;
-        } else if (cached_package == nullptr) {
-          package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-          cached_package = package;
-        }
+  std::vector<EdgeTpuPackageProfile> profiles;
+  for (auto* package = packages_; package; package = package->next_) {
+    if (package->references_ == 0) continue;
+    const char* name = package->inference_exe()->name();
+    profiles.push_back(
+        {name && *name ? name : "package_" + std::to_string(profiles.size()),
+         package->profile()});
+  }
+  return profiles;
+}
+
+void EdgeTpuManager::ResetProfiles() {
+  MutexLock lock(mutex_);
+  for (auto* package = packages_; package; package = package->next_) {
+    package->profile() = {};
+  }
+}
+
+void EdgeTpuManager::SetParameterCacheCapacity(size_t bytes) {
+  MutexLock lock(mutex_);
+  cache_capacity_ = bytes;
+  // Shrinking the budget evicts models the same way a new one would.
+  while (cached_bytes_ > cache_capacity_) {
+    EvictParameters(NextToEvict());
+  }
+}
+
+void EdgeTpuManager::SetParameterCachePolicy(ParameterCachePolicy policy) {
+  MutexLock lock(mutex_);
+  cache_policy_ = policy;
+}
+
+ParameterCacheStats EdgeTpuManager::GetParameterCacheStats() {
+  MutexLock lock(mutex_);
+  return cache_stats_;
+}
+
+void EdgeTpuManager::ResetParameterCacheStats() {
+  MutexLock lock(mutex_);
+  cache_stats_ = {};
+}
+
+bool EdgeTpuManager::SetPerformanceMode(PerformanceMode mode) {
+  // The Edge TPU must be idle, and its cache is empty after.
+  EdgeTpuScheduler::Grant grant(&scheduler_, 0, xTaskGetCurrentTaskHandle());
+  MutexLock lock(mutex_);
+  if (context_.expired() || !usb_instance_) {
+    return false;
+  }
+  if (mode == performance_mode_) {
+    return true;
+  }
+  ClearParameterCache();
+  if (!tpu_driver_.SetPerformanceMode(mode)) {
+    printf("Failed to set the Edge TPU performance mode\r\n");
+    return false;
+  }
+  performance_mode_ = mode;
+  return true;
+}
+
+void EdgeTpuManager::StartGovernor(const EdgeTpuGovernorConfig& config) {
+  MutexLock lock(mutex_);
+  governor_.emplace(config);
+  governor_stats_.running = true;
+  // A task told to stop that hasn't yet carries on instead.
+  if (!governor_task_) {
+    CHECK(xTaskCreate(GovernorTaskMain, "edgetpu_governor",
+                      configMINIMAL_STACK_SIZE * 10, this, kEdgeTpuTaskPriority,
+                      &governor_task_) == pdPASS);
+  }
+}
+
+void EdgeTpuManager::StopGovernor() {
+  MutexLock lock(mutex_);
+  governor_stats_.running = false;
+  if (governor_task_) xTaskNotifyGive(governor_task_);
+}
+
+EdgeTpuGovernorStats EdgeTpuManager::GetGovernorStats() {
+  MutexLock lock(mutex_);
+  EdgeTpuGovernorStats stats = governor_stats_;
+  stats.mode = performance_mode_;
+  return stats;
+}
+
+void EdgeTpuManager::RunGovernor() {
+  uint64_t last_us = TimerMicros();
+  uint64_t last_busy_us;
+  {
+    MutexLock lock(mutex_);
+    last_busy_us = busy_us_;
+  }
+  for (;;) {
+    uint32_t period_ms;
+    {
+      MutexLock lock(mutex_);
+      if (!governor_stats_.running) {
+        governor_task_ = nullptr;
+        return;
       }
+      period_ms = governor_->config().period_ms;
     }
-  } else {
-    current_parameter_caching_token_ = 0;
-  }
+    // Woken early to stop.
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(period_ms));
 
-  return package->inference_exe()->Invoke(tpu_driver_, context, node);
+    PerformanceMode current;
+    PerformanceMode next;
+    {
+      MutexLock lock(mutex_);
+      // No inference runs while the lock is held, so busy_us_ is up to date.
+      const uint64_t now_us = TimerMicros();
+      const float load =
+          now_us > last_us
+              ? std::min(1.0f, static_cast<float>(busy_us_ - last_busy_us) /
+                                   (now_us - last_us))
+              : 0.0f;
+      last_us = now_us;
+      last_busy_us = busy_us_;
+      if (!governor_stats_.running || context_.expired() || !usb_instance_) {
+        continue;
+      }
+      governor_stats_.celsius = tpu_driver_.GetTemperature();
+      governor_stats_.load = load;
+      current = performance_mode_;
+      next = governor_->Update(current, governor_stats_.celsius, load,
+                               now_us / 1000);
+    }
+    if (next == current) {
+      continue;
+    }
+    const bool ok = SetPerformanceMode(next);
+    MutexLock lock(mutex_);
+    governor_->Switched(ok, TimerMicros() / 1000);
+    if (!ok) {
+      ++governor_stats_.failures;
+    } else if (next < current) {
+      ++governor_stats_.throttles;
+    } else {
+      ++governor_stats_.raises;
+    }
+  }
 }
 
 std::optional<float> EdgeTpuManager::GetTemperature() {
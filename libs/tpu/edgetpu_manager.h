@@ -17,19 +17,31 @@
 #ifndef LIBS_TPU_EDGETPU_MANAGER_H_
 #define LIBS_TPU_EDGETPU_MANAGER_H_
 
+#include <atomic>
 #include <cstdlib>
-#include <map>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
+#include "libs/tpu/edgetpu_arena.h"
 #include "libs/tpu/edgetpu_driver.h"
 #include "libs/tpu/edgetpu_executable.h"
+#include "libs/tpu/edgetpu_governor.h"
+#include "libs/tpu/edgetpu_scheduler.h"
+#include "libs/tpu/edgetpu_usb_transport.h"
 #include "libs/tpu/executable_generated.h"
 #include "libs/tpu/usb_host_edgetpu.h"
 #include "third_party/freertos_kernel/include/FreeRTOS.h"
 #include "third_party/freertos_kernel/include/semphr.h"
 #include "third_party/tflite-micro/tensorflow/lite/c/common.h"
 
+namespace tflite {
+class MicroInterpreter;
+struct Model;
+}  // namespace tflite
+
 namespace coralmicro {
 
 // This class is a representation of the Edge TPU device, so there is one
@@ -55,25 +67,141 @@ class EdgeTpuContext {
 // @cond Do not generate docs
 class EdgeTpuPackage {
  public:
-  EdgeTpuPackage(const platforms::darwinn::Executable* inference_exe,
-                 const platforms::darwinn::Executable* parameter_caching_exe) {
-    inference_ = std::make_unique<EdgeTpuExecutable>(inference_exe);
-    if (parameter_caching_exe) {
-      parameter_caching_ =
-          std::make_unique<EdgeTpuExecutable>(parameter_caching_exe);
-    }
-  }
-  EdgeTpuExecutable* parameter_caching_exe() {
-    return parameter_caching_.get();
+  // Creates the package and its executables in `arena`, or returns nullptr
+  // if it is full.
+  static EdgeTpuPackage* Create(
+      EdgeTpuArena* arena, const platforms::darwinn::Executable* inference_exe,
+      const platforms::darwinn::Executable* parameter_caching_exe);
+  EdgeTpuPackage(const EdgeTpuPackage&) = delete;
+  EdgeTpuPackage& operator=(const EdgeTpuPackage&) = delete;
+
+  EdgeTpuExecutable* parameter_caching_exe() { return parameter_caching_; }
+  EdgeTpuExecutable* inference_exe() { return inference_; }
+  // The parameter caching token of the package, or 0 if it doesn't cache
+  // parameters.
+  uint64_t parameter_caching_token() const {
+    return parameter_caching_ ? parameter_caching_->ParameterCachingToken()
+                              : 0;
   }
-  EdgeTpuExecutable* inference_exe() { return inference_.get(); }
+  EdgeTpuProfile& profile() { return profile_; }
 
  private:
-  std::unique_ptr<EdgeTpuExecutable> inference_;
-  std::unique_ptr<EdgeTpuExecutable> parameter_caching_;
+  friend class EdgeTpuManager;
+
+  EdgeTpuPackage() = default;
+
+  EdgeTpuExecutable* inference_ = nullptr;
+  EdgeTpuExecutable* parameter_caching_ = nullptr;
+  EdgeTpuProfile profile_ = {};
+
+  // Kept by EdgeTpuManager: the custom options the package was registered
+  // for, how many registrations of it are left, where in the package arena
+  // it starts (or the arena of its own on the heap), and the package
+  // registered after it.
+  const char* content_ = nullptr;
+  int references_ = 0;
+  EdgeTpuArena::Mark arena_mark_ = {};
+  EdgeTpuArena* heap_arena_ = nullptr;
+  EdgeTpuPackage* next_ = nullptr;
 };
 // @endcond
 
+// Profile of the inferences of a registered package.
+struct EdgeTpuPackageProfile {
+  // Name the model was compiled with, or "package_N" if it has none, where N
+  // is the index of the profile in the list.
+  std::string name;
+  EdgeTpuProfile profile;
+};
+
+// One inference of `EdgeTpuManager::InvokeBatch()`.
+struct EdgeTpuBatchItem {
+  struct Buffer {
+    uint8_t* data;
+    size_t size;
+  };
+  // The input, laid out as the model's input tensor.
+  const uint8_t* input;
+  size_t input_size;
+  // A buffer for each output of the model, in the order of its output
+  // tensors, laid out as those tensors.
+  std::vector<Buffer> outputs;
+};
+
+// Called as each item of `EdgeTpuManager::InvokeBatch()` completes, with the
+// index of the item and its status.
+using EdgeTpuBatchCallback =
+    std::function<void(size_t index, TfLiteStatus status)>;
+
+// An inference running in the background, from `EdgeTpuManager::Submit()`.
+class EdgeTpuInference {
+ public:
+  // @cond Do not generate docs
+  // Use EdgeTpuManager::Submit() instead.
+  EdgeTpuInference(EdgeTpuPackage* package, EdgeTpuBatchItem item);
+  ~EdgeTpuInference();
+  EdgeTpuInference(const EdgeTpuInference&) = delete;
+  EdgeTpuInference& operator=(const EdgeTpuInference&) = delete;
+  // @endcond
+
+  // Waits for the inference to finish. Its outputs are ready once it has.
+  //
+  // @param timeout The most ticks to wait.
+  // @return The status of the inference, or kTfLiteError if it is still
+  //   running after `timeout`.
+  TfLiteStatus Wait(TickType_t timeout = portMAX_DELAY);
+
+  // Returns true once the inference has finished, so `Wait()` won't block.
+  bool done() const { return done_; }
+
+ private:
+  friend class EdgeTpuManager;
+
+  EdgeTpuPackage* package_;
+  // The item, as a batch of one.
+  std::vector<EdgeTpuBatchItem> items_;
+  // The task that submitted the inference, and its FreeRTOS priority.
+  TaskHandle_t requester_ = nullptr;
+  UBaseType_t requester_priority_ = 0;
+  // Keeps the inference alive while it is queued.
+  std::shared_ptr<EdgeTpuInference> self_;
+  StaticSemaphore_t finished_storage_;
+  SemaphoreHandle_t finished_;
+  std::atomic<bool> done_{false};
+  TfLiteStatus status_ = kTfLiteError;
+};
+
+// How the parameter cache picks which package to evict when it is full.
+enum class ParameterCachePolicy {
+  // Evicts the package whose model ran least recently.
+  kLeastRecentlyUsed,
+  // Evicts the package whose parameters were uploaded first.
+  kFirstInFirstOut,
+};
+
+// Memory taken by the state of registered packages.
+struct EdgeTpuPackageArenaStats {
+  // Size of the arena from `EdgeTpuManager::SetPackageArena()`, or 0 if
+  // packages are allocated on the heap.
+  size_t size;
+  // Bytes in use, including those of unregistered packages not yet freed.
+  size_t used;
+  // The most bytes in use at once since the arena was set.
+  size_t peak;
+};
+
+// Counters of the Edge TPU parameter cache, since the last reset.
+struct ParameterCacheStats {
+  // Inferences whose parameters were already on the Edge TPU.
+  uint32_t hits;
+  // Inferences that had to upload their parameters first.
+  uint32_t misses;
+  // Packages whose parameters were dropped from the cache.
+  uint32_t evictions;
+  // Bytes of parameters uploaded to the cache.
+  uint64_t upload_bytes;
+};
+
 // Singleton Edge TPU manager for allocating new instances of `EdgeTpuContext`.
 class EdgeTpuManager {
  public:
@@ -89,12 +217,98 @@ class EdgeTpuManager {
     return &manager;
   }
 
-  // @cond Do not generate docs
+  // Registers the Edge TPU package found in the custom options of a model's
+  // `edgetpu-custom-op`, or returns the package already registered for them.
+  // The interpreter of a model registers its package when its tensors are
+  // allocated, and unregisters it when it is destroyed.
+  //
+  // The package is verified the first time it is seen. Its state is
+  // allocated from the package arena, see `SetPackageArena()`.
+  //
+  // @return The package, or nullptr if it is invalid or the package arena is
+  //   full.
   EdgeTpuPackage* RegisterPackage(const char* package_content, size_t length);
+
+  // Drops a registration of `package`. Once every `RegisterPackage()` call
+  // that returned it is matched by one of these, its parameters leave the
+  // cache and its state is freed, so that another model can take its place.
+  //
+  // No inference of the package may be running or submitted, and it must
+  // not be used after it is freed.
+  void UnregisterPackage(EdgeTpuPackage* package);
+
+  // Sets the memory the state of registered packages is allocated from, such
+  // as part of the SDRAM region the tensor arena is in, so that swapping
+  // models never fragments the heap and the memory they need is bounded.
+  // Defaults to the heap.
+  //
+  // The arena is used from its start onwards, and the memory of a package
+  // is freed once it and all packages registered after it are unregistered,
+  // so swap the models registered last. `GetPackageArenaStats()` reports how
+  // much of the arena the models of an application use.
+  //
+  // @param arena The arena, which must stay valid while packages are
+  //   registered, or nullptr to allocate from the heap.
+  // @param size The size of the arena in bytes.
+  // @return True if the arena is set, or false if packages are registered.
+  bool SetPackageArena(uint8_t* arena, size_t size);
+
+  // Gets how much memory registered packages take.
+  EdgeTpuPackageArenaStats GetPackageArenaStats();
+
+  // @cond Do not generate docs
   TfLiteStatus Invoke(EdgeTpuPackage* package, TfLiteContext* context,
                       TfLiteNode* node);
   // @endcond
 
+  // Runs `package` on each of `items` in turn, streaming them to the Edge TPU
+  // back to back. Cached parameters are uploaded at most once for the whole
+  // batch, and each item is sent as soon as the outputs of the previous one
+  // are in, without waiting for the Edge TPU to report it done.
+  //
+  // Inputs and outputs are laid out as the input and output tensors of the
+  // model's `edgetpu-custom-op`.
+  //
+  // @param package The package, from `RegisterPackage()`.
+  // @param items The inputs and output buffers of each inference.
+  // @param callback Called as each item completes, in order. Its outputs are
+  //   ready when it is called. It may call the other methods of the manager,
+  //   but not those that run inferences or change the performance mode,
+  //   which would wait for the batch to finish. Can be empty.
+  // @return kTfLiteOk if every item ran. Otherwise the batch stops at the
+  //   first item that fails, which is passed to `callback` with its status,
+  //   as are the items already sent to the Edge TPU after it.
+  TfLiteStatus InvokeBatch(EdgeTpuPackage* package,
+                           const std::vector<EdgeTpuBatchItem>& items,
+                           const EdgeTpuBatchCallback& callback = {});
+
+  // Starts an inference of `package` on `item`, and returns at once. The
+  // inference runs on a task of the Edge TPU library at the FreeRTOS
+  // priority of the calling task, and is scheduled with its request
+  // options, so the calling task can prepare the next input meanwhile.
+  //
+  // The buffers of `item` must stay valid, and the outputs untouched, until
+  // the inference is done. Inferences submitted by a task run in order.
+  // Submit blocks while four inferences are already queued.
+  //
+  // @param package The package, from `RegisterPackage()`.
+  // @param item The input and output buffers, as for `InvokeBatch()`.
+  // @return The inference, whose `Wait()` returns its status. Dropping it
+  //   doesn't cancel the inference.
+  std::shared_ptr<EdgeTpuInference> Submit(EdgeTpuPackage* package,
+                                           const EdgeTpuBatchItem& item);
+
+  // Starts an inference of a model whose graph is a single
+  // `edgetpu-custom-op`, on the input and output tensors of `interpreter`,
+  // as `Submit()` does. Use this instead of `interpreter->Invoke()`.
+  //
+  // @param model The model `interpreter` was created with.
+  // @param interpreter The interpreter, after `AllocateTensors()`.
+  // @return The inference, or nullptr if the model isn't a single
+  //   `edgetpu-custom-op`.
+  std::shared_ptr<EdgeTpuInference> Submit(
+      const tflite::Model* model, tflite::MicroInterpreter* interpreter);
+
   // Gets the default Edge TPU device (and starts it if necessary).
   //
   // The Edge TPU device (represented by `EdgeTpuContext`) can be shared among
@@ -107,7 +321,8 @@ class EdgeTpuManager {
   //
   // @param mode The `PerformanceMode` to use for the Edge TPU. Options are:
   // `kMax` (500Mhz), `kHigh` (250Mhz), `kMedium` (125Mhz), or `kLow` (63Mhz).
-  // If omitted, the default is `kHigh`.
+  // If omitted, the default is `kHigh`. It can be changed later with
+  // `SetPerformanceMode()`, or by the governor (see `StartGovernor()`).
   // **Caution**: If you set the performance mode to `kMax`, it can increase
   // the Edge TPU inferencing speed, but it can also make the Edge TPU
   // module hotter, which might cause burns if touched.
@@ -118,24 +333,182 @@ class EdgeTpuManager {
       PerformanceMode mode = PerformanceMode::kHigh);
 
   // @cond Do not generate docs
+  // Runs a submitted inference, on the task of the Edge TPU library.
+  void RunSubmitted(EdgeTpuInference* inference);
   void NotifyError();
   void NotifyConnected(usb_host_edgetpu_instance_t* usb_instance);
   // @endcond
 
+  // Sets the priority and deadline of the Edge TPU requests of the calling
+  // task, including those made by its interpreters.
+  //
+  // Inferences from different tasks take turns on the Edge TPU. When it
+  // frees up, requests with a deadline run first, earliest deadline first,
+  // whatever their priorities. Only when none waiting has a deadline do those
+  // of highest priority run first, and waiting raises the priority of a
+  // request by one level every 100 ms, so low priority requests still run.
+  // Among equal deadlines or priorities, models whose parameters are cached
+  // run first. By default, a task's requests have its FreeRTOS priority and
+  // no deadline.
+  void SetRequestOptions(const EdgeTpuRequestOptions& options);
+
+  // Restores the default options for the Edge TPU requests of the calling
+  // task.
+  void ClearRequestOptions();
+
+  // Gets the counters of the Edge TPU request scheduler.
+  EdgeTpuSchedulerStats GetSchedulerStats();
+
+  // Resets the counters of the Edge TPU request scheduler to zero.
+  void ResetSchedulerStats();
+
+  // Gets the time spent in each phase of the inferences of every registered
+  // package, since it was registered or profiles were last reset.
+  //
+  // Each inference is split into parameter, instruction, and input transfers,
+  // compute (the wait for the first chunk of each output), output transfers,
+  // the relayout of outputs into their tensors, and the wait for the event
+  // that ends it. Uploads to the parameter cache are counted in the
+  // parameters phase of the package they are for.
+  std::vector<EdgeTpuPackageProfile> GetProfiles();
+
+  // Resets the profiles of all registered packages to zero.
+  void ResetProfiles();
+
+  // Sets how many bytes of parameters the Edge TPU cache may hold. Models
+  // whose parameters don't fit with those already cached evict other models
+  // first, and models larger than the whole cache upload their parameters on
+  // each inference. Defaults to `kDefaultParameterCacheBytes`.
+  //
+  // Only models compiled together (with the same parameter caching token)
+  // can share the cache: running a model from another compilation, or one
+  // compiled without parameter caching, evicts every cached model. To keep
+  // several models cached, compile them together with `edgetpu_compiler`.
+  void SetParameterCacheCapacity(size_t bytes);
+
+  // Sets which cached model is evicted when the cache is full. Defaults to
+  // `ParameterCachePolicy::kLeastRecentlyUsed`.
+  void SetParameterCachePolicy(ParameterCachePolicy policy);
+
+  // Gets the parameter cache counters.
+  ParameterCacheStats GetParameterCacheStats();
+
+  // Resets the parameter cache counters to zero.
+  void ResetParameterCacheStats();
+
+  // Default for `SetParameterCacheCapacity()`, the size of the Edge TPU's
+  // on-chip memory.
+  static constexpr size_t kDefaultParameterCacheBytes = 8 * 1024 * 1024;
+
+  // Switches the clock rates of the open Edge TPU to those of `mode`, without
+  // closing the device. The Edge TPU goes through a reset, which takes a few
+  // milliseconds and drops the parameters cached on it. While the governor
+  // runs, it picks the mode instead.
+  //
+  // @return True if the Edge TPU now runs at `mode`, or false if it isn't
+  //   open or the switch failed.
+  bool SetPerformanceMode(PerformanceMode mode);
+
+  // Starts a task that keeps the Edge TPU within its thermal limits at the
+  // best throughput it can, by switching its performance mode at run time.
+  //
+  // Every `config.period_ms`, the task samples the Edge TPU temperature and
+  // the fraction of the period it was busy. It slows the Edge TPU down as
+  // soon as a trip point is reached, and speeds it back up one mode at a time
+  // once the temperature has fallen below the trip point by the hysteresis,
+  // if the Edge TPU is busy enough to gain from it. Mode changes wait for the
+  // inference in progress to finish. After a mode change fails, the governor
+  // keeps the current mode for a period, twice as long after each failure in
+  // a row, before it tries again. If the governor already runs, its settings
+  // are replaced.
+  void StartGovernor(const EdgeTpuGovernorConfig& config = {});
+
+  // Stops the governor task, leaving the Edge TPU at its current mode.
+  void StopGovernor();
+
+  // Gets the state of the governor.
+  EdgeTpuGovernorStats GetGovernorStats();
+
+  // @cond Do not generate docs
+  // Runs the governor, on its task.
+  void RunGovernor();
+  // @endcond
+
   // Gets the current Edge TPU junction temperature.
   // @returns The temperature in Celcius, or `std::nullopt` if
   // `EdgeTpuContext` is empty.
   std::optional<float> GetTemperature();
 
  private:
+  // A package whose parameters are in the Edge TPU cache.
+  struct CachedPackage {
+    EdgeTpuPackage* package;
+    size_t bytes;
+    // Values of `cache_clock_` when the parameters were uploaded and when the
+    // package last ran.
+    uint64_t uploaded;
+    uint64_t used;
+  };
+
+  // Returns the package registered for `package_content`, or nullptr.
+  EdgeTpuPackage* FindPackage(const char* package_content);
+  // Allocates a package for `package_content` and adds it to the registered
+  // packages, or returns nullptr if the package arena is full.
+  EdgeTpuPackage* NewPackage(
+      const char* package_content,
+      const platforms::darwinn::Executable* inference_exe,
+      const platforms::darwinn::Executable* parameter_caching_exe);
+  // Frees the unregistered packages whose memory can be taken back.
+  void FreePackages();
+  // Bytes allocated for packages, from the arena or the heap.
+  size_t PackageBytes() const;
+
+  // Runs `items` on the Edge TPU for the task `requester`.
+  TfLiteStatus RunBatch(EdgeTpuPackage* package,
+                        const std::vector<EdgeTpuBatchItem>& items,
+                        const EdgeTpuBatchCallback& callback,
+                        TaskHandle_t requester);
+  // Makes sure the Edge TPU is ready for the parameters of `package`,
+  // caching them or dropping the cache as needed.
+  bool PrepareParameters(EdgeTpuPackage* package);
+  // Makes sure the parameters of `package` are on the Edge TPU, uploading
+  // them if they aren't.
+  bool CacheParameters(EdgeTpuPackage* package);
+  // Returns the cached package the policy evicts first. The cache must not
+  // be empty.
+  std::vector<CachedPackage>::iterator NextToEvict();
+  void EvictParameters(std::vector<CachedPackage>::iterator it);
+  void ClearParameterCache();
+
+  EdgeTpuUsbTransport usb_transport_;
   TpuDriver tpu_driver_;
-  std::map<uintptr_t, EdgeTpuPackage*> packages_;
-  std::array<EdgeTpuPackage*, 2> cached_packages_;
+  // Orders inferences. `mutex_` guards the state they share with the other
+  // methods.
+  EdgeTpuScheduler scheduler_;
+  // Packages in the order they were registered, including unregistered
+  // packages that are not yet freed.
+  EdgeTpuPackage* packages_ = nullptr;
+  // Null if packages are allocated on the heap, each in an arena of its own.
+  std::unique_ptr<EdgeTpuArena> package_arena_;
+  size_t heap_package_peak_ = 0;
+  std::vector<CachedPackage> cached_packages_;
+  size_t cached_bytes_ = 0;
+  size_t cache_capacity_ = kDefaultParameterCacheBytes;
+  ParameterCachePolicy cache_policy_ = ParameterCachePolicy::kLeastRecentlyUsed;
+  ParameterCacheStats cache_stats_ = {};
+  uint64_t cache_clock_ = 0;
   uint64_t current_parameter_caching_token_ = 0;
+  PerformanceMode performance_mode_ = PerformanceMode::kHigh;
+  // Time spent running inferences, in microseconds.
+  uint64_t busy_us_ = 0;
+  std::optional<EdgeTpuGovernor> governor_;
+  EdgeTpuGovernorStats governor_stats_ = {};
+  TaskHandle_t governor_task_ = nullptr;
   usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
   std::weak_ptr<EdgeTpuContext> context_;
   SemaphoreHandle_t mutex_;
   bool usb_error_{false};
+  bool submit_task_started_ = false;
 };
 
 }  // namespace coralmicro
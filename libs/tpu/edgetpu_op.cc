@@ -25,7 +25,10 @@ void* CustomOpInit(TfLiteContext* context, const char* buffer, size_t length) {
   return EdgeTpuManager::GetSingleton()->RegisterPackage(buffer, length);
 }
 
-void CustomOpFree(TfLiteContext* context, void* buffer) {}
+void CustomOpFree(TfLiteContext* context, void* buffer) {
+  EdgeTpuManager::GetSingleton()->UnregisterPackage(
+      static_cast<EdgeTpuPackage*>(buffer));
+}
 
 TfLiteStatus CustomOpPrepare(TfLiteContext* context, TfLiteNode* node) {
   if (node->user_data == nullptr) return kTfLiteError;
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_profile.h"
+
+namespace coralmicro {
+
+const char* EdgeTpuPhaseName(EdgeTpuPhase phase) {
+  switch (phase) {
+    case EdgeTpuPhase::kParameters:
+      return "parameters";
+    case EdgeTpuPhase::kInstructions:
+      return "instructions";
+    case EdgeTpuPhase::kInputs:
+      return "inputs";
+    case EdgeTpuPhase::kCompute:
+      return "compute";
+    case EdgeTpuPhase::kOutputs:
+      return "outputs";
+    case EdgeTpuPhase::kRelayout:
+      return "relayout";
+    case EdgeTpuPhase::kEvent:
+      return "event";
+  }
+  return "unknown";
+}
+
+void EdgeTpuPhaseStats::Record(uint64_t us, uint64_t bytes) {
+  ++count;
+  total_us += us;
+  if (us > max_us) max_us = static_cast<uint32_t>(us);
+  this->bytes += bytes;
+
+  int bucket = 0;
+  while (bucket < kEdgeTpuHistogramBuckets - 1 && us >= (1ull << bucket)) {
+    ++bucket;
+  }
+  ++histogram[bucket];
+}
+
+}  // namespace coralmicro
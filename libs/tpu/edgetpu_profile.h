@@ -0,0 +1,89 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PROFILE_H_
+#define LIBS_TPU_EDGETPU_PROFILE_H_
+
+#include <cstdint>
+
+namespace coralmicro {
+
+// Phases of an Edge TPU inference.
+enum class EdgeTpuPhase {
+  // Sending parameters, whether uploaded to the parameter cache or streamed
+  // with the inference.
+  kParameters,
+  // Sending instructions.
+  kInstructions,
+  // Sending inputs, including the conversion of signed inputs.
+  kInputs,
+  // Waiting for the first chunk of each output, while the Edge TPU computes.
+  kCompute,
+  // Receiving the rest of the outputs.
+  kOutputs,
+  // Relaying out outputs into their tensors as they arrive, including the
+  // conversion of signed outputs.
+  kRelayout,
+  // Waiting for the event that ends the inference.
+  kEvent,
+};
+
+inline constexpr int kEdgeTpuPhaseCount = 7;
+
+// Returns the name of `phase`, such as "parameters".
+const char* EdgeTpuPhaseName(EdgeTpuPhase phase);
+
+// Buckets of `EdgeTpuPhaseStats::histogram`. Bucket 0 counts times under
+// 1 us, bucket i from 2^(i-1) up to 2^i us, and the last bucket everything
+// longer.
+inline constexpr int kEdgeTpuHistogramBuckets = 24;
+
+// Time and data of one phase over the inferences of a package.
+struct EdgeTpuPhaseStats {
+  // Inferences that went through the phase.
+  uint32_t count;
+  // Time spent in the phase, in microseconds.
+  uint64_t total_us;
+  // Longest time an inference spent in the phase, in microseconds.
+  uint32_t max_us;
+  // Bytes moved over USB during the phase.
+  uint64_t bytes;
+  // Time of each inference in the phase, by power of two microseconds.
+  uint32_t histogram[kEdgeTpuHistogramBuckets];
+
+  // Adds the time and bytes of one inference.
+  void Record(uint64_t us, uint64_t bytes);
+};
+
+// Time of the inferences of a package, by phase.
+struct EdgeTpuProfile {
+  // Inferences run.
+  uint32_t inferences;
+  // Time of the inferences from start to end, in microseconds.
+  uint64_t total_us;
+  EdgeTpuPhaseStats phases[kEdgeTpuPhaseCount];
+
+  EdgeTpuPhaseStats& phase(EdgeTpuPhase phase) {
+    return phases[static_cast<int>(phase)];
+  }
+  const EdgeTpuPhaseStats& phase(EdgeTpuPhase phase) const {
+    return phases[static_cast<int>(phase)];
+  }
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PROFILE_H_
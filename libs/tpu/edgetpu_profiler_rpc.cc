@@ -0,0 +1,105 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_profiler_rpc.h"
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+
+#include "libs/tpu/edgetpu_manager.h"
+#include "third_party/mjson/src/mjson.h"
+
+namespace coralmicro {
+namespace {
+void Append(std::string* json, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void Append(std::string* json, const char* format, ...) {
+  char buf[64];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  json->append(buf);
+}
+
+void AppendString(std::string* json, const std::string& str) {
+  json->push_back('"');
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+      json->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      Append(json, "\\u%04x", c);
+    } else {
+      json->push_back(c);
+    }
+  }
+  json->push_back('"');
+}
+
+void AppendPhase(std::string* json, EdgeTpuPhase phase,
+                 const EdgeTpuPhaseStats& stats) {
+  Append(json, "\"%s\":{", EdgeTpuPhaseName(phase));
+  Append(json, "\"count\":%" PRIu32 ",", stats.count);
+  Append(json, "\"total_us\":%" PRIu64 ",", stats.total_us);
+  Append(json, "\"max_us\":%" PRIu32 ",", stats.max_us);
+  Append(json, "\"bytes\":%" PRIu64 ",\"histogram\":[", stats.bytes);
+  // Trailing empty buckets are left out.
+  int buckets = kEdgeTpuHistogramBuckets;
+  while (buckets > 0 && stats.histogram[buckets - 1] == 0) --buckets;
+  for (int i = 0; i < buckets; ++i) {
+    Append(json, i ? ",%" PRIu32 : "%" PRIu32, stats.histogram[i]);
+  }
+  json->append("]}");
+}
+
+void EdgeTpuProfileRpc(struct jsonrpc_request* request) {
+  std::string json = "{\"packages\":[";
+  bool first = true;
+  for (const auto& package : EdgeTpuManager::GetSingleton()->GetProfiles()) {
+    if (!first) json.push_back(',');
+    first = false;
+    json.append("{\"name\":");
+    AppendString(&json, package.name);
+    Append(&json, ",\"inferences\":%" PRIu32, package.profile.inferences);
+    Append(&json, ",\"total_us\":%" PRIu64 ",\"phases\":{",
+           package.profile.total_us);
+    for (int i = 0; i < kEdgeTpuPhaseCount; ++i) {
+      if (i) json.push_back(',');
+      auto phase = static_cast<EdgeTpuPhase>(i);
+      AppendPhase(&json, phase, package.profile.phase(phase));
+    }
+    json.append("}}");
+  }
+  json.append("]}");
+  jsonrpc_return_success(request, "%s", json.c_str());
+}
+
+void EdgeTpuProfileResetRpc(struct jsonrpc_request* request) {
+  EdgeTpuManager::GetSingleton()->ResetProfiles();
+  jsonrpc_return_success(request, "{}");
+}
+}  // namespace
+
+void RegisterEdgeTpuProfilerRpc() {
+  jsonrpc_export("edgetpu_profile", EdgeTpuProfileRpc);
+  jsonrpc_export("edgetpu_profile_reset", EdgeTpuProfileResetRpc);
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PROFILER_RPC_H_
+#define LIBS_TPU_EDGETPU_PROFILER_RPC_H_
+
+namespace coralmicro {
+
+// Exports the Edge TPU profiles over JSON-RPC, with the following methods:
+//
+// * `edgetpu_profile`: Returns `EdgeTpuManager::GetProfiles()` as
+//   `{"packages": [{"name": ..., "inferences": ..., "total_us": ...,
+//   "phases": {"parameters": {"count": ..., "total_us": ..., "max_us": ...,
+//   "bytes": ..., "histogram": [...]}, ...}}, ...]}`. Histograms are laid
+//   out as `EdgeTpuPhaseStats::histogram`, without trailing empty buckets.
+// * `edgetpu_profile_reset`: Resets the profiles to zero.
+//
+// Call `jsonrpc_init()` first, then serve the methods with a
+// `JsonRpcHttpServer`.
+void RegisterEdgeTpuProfilerRpc();
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PROFILER_RPC_H_
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_scheduler.h"
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+
+namespace coralmicro {
+
+EdgeTpuScheduler::EdgeTpuScheduler() : mutex_(xSemaphoreCreateMutex()) {
+  CHECK(mutex_);
+}
+
+void EdgeTpuScheduler::Acquire(uint64_t group, TaskHandle_t requester) {
+  Request request;
+  request.task = xTaskGetCurrentTaskHandle();
+  request.task_priority = uxTaskPriorityGet(nullptr);
+  request.group = group;
+  request.priority = static_cast<int>(request.task_priority);
+  request.deadline = 0;
+  {
+    MutexLock lock(mutex_);
+    request.arrival = xTaskGetTickCount();
+    auto it = task_options_.find(requester);
+    if (it != task_options_.end()) {
+      if (it->second.priority >= 0) request.priority = it->second.priority;
+      request.deadline = it->second.deadline;
+    }
+
+    if (!busy_) {
+      busy_ = true;
+      Start(request, request.arrival);
+      return;
+    }
+
+    request.wake = xSemaphoreCreateBinaryStatic(&request.wake_storage);
+    waiting_.push_back(&request);
+    if (request.task_priority > uxTaskPriorityGet(owner_)) {
+      vTaskPrioritySet(owner_, request.task_priority);
+    }
+  }
+  CHECK(xSemaphoreTake(request.wake, portMAX_DELAY) == pdTRUE);
+  vSemaphoreDelete(request.wake);
+}
+
+void EdgeTpuScheduler::Release() {
+  MutexLock lock(mutex_);
+  cached_group_ = owner_group_;
+  const UBaseType_t priority = owner_priority_;
+  if (waiting_.empty()) {
+    busy_ = false;
+    owner_ = nullptr;
+  } else {
+    const TickType_t now = xTaskGetTickCount();
+    auto it = Next(now);
+    Request* next = *it;
+    waiting_.erase(it);
+    Start(*next, now);
+    xSemaphoreGive(next->wake);
+  }
+  if (uxTaskPriorityGet(nullptr) != priority) {
+    vTaskPrioritySet(nullptr, priority);
+  }
+}
+
+std::vector<EdgeTpuScheduler::Request*>::iterator EdgeTpuScheduler::Next(
+    TickType_t now) {
+  // Earliest deadline first: requests with a deadline run ahead of those
+  // without, in order of their remaining slack, which is negative once the
+  // deadline has passed. Among equal slacks, cached parameters, then
+  // arrival.
+  auto next = waiting_.end();
+  int64_t next_slack = 0;
+  bool next_cached = false;
+  for (auto it = waiting_.begin(); it != waiting_.end(); ++it) {
+    const Request* request = *it;
+    if (request->deadline == 0) continue;
+    const int64_t slack = static_cast<int64_t>(request->deadline) -
+                          static_cast<int64_t>(now - request->arrival);
+    const bool cached = request->group != 0 && request->group == cached_group_;
+    if (next == waiting_.end() || slack < next_slack ||
+        (slack == next_slack && cached && !next_cached)) {
+      next = it;
+      next_slack = slack;
+      next_cached = cached;
+    }
+  }
+  if (next != waiting_.end()) return next;
+
+  // Otherwise by aged priority, cached parameters, then arrival. Requests
+  // are queued in arrival order, so the first of equals has waited longest.
+  int64_t next_priority = 0;
+  for (auto it = waiting_.begin(); it != waiting_.end(); ++it) {
+    const Request* request = *it;
+    const int64_t aging = (now - request->arrival) / kAgingPeriod;
+    const int64_t priority = request->priority + aging;
+    const bool cached = request->group != 0 && request->group == cached_group_;
+    if (next == waiting_.end() || priority > next_priority ||
+        (priority == next_priority && cached && !next_cached)) {
+      next = it;
+      next_priority = priority;
+      next_cached = cached;
+    }
+  }
+  return next;
+}
+
+void EdgeTpuScheduler::Start(const Request& request, TickType_t now) {
+  owner_ = request.task;
+  owner_priority_ = request.task_priority;
+  owner_group_ = request.group;
+  // The owner runs at the priority of the highest task waiting on it.
+  for (const Request* waiting : waiting_) {
+    if (waiting->task_priority > uxTaskPriorityGet(owner_)) {
+      vTaskPrioritySet(owner_, waiting->task_priority);
+    }
+  }
+
+  const TickType_t wait = now - request.arrival;
+  ++stats_.requests;
+  if (wait > 0) ++stats_.waited;
+  stats_.total_wait += wait;
+  if (wait > stats_.max_wait) stats_.max_wait = wait;
+  if (request.deadline != 0 && wait > request.deadline) {
+    ++stats_.deadline_misses;
+  }
+}
+
+void EdgeTpuScheduler::SetTaskOptions(TaskHandle_t task,
+                                      const EdgeTpuRequestOptions& options) {
+  MutexLock lock(mutex_);
+  task_options_[task] = options;
+}
+
+void EdgeTpuScheduler::ClearTaskOptions(TaskHandle_t task) {
+  MutexLock lock(mutex_);
+  task_options_.erase(task);
+}
+
+EdgeTpuSchedulerStats EdgeTpuScheduler::GetStats() {
+  MutexLock lock(mutex_);
+  return stats_;
+}
+
+void EdgeTpuScheduler::ResetStats() {
+  MutexLock lock(mutex_);
+  stats_ = {};
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_SCHEDULER_H_
+#define LIBS_TPU_EDGETPU_SCHEDULER_H_
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+namespace coralmicro {
+
+// How the Edge TPU requests of a task are scheduled.
+struct EdgeTpuRequestOptions {
+  // Requests of higher priority run first. If negative, the FreeRTOS
+  // priority of the task is used.
+  int priority = -1;
+  // How long a request may wait for the Edge TPU, in ticks, or 0 for no
+  // deadline. Requests with a deadline run ahead of those without, the one
+  // closest to its deadline first, whatever their priorities.
+  TickType_t deadline = 0;
+};
+
+// Counters of the Edge TPU scheduler, since the last reset.
+struct EdgeTpuSchedulerStats {
+  // Requests granted the Edge TPU.
+  uint32_t requests;
+  // Requests that waited for another to finish first.
+  uint32_t waited;
+  // Ticks spent waiting, summed over all requests.
+  uint64_t total_wait;
+  // Longest wait of a request, in ticks.
+  TickType_t max_wait;
+  // Requests granted the Edge TPU after their deadline.
+  uint32_t deadline_misses;
+};
+
+// @cond Do not generate docs
+// Grants the Edge TPU to one request at a time.
+//
+// When the Edge TPU is released, the request to run next is picked among
+// those waiting as follows:
+//
+// 1. If any request has a deadline, earliest deadline first: the request
+//    with the least time left before its deadline, or furthest past it.
+// 2. Otherwise, the highest priority, raised by one level for every
+//    `kAgingPeriod` the request has waited, so that no package is starved.
+// 3. Among equal deadlines or priorities, requests whose parameters are
+//    already cached on the Edge TPU, so they run back to back instead of
+//    evicting each other.
+// 4. Then the request that has waited longest.
+//
+// The task holding the Edge TPU runs at the FreeRTOS priority of the highest
+// task waiting for it, as it would with a mutex.
+class EdgeTpuScheduler {
+ public:
+  // Waiting time that raises the priority of a request by one level.
+  static constexpr TickType_t kAgingPeriod = pdMS_TO_TICKS(100);
+
+  EdgeTpuScheduler();
+  EdgeTpuScheduler(const EdgeTpuScheduler&) = delete;
+  EdgeTpuScheduler& operator=(const EdgeTpuScheduler&) = delete;
+
+  // Blocks until the calling task is granted the Edge TPU, for a package
+  // whose cached parameters belong to `group` (its parameter caching token),
+  // or 0 if it doesn't cache parameters. The request is scheduled with the
+  // options of `requester`, the task it is made for.
+  void Acquire(uint64_t group, TaskHandle_t requester);
+  // Hands the Edge TPU to the next request. Must be called by the task that
+  // acquired it.
+  void Release();
+
+  void SetTaskOptions(TaskHandle_t task, const EdgeTpuRequestOptions& options);
+  void ClearTaskOptions(TaskHandle_t task);
+
+  EdgeTpuSchedulerStats GetStats();
+  void ResetStats();
+
+  // Holds the Edge TPU for the life of the object.
+  class Grant {
+   public:
+    Grant(EdgeTpuScheduler* scheduler, uint64_t group, TaskHandle_t requester)
+        : scheduler_(scheduler) {
+      scheduler_->Acquire(group, requester);
+    }
+    ~Grant() { scheduler_->Release(); }
+    Grant(const Grant&) = delete;
+    Grant& operator=(const Grant&) = delete;
+
+   private:
+    EdgeTpuScheduler* scheduler_;
+  };
+
+ private:
+  struct Request {
+    TaskHandle_t task;
+    UBaseType_t task_priority;
+    uint64_t group;
+    int priority;
+    TickType_t arrival;
+    TickType_t deadline;
+    StaticSemaphore_t wake_storage;
+    SemaphoreHandle_t wake;
+  };
+
+  // Returns the waiting request to run next. There must be one.
+  std::vector<Request*>::iterator Next(TickType_t now);
+  // Grants the Edge TPU to `request`.
+  void Start(const Request& request, TickType_t now);
+
+  SemaphoreHandle_t mutex_;
+  bool busy_ = false;
+  TaskHandle_t owner_ = nullptr;
+  // FreeRTOS priority of the owner before it was raised.
+  UBaseType_t owner_priority_ = 0;
+  // Group whose parameters the last request left cached.
+  uint64_t cached_group_ = 0;
+  uint64_t owner_group_ = 0;
+  std::vector<Request*> waiting_;
+  std::map<TaskHandle_t, EdgeTpuRequestOptions> task_options_;
+  EdgeTpuSchedulerStats stats_ = {};
+};
+// @endcond
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_SCHEDULER_H_
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_TRANSPORT_H_
+
+#include <cstdint>
+
+namespace coralmicro {
+
+// Pipes of the Edge TPU.
+enum class EdgeTpuPipe {
+  // Vendor requests that read and write CSRs.
+  kControl,
+  // Headers and data sent to the device.
+  kBulkOut,
+  // Output activations read from the device.
+  kBulkIn,
+  // The event the device sends at the end of each inference.
+  kEvent,
+};
+
+inline constexpr int kEdgeTpuPipeCount = 4;
+
+// A vendor request on the control pipe, which reads or writes the CSR at
+// (`index` << 16) | `value`.
+struct EdgeTpuControlSetup {
+  bool read;
+  uint8_t request;
+  uint16_t value;
+  uint16_t index;
+  uint16_t length;
+};
+
+enum class EdgeTpuTransferStatus {
+  kSuccess,
+  kError,
+  kTimeout,
+};
+
+// @cond Do not generate docs
+// Moves data between `TpuDriver` and an Edge TPU.
+//
+// Transfers are queued on a pipe and complete in the order they were queued.
+// A transport must take at least 2 transfers at once on the control and event
+// pipes, and 4 on the bulk pipes. The buffer of a transfer belongs to the
+// transport until the transfer is waited for or cancelled.
+class EdgeTpuTransport {
+ public:
+  virtual ~EdgeTpuTransport() = default;
+
+  // Queues a control transfer of `setup.length` bytes from or to `data`.
+  virtual bool SubmitControl(const EdgeTpuControlSetup& setup,
+                             uint8_t* data) = 0;
+  // Queues a transfer of `length` bytes on a bulk or event pipe.
+  virtual bool SubmitBulk(EdgeTpuPipe pipe, uint8_t* data,
+                          uint32_t length) = 0;
+  // Waits up to `timeout_ms` for the oldest transfer queued on `pipe`, and
+  // sets `transferred` to the bytes it moved. A transfer that timed out is
+  // still queued, and the pipe must be cancelled.
+  virtual EdgeTpuTransferStatus Wait(EdgeTpuPipe pipe, uint32_t timeout_ms,
+                                     uint32_t* transferred) = 0;
+  // Cancels every transfer queued on `pipe`, and returns once none is in
+  // flight.
+  virtual void Cancel(EdgeTpuPipe pipe) = 0;
+
+  // Returns true if the device can read the `length` bytes at `data` in
+  // place, without a copy. The driver asks for each chunk it sends.
+  virtual bool CanSendInPlace(const uint8_t* data, uint32_t length) const {
+    return false;
+  }
+  // Makes what the CPU wrote to `length` bytes at `data` visible to the
+  // device, before they are sent in place.
+  virtual void FlushForDevice(const uint8_t* data, uint32_t length) const {}
+
+  // Waits for at least `us` microseconds.
+  virtual void DelayMicros(uint32_t us) = 0;
+};
+// @endcond
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_TRANSPORT_H_
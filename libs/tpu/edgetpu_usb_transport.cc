@@ -0,0 +1,203 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_usb_transport.h"
+
+#include <cstdio>
+
+#include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
+#include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/cm7/fsl_cache.h"
+#include "third_party/nxp/rt1176-sdk/middleware/usb/include/usb_spec.h"
+
+namespace coralmicro {
+
+// Bounds of the memories of the M7, from the linker script.
+extern "C" uint8_t __DTCM_START[];
+extern "C" uint8_t __DTCM_END[];
+extern "C" uint8_t __OCRAM_START[];
+extern "C" uint8_t __OCRAM_END[];
+extern "C" uint8_t __SDRAM_START[];
+extern "C" uint8_t __SDRAM_END[];
+
+namespace {
+constexpr uint8_t kSingleBulkOutEndpoint = 1;
+constexpr uint8_t kEventInEndpoint = 2;
+
+// Time a cancelled transfer has to complete.
+constexpr TickType_t kCancelTimeout = pdMS_TO_TICKS(200);
+
+// Memory the host controller can read from, as [begin, end) address ranges:
+// DTCM through the M7 backdoor, OCRAM and SDRAM, as the linker script lays
+// them out. ITCM and XIP flash are not listed, so buffers there always go
+// through the bounce buffers.
+struct DmaRegion {
+  const uint8_t* begin;
+  const uint8_t* end;
+};
+const DmaRegion kDmaRegions[] = {
+    {__DTCM_START, __DTCM_END},
+    {__OCRAM_START, __OCRAM_END},
+    {__SDRAM_START, __SDRAM_END},
+};
+constexpr uintptr_t kCacheLineSize = 32;
+
+uint8_t Endpoint(EdgeTpuPipe pipe) {
+  return pipe == EdgeTpuPipe::kEvent ? kEventInEndpoint
+                                     : kSingleBulkOutEndpoint;
+}
+
+uint8_t Direction(EdgeTpuPipe pipe) {
+  return pipe == EdgeTpuPipe::kBulkOut ? USB_OUT : USB_IN;
+}
+}  // namespace
+
+EdgeTpuUsbTransport::EdgeTpuUsbTransport() {
+  for (auto& queue : queues_) {
+    for (auto& slot : queue.slots) {
+      slot.done = xSemaphoreCreateBinaryStatic(&slot.done_storage);
+    }
+  }
+}
+
+EdgeTpuUsbTransport::Slot* EdgeTpuUsbTransport::StartSlot(Queue* queue) {
+  if (queue->head - queue->tail == kMaxQueued) {
+    printf("Too many transfers queued\r\n");
+    return nullptr;
+  }
+  Slot* slot = &queue->slots[queue->head % kMaxQueued];
+  slot->status = kStatus_USB_Error;
+  slot->transferred = 0;
+  slot->request.callbackFn = SlotCallback;
+  slot->request.callbackParam = slot;
+  // Drops a completion left over from a transfer that was given up on.
+  xSemaphoreTake(slot->done, 0);
+  return slot;
+}
+
+void EdgeTpuUsbTransport::SlotCallback(void* param, uint8_t* data,
+                                       uint32_t data_length,
+                                       usb_status_t status) {
+  auto* slot = static_cast<Slot*>(param);
+  slot->transferred = data_length;
+  slot->status = status;
+  xSemaphoreGive(slot->done);
+}
+
+bool EdgeTpuUsbTransport::SubmitControl(const EdgeTpuControlSetup& setup,
+                                        uint8_t* data) {
+  Queue* queue = &queues_[static_cast<int>(EdgeTpuPipe::kControl)];
+  Slot* slot = StartSlot(queue);
+  if (!slot) {
+    return false;
+  }
+
+  usb_setup_struct_t setup_packet;
+  setup_packet.bmRequestType =
+      USB_REQUEST_TYPE_TYPE_VENDOR | USB_REQUEST_TYPE_RECIPIENT_DEVICE;
+  setup_packet.bmRequestType |=
+      setup.read ? USB_REQUEST_TYPE_DIR_IN : USB_REQUEST_TYPE_DIR_OUT;
+  setup_packet.bRequest = setup.request;
+  setup_packet.wValue = setup.value;
+  setup_packet.wIndex = setup.index;
+  setup_packet.wLength = setup.length;
+  if (USB_HostEdgeTpuControlSubmit(usb_instance_, &setup_packet, data,
+                                   &slot->request) != kStatus_USB_Success) {
+    printf("USB_HostEdgeTpuControlSubmit failed\r\n");
+    return false;
+  }
+  ++queue->head;
+  return true;
+}
+
+bool EdgeTpuUsbTransport::SubmitBulk(EdgeTpuPipe pipe, uint8_t* data,
+                                     uint32_t length) {
+  Queue* queue = &queues_[static_cast<int>(pipe)];
+  Slot* slot = StartSlot(queue);
+  if (!slot) {
+    return false;
+  }
+  if (USB_HostEdgeTpuBulkSubmit(usb_instance_, Endpoint(pipe), Direction(pipe),
+                                data, length,
+                                &slot->request) != kStatus_USB_Success) {
+    printf("USB_HostEdgeTpuBulkSubmit failed\r\n");
+    return false;
+  }
+  ++queue->head;
+  return true;
+}
+
+EdgeTpuTransferStatus EdgeTpuUsbTransport::Wait(EdgeTpuPipe pipe,
+                                                uint32_t timeout_ms,
+                                                uint32_t* transferred) {
+  Queue* queue = &queues_[static_cast<int>(pipe)];
+  if (queue->head == queue->tail) {
+    return EdgeTpuTransferStatus::kError;
+  }
+  Slot* slot = &queue->slots[queue->tail % kMaxQueued];
+  if (xSemaphoreTake(slot->done, pdMS_TO_TICKS(timeout_ms)) == pdFALSE) {
+    return EdgeTpuTransferStatus::kTimeout;
+  }
+  ++queue->tail;
+  *transferred = slot->transferred;
+  return slot->status == kStatus_USB_Success ? EdgeTpuTransferStatus::kSuccess
+                                             : EdgeTpuTransferStatus::kError;
+}
+
+void EdgeTpuUsbTransport::Cancel(EdgeTpuPipe pipe) {
+  Queue* queue = &queues_[static_cast<int>(pipe)];
+  if (queue->head == queue->tail) {
+    return;
+  }
+  // Cancelling completes whatever is still queued, which must finish before
+  // its buffer is reused.
+  if (pipe == EdgeTpuPipe::kControl) {
+    USB_HostEdgeTpuControlCancel(usb_instance_);
+  } else {
+    USB_HostEdgeTpuBulkCancel(usb_instance_, Endpoint(pipe), Direction(pipe));
+  }
+  for (; queue->tail != queue->head; ++queue->tail) {
+    xSemaphoreTake(queue->slots[queue->tail % kMaxQueued].done,
+                   kCancelTimeout);
+  }
+}
+
+// The buffer has to start and end on a cache line, so that cache maintenance
+// on it never reaches memory outside it.
+bool EdgeTpuUsbTransport::CanSendInPlace(const uint8_t* data,
+                                         uint32_t length) const {
+  if (reinterpret_cast<uintptr_t>(data) % kCacheLineSize != 0 ||
+      length % kCacheLineSize != 0) {
+    return false;
+  }
+  for (const auto& region : kDmaRegions) {
+    if (data >= region.begin && data < region.end &&
+        length <= static_cast<size_t>(region.end - data)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void EdgeTpuUsbTransport::FlushForDevice(const uint8_t* data,
+                                         uint32_t length) const {
+  DCACHE_CleanByRange(reinterpret_cast<uint32_t>(data), length);
+}
+
+void EdgeTpuUsbTransport::DelayMicros(uint32_t us) {
+  SDK_DelayAtLeastUs(us, CLOCK_GetFreq(kCLOCK_CpuClk));
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
+
+#include "libs/tpu/edgetpu_transport.h"
+#include "libs/tpu/usb_host_edgetpu.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+
+namespace coralmicro {
+
+// @cond Do not generate docs
+// Transport to an Edge TPU on the USB host controller.
+class EdgeTpuUsbTransport : public EdgeTpuTransport {
+ public:
+  EdgeTpuUsbTransport();
+  EdgeTpuUsbTransport(const EdgeTpuUsbTransport&) = delete;
+  EdgeTpuUsbTransport& operator=(const EdgeTpuUsbTransport&) = delete;
+
+  // Sets the device transfers go to. Transfers must not be queued.
+  void set_usb_instance(usb_host_edgetpu_instance_t* usb_instance) {
+    usb_instance_ = usb_instance;
+  }
+
+  bool SubmitControl(const EdgeTpuControlSetup& setup, uint8_t* data) override;
+  bool SubmitBulk(EdgeTpuPipe pipe, uint8_t* data, uint32_t length) override;
+  EdgeTpuTransferStatus Wait(EdgeTpuPipe pipe, uint32_t timeout_ms,
+                             uint32_t* transferred) override;
+  void Cancel(EdgeTpuPipe pipe) override;
+  bool CanSendInPlace(const uint8_t* data, uint32_t length) const override;
+  void FlushForDevice(const uint8_t* data, uint32_t length) const override;
+  void DelayMicros(uint32_t us) override;
+
+ private:
+  // Transfers queued on a pipe at once. The driver keeps fewer than that on
+  // the control and event pipes.
+  static constexpr int kMaxQueued = 4;
+
+  // One transfer in flight. The completion is reused from one transfer to
+  // the next.
+  struct Slot {
+    usb_host_edgetpu_request_t request;
+    StaticSemaphore_t done_storage;
+    SemaphoreHandle_t done;
+    usb_status_t status;
+    uint32_t transferred;
+  };
+
+  // Transfers queued on a pipe, filled at `head` and drained at `tail`.
+  struct Queue {
+    Slot slots[kMaxQueued];
+    int head = 0;
+    int tail = 0;
+  };
+
+  // Takes the slot at the head of `queue` for a new transfer.
+  Slot* StartSlot(Queue* queue);
+  static void SlotCallback(void* param, uint8_t* data, uint32_t data_length,
+                           usb_status_t status);
+
+  usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  Queue queues_[kEdgeTpuPipeCount];
+};
+// @endcond
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
@@ -462,6 +462,92 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
 }
 
 
+static void USB_HostEdgeTpuRequestCallback(void *param,
+                                           usb_host_transfer_t *transfer,
+                                           usb_status_t status)
+{
+    usb_host_edgetpu_request_t *request = (usb_host_edgetpu_request_t *)param;
+    uint8_t *buffer = transfer->transferBuffer;
+    uint32_t length = transfer->transferSofar;
+
+    // Free the transfer first, so the callback can queue another one.
+    USB_HostFreeTransfer(request->tpuInstance->hostHandle, transfer);
+    if (request->callbackFn != NULL)
+    {
+        request->callbackFn(request->callbackParam, buffer, length, status);
+    }
+}
+
+
+usb_status_t USB_HostEdgeTpuBulkSubmit(usb_host_edgetpu_instance_t *tpuInstance,
+                                       uint8_t endPoint,
+                                       uint8_t direction,
+                                       uint8_t *buffer,
+                                       uint32_t length,
+                                       usb_host_edgetpu_request_t *request)
+{
+    usb_host_transfer_t *transfer;
+    usb_status_t status;
+
+    // Unlike USB_HostEdgeTpuBulkOutSend and USB_HostEdgeTpuBulkInRecv, the
+    // pipe doesn't track the transfer: each request carries its own callback,
+    // so any number of them can be queued on the pipe.
+    int8_t index = USB_HostEdgeTpuGetPipeIndexFromEndpoint(tpuInstance, endPoint, direction);
+    if (index < 0 || request == NULL)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    usb_host_edgetpu_pipe_t *pipe = &tpuInstance->pipes[index];
+
+    // Check endpoint is BULK
+    if (pipe->pipeType != USB_ENDPOINT_BULK)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+
+    if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
+    {
+        return kStatus_USB_Error;
+    }
+
+    request->tpuInstance = tpuInstance;
+    transfer->transferBuffer = buffer;
+    transfer->transferLength = length;
+    transfer->callbackFn = USB_HostEdgeTpuRequestCallback;
+    transfer->callbackParam = request;
+    transfer->direction = direction;
+
+    if (direction == USB_OUT)
+    {
+        status = USB_HostSend(tpuInstance->hostHandle, pipe->pipeHandle, transfer);
+    }
+    else
+    {
+        status = USB_HostRecv(tpuInstance->hostHandle, pipe->pipeHandle, transfer);
+    }
+    if (status != kStatus_USB_Success)
+    {
+        USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
+        return kStatus_USB_Error;
+    }
+    return kStatus_USB_Success;
+}
+
+
+usb_status_t USB_HostEdgeTpuBulkCancel(usb_host_edgetpu_instance_t *tpuInstance,
+                                       uint8_t endPoint,
+                                       uint8_t direction)
+{
+    int8_t index = USB_HostEdgeTpuGetPipeIndexFromEndpoint(tpuInstance, endPoint, direction);
+    if (index < 0)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    // Every queued transfer completes with kStatus_USB_TransferCancel.
+    return USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->pipes[index].pipeHandle, NULL);
+}
+
+
 static void USB_HostEdgeTpuControlPipeCallback(void *param, usb_host_transfer_t *transfer, usb_status_t status)
 {
     usb_host_edgetpu_instance_t *tpuInstance = (usb_host_edgetpu_instance_t *)param;
@@ -476,6 +562,51 @@ static void USB_HostEdgeTpuControlPipeCallback(void *param, usb_host_transfer_t
 }
 
 
+usb_status_t USB_HostEdgeTpuControlSubmit(usb_host_edgetpu_instance_t *tpuInstance,
+                                          usb_setup_struct_t *setupPacket,
+                                          uint8_t *buffer,
+                                          usb_host_edgetpu_request_t *request)
+{
+    usb_host_transfer_t *transfer;
+
+    // As with USB_HostEdgeTpuBulkSubmit, the instance doesn't track the
+    // transfer, so several can be queued on the control pipe.
+    if (request == NULL)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
+    {
+        return kStatus_USB_Error;
+    }
+
+    request->tpuInstance = tpuInstance;
+    transfer->transferBuffer = buffer;
+    transfer->transferLength = setupPacket->wLength;
+    transfer->callbackFn = USB_HostEdgeTpuRequestCallback;
+    transfer->callbackParam = request;
+    transfer->setupPacket->bRequest = setupPacket->bRequest;
+    transfer->setupPacket->bmRequestType = setupPacket->bmRequestType;
+    transfer->setupPacket->wValue = USB_SHORT_TO_LITTLE_ENDIAN(setupPacket->wValue);
+    transfer->setupPacket->wIndex = USB_SHORT_TO_LITTLE_ENDIAN(setupPacket->wIndex);
+    transfer->setupPacket->wLength = USB_SHORT_TO_LITTLE_ENDIAN(setupPacket->wLength);
+
+    if (USB_HostSendSetup(tpuInstance->hostHandle, tpuInstance->controlPipe, transfer) != kStatus_USB_Success)
+    {
+        USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
+        return kStatus_USB_Error;
+    }
+    return kStatus_USB_Success;
+}
+
+
+usb_status_t USB_HostEdgeTpuControlCancel(usb_host_edgetpu_instance_t *tpuInstance)
+{
+    // Every queued transfer completes with kStatus_USB_TransferCancel.
+    return USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->controlPipe, NULL);
+}
+
+
 usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
                                                usb_setup_struct_t *setupPacket,
                                                uint8_t* buffer,
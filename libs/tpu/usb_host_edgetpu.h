@@ -100,6 +100,30 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
                                        transfer_callback_t callbackFn,
                                        void *callbackParam);
 
+/*! A bulk or control transfer that can be queued behind others on the same
+ *  pipe. The caller sets callbackFn and callbackParam, and keeps the request
+ *  alive until the callback runs. */
+typedef struct _usb_host_edgetpu_request {
+  usb_host_edgetpu_instance_t *tpuInstance;
+  transfer_callback_t callbackFn;
+  void *callbackParam;
+} usb_host_edgetpu_request_t;
+
+usb_status_t USB_HostEdgeTpuBulkSubmit(usb_host_edgetpu_instance_t *tpuInstance,
+                                       uint8_t endPoint, uint8_t direction,
+                                       uint8_t *buffer, uint32_t length,
+                                       usb_host_edgetpu_request_t *request);
+
+usb_status_t USB_HostEdgeTpuBulkCancel(usb_host_edgetpu_instance_t *tpuInstance,
+                                       uint8_t endPoint, uint8_t direction);
+
+usb_status_t USB_HostEdgeTpuControlSubmit(
+    usb_host_edgetpu_instance_t *tpuInstance, usb_setup_struct_t *setupPacket,
+    uint8_t *buffer, usb_host_edgetpu_request_t *request);
+
+usb_status_t USB_HostEdgeTpuControlCancel(
+    usb_host_edgetpu_instance_t *tpuInstance);
+
 usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
                                     usb_setup_struct_t *setupPacket,
                                     uint8_t *buffer,
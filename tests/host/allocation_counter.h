@@ -0,0 +1,32 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TESTS_HOST_ALLOCATION_COUNTER_H_
+#define TESTS_HOST_ALLOCATION_COUNTER_H_
+
+namespace coralmicro {
+namespace benchmark {
+
+// Returns the number of heap allocations made with `new` so far. Only
+// programs that link allocation_counter.cc, which replaces the global
+// `operator new`, count them.
+int HeapAllocations();
+
+}  // namespace benchmark
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_ALLOCATION_COUNTER_H_
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TESTS_HOST_BENCHMARK_H_
+#define TESTS_HOST_BENCHMARK_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace coralmicro {
+namespace benchmark {
+
+// Whether `Timing::cycles` is measured on this host.
+#if defined(__x86_64__) || defined(__i386__)
+inline constexpr bool kHasCycles = true;
+#else
+inline constexpr bool kHasCycles = false;
+#endif
+
+// The fastest of several runs.
+struct Timing {
+  double micros;
+  // Time stamp counter ticks, which run at the nominal clock rate whatever
+  // the actual clock, or 0 without `kHasCycles`.
+  double cycles;
+};
+
+inline uint64_t Cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Returns the fastest of `repeats` runs of `fn`.
+template <typename Fn>
+Timing Best(Fn fn, int repeats = 20) {
+  Timing best{1e30, 1e30};
+  for (int i = 0; i < repeats; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t start_cycles = Cycles();
+    fn();
+    const uint64_t end_cycles = Cycles();
+    const auto end = std::chrono::steady_clock::now();
+    best.micros = std::min(
+        best.micros,
+        std::chrono::duration<double, std::micro>(end - start).count());
+    best.cycles =
+        std::min(best.cycles, static_cast<double>(end_cycles - start_cycles));
+  }
+  return best;
+}
+
+// Reads all of file `path` into `data`.
+//
+// @return False if the file can't be read, or is not `size` bytes when
+// `size` is not 0.
+inline bool ReadFile(const std::string& path, std::vector<uint8_t>* data,
+                     size_t size = 0) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    printf("Can't open %s\n", path.c_str());
+    return false;
+  }
+  data->clear();
+  uint8_t chunk[4096];
+  size_t read;
+  while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data->insert(data->end(), chunk, chunk + read);
+  }
+  const bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    printf("Can't read %s\n", path.c_str());
+    return false;
+  }
+  if (size && data->size() != size) {
+    printf("%s is %zu bytes, not %zu\n", path.c_str(), data->size(), size);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace benchmark
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_BENCHMARK_H_
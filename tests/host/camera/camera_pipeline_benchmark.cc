@@ -0,0 +1,287 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays raw Bayer frames through the camera pipeline on the host, checks
+// its output against the conversions it replaced, and times both.
+//
+// Usage: camera_pipeline_benchmark FRAME...
+//
+// Each FRAME is a raw 324x324 Bayer frame, as `CameraFormat::kRaw` returns.
+// The frames are followed by one of uniform noise, which reaches every
+// entry of the luma tables. RGB must match the reference bit for bit, and
+// Y8 within 1 LSB, and converting several formats at once in a workspace
+// must not allocate after the first frame. Exits with 1 otherwise.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "libs/camera/camera_pipeline.h"
+#include "tests/host/allocation_counter.h"
+#include "tests/host/benchmark.h"
+#include "tests/host/camera/camera_reference.h"
+#include "tests/host/camera/raw_frames.h"
+
+namespace coralmicro {
+namespace {
+// Largest difference allowed between the fixed-point and float luma.
+constexpr int kLumaTolerance = 1;
+// Fills the pipeline's outputs before each conversion, so that pixels it
+// fails to write show up as differences.
+constexpr uint8_t kUnwritten = 0x5a;
+
+constexpr CameraRotation kRotations[] = {CameraRotation::k0,
+                                         CameraRotation::k90,
+                                         CameraRotation::k180,
+                                         CameraRotation::k270};
+constexpr CameraFilterMethod kFilters[] = {
+    CameraFilterMethod::kBilinear, CameraFilterMethod::kNearestNeighbor};
+
+struct Size {
+  int width;
+  int height;
+};
+constexpr Size kSizes[] = {{324, 324}, {224, 224}, {96, 96}, {320, 240},
+                           {100, 300}, {7, 5},     {400, 400}};
+
+// Returns the fastest of several runs of `fn`, in microseconds.
+template <typename Fn>
+double BestMicros(Fn fn) {
+  return benchmark::Best(fn).micros;
+}
+
+CameraFrameFormat MakeFormat(CameraFormat format, CameraFilterMethod filter,
+                             CameraRotation rotation, Size size,
+                             bool preserve_ratio, uint8_t* buffer,
+                             bool white_balance) {
+  CameraFrameFormat fmt{format, filter,         rotation, size.width,
+                        size.height, preserve_ratio, buffer};
+  fmt.white_balance = white_balance;
+  return fmt;
+}
+
+// Returns the number of bytes that differ by more than `tolerance`, and
+// updates `max_difference` with the largest difference.
+int CountDifferences(const std::vector<uint8_t>& got,
+                     const std::vector<uint8_t>& want, int tolerance,
+                     int* max_difference = nullptr) {
+  int count = 0;
+  for (size_t i = 0; i < got.size(); ++i) {
+    const int difference = std::abs(got[i] - want[i]);
+    if (difference > tolerance) ++count;
+    if (max_difference) {
+      *max_difference = std::max(*max_difference, difference);
+    }
+  }
+  return count;
+}
+
+// Checks `kRgb` outputs of the pipeline against the reference, bit for bit.
+// A fresh white balance state balances each frame with its own gains, as
+// the reference does.
+bool CheckRgb(const std::vector<uint8_t>& raw) {
+  int cases = 0;
+  int failures = 0;
+  for (auto filter : kFilters) {
+    for (auto rotation : kRotations) {
+      for (const Size& size : kSizes) {
+        for (bool preserve_ratio : {false, true}) {
+          for (bool white_balance : {false, true}) {
+            const size_t bytes = size.width * size.height * 3;
+            std::vector<uint8_t> want(bytes, 0);
+            std::vector<uint8_t> got(bytes, kUnwritten);
+            camera::reference::Convert(
+                raw.data(),
+                MakeFormat(CameraFormat::kRgb, filter, rotation, size,
+                           preserve_ratio, want.data(), false),
+                white_balance);
+            camera::WhiteBalance balance;
+            const bool ok = camera::ConvertBayer(
+                raw.data(),
+                MakeFormat(CameraFormat::kRgb, filter, rotation, size,
+                           preserve_ratio, got.data(), white_balance),
+                &balance);
+            const int differences = CountDifferences(got, want, 0);
+            ++cases;
+            if (!ok || differences) {
+              ++failures;
+              printf("  RGB %dx%d filter %d rotation %d preserve_ratio %d "
+                     "white_balance %d: %s, %d bytes differ\n",
+                     size.width, size.height, static_cast<int>(filter),
+                     static_cast<int>(rotation), preserve_ratio,
+                     white_balance, ok ? "converted" : "failed",
+                     differences);
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("RGB against the reference: %d of %d cases bit-exact\n",
+         cases - failures, cases);
+  return failures == 0;
+}
+
+// Checks `kY8` outputs of the pipeline's luma tables against the float
+// luma of the reference, within `kLumaTolerance`.
+bool CheckY8(const std::vector<uint8_t>& raw) {
+  int cases = 0;
+  int failures = 0;
+  int max_difference = 0;
+  size_t bytes_differing = 0;
+  size_t bytes_total = 0;
+  for (auto filter : kFilters) {
+    for (auto rotation : kRotations) {
+      for (const Size& size : kSizes) {
+        for (bool preserve_ratio : {false, true}) {
+          const size_t bytes = size.width * size.height;
+          std::vector<uint8_t> want(bytes, 0);
+          std::vector<uint8_t> got(bytes, kUnwritten);
+          camera::reference::Convert(
+              raw.data(),
+              MakeFormat(CameraFormat::kY8, filter, rotation, size,
+                         preserve_ratio, want.data(), false),
+              false);
+          const bool ok = camera::ConvertBayer(
+              raw.data(),
+              MakeFormat(CameraFormat::kY8, filter, rotation, size,
+                         preserve_ratio, got.data(), false),
+              nullptr);
+          const int differences =
+              CountDifferences(got, want, kLumaTolerance, &max_difference);
+          bytes_differing += CountDifferences(got, want, 0);
+          bytes_total += bytes;
+          ++cases;
+          if (!ok || differences) {
+            ++failures;
+            printf("  Y8 %dx%d filter %d rotation %d preserve_ratio %d: %s, "
+                   "%d bytes off by more than %d\n",
+                   size.width, size.height, static_cast<int>(filter),
+                   static_cast<int>(rotation), preserve_ratio,
+                   ok ? "converted" : "failed", differences, kLumaTolerance);
+          }
+        }
+      }
+    }
+  }
+  printf("Y8 against the reference: %d of %d cases within %d LSB "
+         "(%zu of %zu bytes differ, by at most %d)\n",
+         cases - failures, cases, kLumaTolerance, bytes_differing,
+         bytes_total, max_difference);
+  return failures == 0;
+}
+
+void BenchmarkRgb(const std::vector<uint8_t>& raw) {
+  printf("RGB, bilinear demosaic, 270 degrees (us per frame):\n");
+  printf("  %-9s %-13s %10s %10s\n", "size", "white balance", "reference",
+         "pipeline");
+  for (const Size& size : {Size{324, 324}, Size{224, 224}, Size{96, 96}}) {
+    for (bool white_balance : {false, true}) {
+      std::vector<uint8_t> buffer(size.width * size.height * 3);
+      const CameraFrameFormat fmt = MakeFormat(
+          CameraFormat::kRgb, CameraFilterMethod::kBilinear,
+          CameraRotation::k270, size, false, buffer.data(), white_balance);
+      const double reference = BestMicros([&] {
+        camera::reference::Convert(raw.data(), fmt, white_balance);
+      });
+      // Frames after the first are balanced with the gains carried over.
+      camera::WhiteBalance balance;
+      camera::ConvertBayer(raw.data(), fmt, &balance);
+      const double pipeline =
+          BestMicros([&] { camera::ConvertBayer(raw.data(), fmt, &balance); });
+      printf("  %3dx%-5d %-13s %10.1f %10.1f\n", size.width, size.height,
+             white_balance ? "on" : "off", reference, pipeline);
+    }
+  }
+}
+void BenchmarkY8(const std::vector<uint8_t>& raw) {
+  printf("Y8, bilinear demosaic, 270 degrees (us per frame):\n");
+  printf("  %-9s %10s %10s\n", "size", "reference", "pipeline");
+  for (const Size& size : {Size{324, 324}, Size{224, 224}, Size{96, 96}}) {
+    std::vector<uint8_t> buffer(size.width * size.height);
+    const CameraFrameFormat fmt =
+        MakeFormat(CameraFormat::kY8, CameraFilterMethod::kBilinear,
+                   CameraRotation::k270, size, false, buffer.data(), false);
+    const double reference = BestMicros(
+        [&] { camera::reference::Convert(raw.data(), fmt, false); });
+    const double pipeline =
+        BestMicros([&] { camera::ConvertBayer(raw.data(), fmt, nullptr); });
+    printf("  %3dx%-5d %10.1f %10.1f\n", size.width, size.height, reference,
+           pipeline);
+  }
+}
+
+// Converts several formats that share the demosaiced rows a few times in
+// one workspace, and checks that only the first conversion allocates.
+bool CheckSharedAllocations(const std::vector<uint8_t>& raw) {
+  std::vector<uint8_t> rgb(224 * 224 * 3);
+  std::vector<uint8_t> y8(96 * 96);
+  std::vector<uint8_t> full(kSizes[0].width * kSizes[0].height * 3);
+  std::vector<CameraFrameFormat> fmts = {
+      MakeFormat(CameraFormat::kRgb, CameraFilterMethod::kBilinear,
+                 CameraRotation::k270, {224, 224}, false, rgb.data(), true),
+      MakeFormat(CameraFormat::kY8, CameraFilterMethod::kBilinear,
+                 CameraRotation::k270, {96, 96}, false, y8.data(), false),
+      MakeFormat(CameraFormat::kRgb, CameraFilterMethod::kBilinear,
+                 CameraRotation::k0, kSizes[0], false, full.data(), true)};
+  fmts[0].resize = CameraResizeMethod::kBilinear;
+  fmts[1].resize = CameraResizeMethod::kArea;
+  camera::WhiteBalance balance;
+  camera::Workspace workspace;
+  int steady = 0;
+  bool ok = true;
+  for (int i = 0; i < 4; ++i) {
+    const int before = benchmark::HeapAllocations();
+    ok &= camera::ConvertBayer(raw.data(), fmts, &balance, &workspace);
+    if (i > 0) steady += benchmark::HeapAllocations() - before;
+  }
+  printf("Shared conversion: workspace of %zu bytes (%zu needed), %d "
+         "allocations after the first frame\n",
+         workspace.size(), workspace.peak(), steady);
+  return ok && steady == 0;
+}
+
+bool Replay(const std::vector<uint8_t>& raw) {
+  bool ok = CheckRgb(raw);
+  ok &= CheckY8(raw);
+  ok &= CheckSharedAllocations(raw);
+  BenchmarkRgb(raw);
+  BenchmarkY8(raw);
+  return ok;
+}
+}  // namespace
+}  // namespace coralmicro
+
+int main(int argc, char** argv) {
+  using namespace coralmicro;
+  if (argc < 2) {
+    printf("Usage: %s FRAME...\n", argv[0]);
+    return 2;
+  }
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) {
+    std::vector<uint8_t> raw;
+    if (!camera::ReadRawFrame(argv[i], &raw)) return 2;
+    printf("%s\n", argv[i]);
+    ok &= Replay(raw);
+  }
+  std::vector<uint8_t> noise;
+  camera::NoiseFrame(&noise);
+  printf("noise\n");
+  ok &= Replay(noise);
+  return ok ? 0 : 1;
+}
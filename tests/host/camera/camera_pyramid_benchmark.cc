@@ -0,0 +1,187 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times `camera::ConvertPyramid()` against converting each level on its own,
+// as a `CameraTask::GetFrame()` call per level does, and checks that a
+// pyramid converted in a workspace allocates nothing once the workspace has
+// grown to fit.
+//
+// Usage: camera_pyramid_benchmark FRAME...
+//
+// Each FRAME is a raw 324x324 Bayer frame, as `CameraFormat::kRaw` returns,
+// and is followed by a frame of noise. Exits with 1 if a first level differs
+// from converting it on its own, or if a pyramid allocates from the heap.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "libs/camera/camera_pipeline.h"
+#include "tests/host/allocation_counter.h"
+#include "tests/host/benchmark.h"
+#include "tests/host/camera/raw_frames.h"
+
+namespace coralmicro {
+namespace {
+
+struct Level {
+  CameraFormat format;
+  int width;
+  int height;
+  CameraResizeMethod resize;
+};
+
+struct Pyramid {
+  const char* name;
+  std::vector<Level> levels;
+};
+
+// Pyramids as a detection cascade would ask for them.
+const Pyramid kPyramids[] = {
+    {"224/160/96 RGB area",
+     {{CameraFormat::kRgb, 224, 224, CameraResizeMethod::kArea},
+      {CameraFormat::kRgb, 160, 160, CameraResizeMethod::kArea},
+      {CameraFormat::kRgb, 96, 96, CameraResizeMethod::kArea}}},
+    {"324/162/81 RGB bilinear",
+     {{CameraFormat::kRgb, 324, 324, CameraResizeMethod::kBilinear},
+      {CameraFormat::kRgb, 162, 162, CameraResizeMethod::kBilinear},
+      {CameraFormat::kRgb, 81, 81, CameraResizeMethod::kBilinear}}},
+    {"320x240/160x120 RGB + 96x96 Y8 bilinear",
+     {{CameraFormat::kRgb, 320, 240, CameraResizeMethod::kBilinear},
+      {CameraFormat::kRgb, 160, 120, CameraResizeMethod::kBilinear},
+      {CameraFormat::kY8, 96, 96, CameraResizeMethod::kBilinear}}},
+};
+
+// Buffers and formats for the levels of `pyramid`.
+struct Outputs {
+  std::vector<std::vector<uint8_t>> buffers;
+  std::vector<CameraFrameFormat> fmts;
+
+  Outputs(const Pyramid& pyramid, bool white_balance) {
+    buffers.reserve(pyramid.levels.size());
+    for (const Level& level : pyramid.levels) {
+      buffers.emplace_back(level.width * level.height *
+                           CameraFormatBpp(level.format));
+      CameraFrameFormat fmt{level.format,    CameraFilterMethod::kBilinear,
+                            CameraRotation::k270, level.width,
+                            level.height,    false,
+                            buffers.back().data()};
+      fmt.white_balance = white_balance;
+      fmt.resize = level.resize;
+      fmts.push_back(fmt);
+    }
+  }
+};
+
+// Checks the first level against converting it on its own, and reports how
+// far the later levels, resampled from the level before, are from that.
+bool CheckLevels(const std::vector<uint8_t>& raw, const Pyramid& pyramid) {
+  Outputs pyramid_outputs(pyramid, false);
+  Outputs separate_outputs(pyramid, false);
+  if (!camera::ConvertPyramid(raw.data(), pyramid_outputs.fmts, nullptr)) {
+    printf("  %s: conversion failed\n", pyramid.name);
+    return false;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < pyramid.levels.size(); ++i) {
+    camera::ConvertBayer(raw.data(), separate_outputs.fmts[i], nullptr);
+    const auto& got = pyramid_outputs.buffers[i];
+    const auto& want = separate_outputs.buffers[i];
+    int max_difference = 0;
+    double sum = 0;
+    for (size_t k = 0; k < got.size(); ++k) {
+      const int difference = std::abs(got[k] - want[k]);
+      max_difference = std::max(max_difference, difference);
+      sum += difference;
+    }
+    printf("  %s level %zu: differs from its own conversion by %.2f on "
+           "average, %d at most\n",
+           pyramid.name, i, sum / got.size(), max_difference);
+    if (i == 0 && max_difference != 0) ok = false;
+  }
+  return ok;
+}
+
+// Converts `pyramid` a few times in one workspace, and checks that only the
+// first conversion allocates.
+bool CheckAllocations(const std::vector<uint8_t>& raw, const Pyramid& pyramid) {
+  Outputs outputs(pyramid, true);
+  camera::WhiteBalance white_balance;
+  camera::Workspace workspace;
+  int steady = 0;
+  for (int i = 0; i < 4; ++i) {
+    const int before = benchmark::HeapAllocations();
+    camera::ConvertPyramid(raw.data(), outputs.fmts, &white_balance,
+                           &workspace);
+    if (i > 0) steady += benchmark::HeapAllocations() - before;
+  }
+  printf("  %s: workspace of %zu bytes (%zu needed), %d allocations after "
+         "the first frame\n",
+         pyramid.name, workspace.size(), workspace.peak(), steady);
+  return steady == 0;
+}
+
+void Benchmark(const std::vector<uint8_t>& raw, const Pyramid& pyramid) {
+  Outputs outputs(pyramid, true);
+  camera::WhiteBalance white_balance;
+  camera::Workspace workspace;
+  const double pyramid_micros = benchmark::Best([&] {
+    camera::ConvertPyramid(raw.data(), outputs.fmts, &white_balance,
+                           &workspace);
+  }).micros;
+  const double separate_micros = benchmark::Best([&] {
+    for (const CameraFrameFormat& fmt : outputs.fmts) {
+      camera::ConvertBayer(raw.data(), fmt, &white_balance);
+    }
+  }).micros;
+  printf("  %-42s %10.1f %10.1f\n", pyramid.name, pyramid_micros,
+         separate_micros);
+}
+
+bool Replay(const std::vector<uint8_t>& raw) {
+  bool ok = true;
+  for (const Pyramid& pyramid : kPyramids) {
+    ok &= CheckLevels(raw, pyramid);
+    ok &= CheckAllocations(raw, pyramid);
+  }
+  printf("White balanced, bilinear demosaic, 270 degrees (us per frame):\n");
+  printf("  %-42s %10s %10s\n", "levels", "pyramid", "separate");
+  for (const Pyramid& pyramid : kPyramids) Benchmark(raw, pyramid);
+  return ok;
+}
+}  // namespace
+}  // namespace coralmicro
+
+int main(int argc, char** argv) {
+  using namespace coralmicro;
+  if (argc < 2) {
+    printf("Usage: %s FRAME...\n", argv[0]);
+    return 2;
+  }
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) {
+    std::vector<uint8_t> raw;
+    if (!camera::ReadRawFrame(argv[i], &raw)) return 2;
+    printf("%s\n", argv[i]);
+    ok &= Replay(raw);
+  }
+  std::vector<uint8_t> noise;
+  camera::NoiseFrame(&noise);
+  printf("noise\n");
+  ok &= Replay(noise);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TESTS_HOST_CAMERA_CAMERA_REFERENCE_H_
+#define TESTS_HOST_CAMERA_CAMERA_REFERENCE_H_
+
+#include <cstdint>
+
+#include "libs/camera/camera_format.h"
+
+namespace coralmicro {
+namespace camera {
+namespace reference {
+
+// Converts `raw` into `fmt` the way `CameraTask::GetFrame()` did before the
+// streaming pipeline of camera_pipeline.h: a full-frame demosaic into a heap
+// buffer, then auto white balance over it, then a nearest-neighbor resize.
+// The code is that of libs/camera/camera.cc at the time, with `CHECK`
+// replaced by `assert`, and rotations about the center of the frame (see
+// `RotateXY()`). Only `fmt`'s format, filter, rotation, size and
+// preserve_ratio are used.
+//
+// @return False if `fmt` is not `kRgb` or `kY8`.
+bool Convert(const uint8_t* raw, const CameraFrameFormat& fmt,
+             bool white_balance);
+
+}  // namespace reference
+}  // namespace camera
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_CAMERA_CAMERA_REFERENCE_H_
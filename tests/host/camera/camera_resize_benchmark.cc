@@ -0,0 +1,274 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks the camera pipeline's bilinear and area resizes against float
+// resamplers of the full demosaiced frame, and times each resize method per
+// output pixel.
+//
+// Usage: camera_resize_benchmark FRAME...
+//
+// Each FRAME is a raw 324x324 Bayer frame, as `CameraFormat::kRaw` returns,
+// and is followed by a frame of noise. On the host the pipeline builds
+// without the ARM DSP instructions, so this checks and times the portable
+// C code. Exits with 1 if any output is off by more than the method's
+// tolerance.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "libs/camera/camera_pipeline.h"
+#include "tests/host/benchmark.h"
+#include "tests/host/camera/camera_reference.h"
+#include "tests/host/camera/raw_frames.h"
+
+namespace coralmicro {
+namespace {
+constexpr int kSide = camera::kSensorWidth;
+static_assert(camera::kSensorWidth == camera::kSensorHeight,
+              "The float resamplers expect a square frame");
+
+struct Size {
+  int width;
+  int height;
+};
+constexpr Size kSizes[] = {{96, 96},  {224, 224}, {320, 240}, {240, 320},
+                           {100, 50}, {33, 97},   {1, 1},     {162, 162},
+                           {324, 324}, {640, 480}};
+
+constexpr CameraRotation kRotations[] = {CameraRotation::k0,
+                                         CameraRotation::k90,
+                                         CameraRotation::k180,
+                                         CameraRotation::k270};
+constexpr CameraFilterMethod kFilters[] = {
+    CameraFilterMethod::kBilinear, CameraFilterMethod::kNearestNeighbor};
+
+struct Method {
+  CameraResizeMethod resize;
+  const char* name;
+  // Largest difference allowed from the float resampler, for the bilinear
+  // weights' 7 fraction bits and the rounding of the area mean.
+  int tolerance;
+};
+constexpr Method kMethods[] = {
+    {CameraResizeMethod::kNearestNeighbor, "nearest", 0},
+    {CameraResizeMethod::kBilinear, "bilinear", 2},
+    {CameraResizeMethod::kArea, "area", 1},
+};
+
+// Returns the part of a `width` x `height` output that the frame is scaled
+// into, at its top left.
+Size ScaledSize(Size size, bool preserve_ratio) {
+  if (!preserve_ratio) return size;
+  const int side = std::min(size.width, size.height);
+  return {side, side};
+}
+
+// Bilinear resize of the `kSide` x `kSide` RGB frame `src`, sampling at
+// pixel centers and clamping at the edges.
+std::vector<float> Bilinear(const std::vector<uint8_t>& src, Size size,
+                            bool preserve_ratio) {
+  const Size scaled = ScaledSize(size, preserve_ratio);
+  std::vector<float> out(size.width * size.height * 3, 0);
+  for (int y = 0; y < scaled.height; ++y) {
+    const float fy =
+        std::max(0.f, (y + .5f) * kSide / scaled.height - .5f);
+    const int y0 = std::min(static_cast<int>(fy), kSide - 1);
+    const int y1 = std::min(y0 + 1, kSide - 1);
+    const float wy = y0 == kSide - 1 ? 0 : fy - y0;
+    for (int x = 0; x < scaled.width; ++x) {
+      const float fx =
+          std::max(0.f, (x + .5f) * kSide / scaled.width - .5f);
+      const int x0 = std::min(static_cast<int>(fx), kSide - 1);
+      const int x1 = std::min(x0 + 1, kSide - 1);
+      const float wx = x0 == kSide - 1 ? 0 : fx - x0;
+      for (int c = 0; c < 3; ++c) {
+        auto at = [&](int yy, int xx) {
+          return static_cast<float>(src[(yy * kSide + xx) * 3 + c]);
+        };
+        out[(y * size.width + x) * 3 + c] =
+            (at(y0, x0) * (1 - wx) + at(y0, x1) * wx) * (1 - wy) +
+            (at(y1, x0) * (1 - wx) + at(y1, x1) * wx) * wy;
+      }
+    }
+  }
+  return out;
+}
+
+// Area resize of the `kSide` x `kSide` RGB frame `src`: each output pixel is
+// the mean of the source pixels it covers, weighted by coverage.
+std::vector<float> Area(const std::vector<uint8_t>& src, Size size,
+                        bool preserve_ratio) {
+  const Size scaled = ScaledSize(size, preserve_ratio);
+  std::vector<float> out(size.width * size.height * 3, 0);
+  for (int y = 0; y < scaled.height; ++y) {
+    const double top = static_cast<double>(y) * kSide / scaled.height;
+    const double bottom = static_cast<double>(y + 1) * kSide / scaled.height;
+    for (int x = 0; x < scaled.width; ++x) {
+      const double left = static_cast<double>(x) * kSide / scaled.width;
+      const double right = static_cast<double>(x + 1) * kSide / scaled.width;
+      double sum[3] = {0, 0, 0};
+      double weight_sum = 0;
+      for (int sy = static_cast<int>(top); sy < kSide && sy < bottom; ++sy) {
+        const double h = std::min<double>(sy + 1, bottom) -
+                         std::max<double>(sy, top);
+        for (int sx = static_cast<int>(left); sx < kSide && sx < right;
+             ++sx) {
+          const double w = h * (std::min<double>(sx + 1, right) -
+                                std::max<double>(sx, left));
+          if (w <= 0) continue;
+          weight_sum += w;
+          for (int c = 0; c < 3; ++c) {
+            sum[c] += w * src[(sy * kSide + sx) * 3 + c];
+          }
+        }
+      }
+      for (int c = 0; c < 3; ++c) {
+        out[(y * size.width + x) * 3 + c] = sum[c] / weight_sum;
+      }
+    }
+  }
+  return out;
+}
+
+CameraFrameFormat MakeFormat(CameraFilterMethod filter,
+                             CameraRotation rotation, Size size,
+                             bool preserve_ratio, CameraResizeMethod resize,
+                             uint8_t* buffer) {
+  CameraFrameFormat fmt{CameraFormat::kRgb, filter,         rotation,
+                        size.width,         size.height,    preserve_ratio,
+                        buffer};
+  fmt.white_balance = false;
+  fmt.resize = resize;
+  return fmt;
+}
+
+// Checks the bilinear and area resizes of `raw` against the float ones.
+bool CheckResize(const std::vector<uint8_t>& raw) {
+  int cases = 0;
+  int failures = 0;
+  int worst[3] = {0, 0, 0};
+  for (auto filter : kFilters) {
+    for (auto rotation : kRotations) {
+      // The full frame, demosaiced and rotated as the pipeline does.
+      std::vector<uint8_t> full(kSide * kSide * 3);
+      camera::reference::Convert(
+          raw.data(),
+          MakeFormat(filter, rotation, {kSide, kSide}, false,
+                     CameraResizeMethod::kNearestNeighbor, full.data()),
+          false);
+      for (const Size& size : kSizes) {
+        for (bool preserve_ratio : {false, true}) {
+          for (int m = 1; m < 3; ++m) {
+            const Method& method = kMethods[m];
+            const std::vector<float> want =
+                method.resize == CameraResizeMethod::kArea
+                    ? Area(full, size, preserve_ratio)
+                    : Bilinear(full, size, preserve_ratio);
+            // Pixels left unwritten show up as differences.
+            std::vector<uint8_t> got(want.size(), 0x5a);
+            const bool ok = camera::ConvertBayer(
+                raw.data(),
+                MakeFormat(filter, rotation, size, preserve_ratio,
+                           method.resize, got.data()),
+                nullptr);
+            int difference = 0;
+            for (size_t i = 0; i < got.size(); ++i) {
+              difference = std::max(
+                  difference,
+                  static_cast<int>(std::lround(std::fabs(got[i] - want[i]))));
+            }
+            worst[m] = std::max(worst[m], difference);
+            ++cases;
+            if (!ok || difference > method.tolerance) {
+              ++failures;
+              printf("  %s %dx%d filter %d rotation %d preserve_ratio %d: "
+                     "%s, off by %d\n",
+                     method.name, size.width, size.height,
+                     static_cast<int>(filter), static_cast<int>(rotation),
+                     preserve_ratio, ok ? "converted" : "failed", difference);
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("Resize against float: %d of %d cases within tolerance "
+         "(bilinear off by at most %d, area by at most %d)\n",
+         cases - failures, cases, worst[1], worst[2]);
+  return failures == 0;
+}
+
+void BenchmarkResize(const std::vector<uint8_t>& raw) {
+  printf("RGB, bilinear demosaic, 270 degrees, %s code:\n",
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+         "ARM DSP"
+#else
+         "portable C"
+#endif
+  );
+  printf("  %-9s %-9s %10s %12s %16s\n", "size", "resize", "us/frame",
+         "ns/out px", "cycles/out px");
+  for (const Size& size : {Size{224, 224}, Size{96, 96}}) {
+    for (const Method& method : kMethods) {
+      std::vector<uint8_t> buffer(size.width * size.height * 3);
+      const CameraFrameFormat fmt =
+          MakeFormat(CameraFilterMethod::kBilinear, CameraRotation::k270,
+                     size, false, method.resize, buffer.data());
+      const benchmark::Timing timing = benchmark::Best(
+          [&] { camera::ConvertBayer(raw.data(), fmt, nullptr); });
+      const int pixels = size.width * size.height;
+      if (benchmark::kHasCycles) {
+        printf("  %3dx%-5d %-9s %10.1f %12.1f %16.1f\n", size.width,
+               size.height, method.name, timing.micros,
+               timing.micros * 1000 / pixels, timing.cycles / pixels);
+      } else {
+        printf("  %3dx%-5d %-9s %10.1f %12.1f %16s\n", size.width,
+               size.height, method.name, timing.micros,
+               timing.micros * 1000 / pixels, "n/a");
+      }
+    }
+  }
+}
+
+bool Replay(const std::vector<uint8_t>& raw) {
+  const bool ok = CheckResize(raw);
+  BenchmarkResize(raw);
+  return ok;
+}
+}  // namespace
+}  // namespace coralmicro
+
+int main(int argc, char** argv) {
+  using namespace coralmicro;
+  if (argc < 2) {
+    printf("Usage: %s FRAME...\n", argv[0]);
+    return 2;
+  }
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) {
+    std::vector<uint8_t> raw;
+    if (!camera::ReadRawFrame(argv[i], &raw)) return 2;
+    printf("%s\n", argv[i]);
+    ok &= Replay(raw);
+  }
+  std::vector<uint8_t> noise;
+  camera::NoiseFrame(&noise);
+  printf("noise\n");
+  ok &= Replay(noise);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TESTS_HOST_CAMERA_RAW_FRAMES_H_
+#define TESTS_HOST_CAMERA_RAW_FRAMES_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "libs/camera/camera_format.h"
+#include "tests/host/benchmark.h"
+
+namespace coralmicro {
+namespace camera {
+
+// Reads a raw Bayer frame, as `CameraFormat::kRaw` returns, from `path`.
+inline bool ReadRawFrame(const std::string& path, std::vector<uint8_t>* raw) {
+  return benchmark::ReadFile(path, raw, kSensorWidth * kSensorHeight);
+}
+
+// Fills `raw` with a reproducible frame of uniform noise, which reaches
+// every value of every channel.
+inline void NoiseFrame(std::vector<uint8_t>* raw) {
+  raw->resize(kSensorWidth * kSensorHeight);
+  uint32_t state = 1;
+  for (uint8_t& value : *raw) {
+    state = state * 1664525 + 1013904223;
+    value = state >> 24;
+  }
+}
+
+}  // namespace camera
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_CAMERA_RAW_FRAMES_H_
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_BASE_CHECK_H_
+#define LIBS_BASE_CHECK_H_
+
+// Host stand-in for libs/base/check.h, whose `CHECK` reports through the
+// board's console and suspends FreeRTOS. Host targets put tests/host/fakes
+// ahead of the source tree on the include path to pick this one up.
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(a)                                                            \
+  do {                                                                      \
+    if (!(a)) {                                                             \
+      fprintf(stderr, "%s:%d %s was not true.\n", __FILE__, __LINE__, #a); \
+      abort();                                                              \
+    }                                                                       \
+  } while (0)
+
+#endif  // LIBS_BASE_CHECK_H_
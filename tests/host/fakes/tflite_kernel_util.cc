@@ -0,0 +1,70 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host stand-ins for the tflite-micro helpers libs/tpu calls, so that host
+// targets don't build the kernel library for them. They behave as
+// tensorflow/lite/micro/kernels/kernel_util.cc and memory_helpers.cc do for
+// the types the Edge TPU op uses.
+
+#include "tensorflow/lite/micro/kernels/kernel_util.h"
+#include "tensorflow/lite/micro/memory_helpers.h"
+
+namespace tflite {
+namespace micro {
+
+const TfLiteEvalTensor* GetEvalInput(const TfLiteContext* context,
+                                     const TfLiteNode* node, int index) {
+  if (index < 0 || index >= node->inputs->size) return nullptr;
+  return context->GetEvalTensor(context, node->inputs->data[index]);
+}
+
+TfLiteEvalTensor* GetEvalOutput(const TfLiteContext* context,
+                                const TfLiteNode* node, int index) {
+  if (index < 0 || index >= node->outputs->size) return nullptr;
+  return context->GetEvalTensor(context, node->outputs->data[index]);
+}
+
+}  // namespace micro
+
+TfLiteStatus TfLiteEvalTensorByteLength(const TfLiteEvalTensor* eval_tensor,
+                                        size_t* out_bytes) {
+  size_t type_size;
+  switch (eval_tensor->type) {
+    case kTfLiteUInt8:
+    case kTfLiteInt8:
+      type_size = 1;
+      break;
+    case kTfLiteInt16:
+      type_size = 2;
+      break;
+    case kTfLiteFloat32:
+    case kTfLiteInt32:
+      type_size = 4;
+      break;
+    default:
+      return kTfLiteError;
+  }
+  size_t element_count = 1;
+  if (eval_tensor->dims) {
+    for (int i = 0; i < eval_tensor->dims->size; ++i) {
+      element_count *= eval_tensor->dims->data[i];
+    }
+  }
+  *out_bytes = element_count * type_size;
+  return kTfLiteOk;
+}
+
+}  // namespace tflite
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TESTS_HOST_TPU_EDGETPU_MODELS_H_
+#define TESTS_HOST_TPU_EDGETPU_MODELS_H_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "libs/tpu/edgetpu_op.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace coralmicro {
+
+// Returns the custom options of each Edge TPU op in `model`, which hold the
+// op's package, in the order of the model's subgraphs and operators.
+inline std::vector<const flatbuffers::Vector<uint8_t>*> FindEdgeTpuPackages(
+    const std::vector<uint8_t>& model) {
+  std::vector<const flatbuffers::Vector<uint8_t>*> packages;
+  const auto* tflite_model = tflite::GetModel(model.data());
+  for (const auto* subgraph : *tflite_model->subgraphs()) {
+    for (const auto* op : *subgraph->operators()) {
+      const auto* code =
+          tflite_model->operator_codes()->Get(op->opcode_index());
+      if (code->custom_code() && op->custom_options() &&
+          strcmp(code->custom_code()->c_str(), kCustomOp) == 0) {
+        packages.push_back(op->custom_options());
+      }
+    }
+  }
+  return packages;
+}
+
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_TPU_EDGETPU_MODELS_H_
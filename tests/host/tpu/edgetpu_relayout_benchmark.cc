@@ -0,0 +1,215 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks the relayout plans of `OutputLayer` against the relayout they
+// replaced, on the output layers of Edge TPU models, and times both.
+//
+// Usage: edgetpu_relayout_benchmark MODEL...
+//
+// The output activations of each layer are filled with random bytes, and
+// laid out by `reference::Relayout()` and by `OutputLayer::RelayoutChunk()`,
+// given the activations whole and in chunks of several sizes, including ones
+// that cut elements in two. The tensors must match, and each element must be
+// the one `reference::GetBufferIndex()` finds. Exits with 1 otherwise.
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "libs/tpu/edgetpu_arena.h"
+#include "libs/tpu/edgetpu_executable.h"
+#include "tests/host/benchmark.h"
+#include "tests/host/tpu/edgetpu_models.h"
+#include "tests/host/tpu/relayout_reference.h"
+
+namespace coralmicro {
+namespace {
+// Sizes the activations are given to `RelayoutChunk()` in, 0 for whole: the
+// driver's bulk chunks, USB high speed packets, and sizes that cut elements.
+constexpr uint32_t kChunkSizes[] = {0, 8 * 1024, 512, 61, 1};
+// The chunk size relayouts are timed with, that of the driver.
+constexpr uint32_t kTimedChunkSize = 8 * 1024;
+// Fills the tensor before each relayout, so that bytes the relayout fails to
+// write show up as differences.
+constexpr uint8_t kUnwritten = 0x5a;
+
+int DataTypeSize(platforms::darwinn::DataType data_type) {
+  switch (data_type) {
+    case platforms::darwinn::DataType_FIXED_POINT16:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT16:
+    case platforms::darwinn::DataType_BFLOAT:
+    case platforms::darwinn::DataType_HALF:
+      return 2;
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT32:
+    case platforms::darwinn::DataType_SINGLE:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+void RelayoutInChunks(const OutputLayer& output_layer,
+                      const std::vector<uint8_t>& activations,
+                      uint32_t chunk_size, uint8_t* dest) {
+  const uint32_t size = activations.size();
+  if (chunk_size == 0) chunk_size = size;
+  for (uint32_t offset = 0; offset < size; offset += chunk_size) {
+    output_layer.RelayoutChunk(activations.data() + offset, offset,
+                               std::min(chunk_size, size - offset), dest);
+  }
+}
+
+// Returns the number of elements of `tensor` that are not the ones
+// `reference::GetBufferIndex()` finds in `activations`.
+int CheckBufferIndices(const platforms::darwinn::Layer* layer,
+                       const std::vector<uint8_t>& activations,
+                       const std::vector<uint8_t>& tensor) {
+  if (layer->x_dim() == 1 && layer->y_dim() == 1) return 0;
+  const int size = DataTypeSize(layer->data_type());
+  const uint8_t sign =
+      OutputLayer::SignedDataType(layer->data_type()) ? 0x80 : 0;
+  int differences = 0;
+  const uint8_t* element = tensor.data();
+  for (int y = 0; y < layer->y_dim(); ++y) {
+    for (int x = 0; x < layer->x_dim(); ++x) {
+      for (int z = 0; z < layer->z_dim(); ++z) {
+        const uint8_t* src =
+            &activations[reference::GetBufferIndex(layer, y, x, z) * size];
+        if (memcmp(element, src, size - 1) != 0 ||
+            element[size - 1] != (src[size - 1] ^ sign)) {
+          ++differences;
+        }
+        element += size;
+      }
+    }
+  }
+  return differences;
+}
+
+int CountDifferences(const std::vector<uint8_t>& a,
+                     const std::vector<uint8_t>& b) {
+  int differences = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i] != b[i]) ++differences;
+  }
+  return differences;
+}
+
+// Checks and times the relayout of `layer`, the output layer of the given
+// `index`. Returns false if the plan's tensor differs from the reference's.
+bool CheckLayer(const platforms::darwinn::Layer* layer, int index,
+                std::mt19937* random) {
+  EdgeTpuArena arena;
+  const OutputLayer* output_layer = OutputLayer::Create(&arena, layer, index);
+  if (!output_layer) {
+    printf("  %s: can't create the output layer\n", layer->name()->c_str());
+    return false;
+  }
+  const size_t plan_bytes = arena.used();
+  std::vector<uint8_t> activations(layer->size_bytes() *
+                                   layer->execution_count_per_inference());
+  for (auto& byte : activations) byte = (*random)();
+  std::vector<uint8_t> expected(output_layer->ActualSizeBytes(), kUnwritten);
+  reference::Relayout(layer, activations.data(), expected.data());
+
+  bool ok = true;
+  const int index_differences =
+      CheckBufferIndices(layer, activations, expected);
+  if (index_differences) {
+    printf("  %s: %d elements of the reference differ from GetBufferIndex()\n",
+           layer->name()->c_str(), index_differences);
+    ok = false;
+  }
+  std::vector<uint8_t> tensor(expected.size());
+  for (uint32_t chunk_size : kChunkSizes) {
+    std::fill(tensor.begin(), tensor.end(), kUnwritten);
+    RelayoutInChunks(*output_layer, activations, chunk_size, tensor.data());
+    const int differences = CountDifferences(tensor, expected);
+    if (differences) {
+      printf("  %s: %d bytes differ in chunks of %u bytes\n",
+             layer->name()->c_str(), differences, chunk_size);
+      ok = false;
+    }
+  }
+
+  const auto reference_timing = benchmark::Best([&] {
+    reference::Relayout(layer, activations.data(), tensor.data());
+  });
+  const auto plan_timing = benchmark::Best([&] {
+    RelayoutInChunks(*output_layer, activations, kTimedChunkSize,
+                     tensor.data());
+  });
+  char shape[32];
+  snprintf(shape, sizeof(shape), "%dx%dx%d x%d", layer->y_dim(),
+           layer->x_dim(), layer->z_dim(),
+           layer->execution_count_per_inference());
+  printf("  %-40s %-14s %8zu %6zu %8.2f %8.2f %6.1fx\n",
+         layer->name()->c_str(), shape, expected.size(), plan_bytes,
+         reference_timing.micros, plan_timing.micros,
+         reference_timing.micros / plan_timing.micros);
+  return ok;
+}
+
+// Checks the output layers of every executable in `model_path`.
+bool CheckModel(const std::string& model_path, std::mt19937* random) {
+  std::vector<uint8_t> model;
+  if (!benchmark::ReadFile(model_path, &model)) return false;
+  const auto packages = FindEdgeTpuPackages(model);
+  if (packages.empty()) {
+    printf("%s has no %s\n", model_path.c_str(), kCustomOp);
+    return false;
+  }
+  printf("%s\n", model_path.substr(model_path.rfind('/') + 1).c_str());
+  bool ok = true;
+  for (const auto* package : packages) {
+    const platforms::darwinn::Executable* executables[2];
+    if (!ParseEdgeTpuPackage(reinterpret_cast<const char*>(package->data()),
+                             package->size(), &executables[0],
+                             &executables[1])) {
+      return false;
+    }
+    for (const auto* executable : executables) {
+      if (!executable || !executable->output_layers()) continue;
+      int index = 0;
+      for (const auto* layer : *executable->output_layers()) {
+        ok &= CheckLayer(layer, index++, random);
+      }
+    }
+  }
+  return ok;
+}
+}  // namespace
+}  // namespace coralmicro
+
+int main(int argc, char** argv) {
+  using namespace coralmicro;
+  if (argc < 2) {
+    printf("Usage: %s MODEL...\n", argv[0]);
+    return 2;
+  }
+  // Shapes are y x x x z, times the executions per inference. The plan is
+  // what the output layer and its relayout plan take in the arena.
+  printf("  %-40s %-14s %8s %6s %8s %8s %7s\n", "output layer", "shape",
+         "bytes", "plan", "old us", "plan us", "speedup");
+  std::mt19937 random(1);
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) {
+    ok &= CheckModel(argv[i], &random);
+  }
+  return ok ? 0 : 1;
+}
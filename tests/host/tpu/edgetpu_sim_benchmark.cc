@@ -0,0 +1,210 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs an Edge TPU model through libs/tpu on the host, against a simulated
+// Edge TPU, checks what it sends and the outputs it relays out, and times it.
+//
+// Usage: edgetpu_sim_benchmark MODEL INPUT EXPECTED_OUTPUT BULK_OUT BULK_IN
+//            [INFERENCES]
+//
+// The package of the model's `edgetpu-custom-op` is parsed and verified as
+// `EdgeTpuManager::RegisterPackage()` does, and its inference executable is
+// run by `TpuDriver` over `EdgeTpuSimTransport`. BULK_OUT is the golden
+// capture of what the bulk out pipe is sent for one inference, and BULK_IN
+// the trace the bulk in pipe replays, as make_sim_traces.py writes them.
+// Every inference, with chunks sent in place and through the bounce buffers,
+// and after a performance mode switch, must send the golden capture and
+// relay the trace out into EXPECTED_OUTPUT. Exits with 1 otherwise.
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_arena.h"
+#include "libs/tpu/edgetpu_driver.h"
+#include "libs/tpu/edgetpu_executable.h"
+#include "libs/tpu/edgetpu_op.h"
+#include "libs/tpu/edgetpu_profile.h"
+#include "tests/host/benchmark.h"
+#include "tests/host/tpu/edgetpu_models.h"
+#include "tests/host/tpu/edgetpu_sim_transport.h"
+
+namespace coralmicro {
+namespace {
+// Inferences timed when none are given.
+constexpr int kDefaultInferences = 200;
+// Fills the output before each checked inference, so that bytes the relayout
+// fails to write show up as differences.
+constexpr uint8_t kUnwritten = 0x5a;
+
+struct Files {
+  std::vector<uint8_t> model;
+  std::vector<uint8_t> input;
+  std::vector<uint8_t> expected;
+  std::vector<uint8_t> bulk_out;
+  std::vector<uint8_t> bulk_in;
+};
+
+// Runs one inference of `executable`, and checks what it sends against the
+// golden capture and its output against the expected one.
+bool CheckInference(const char* what, EdgeTpuExecutable* executable,
+                    const TpuDriver& driver, EdgeTpuSimTransport* sim,
+                    const Files& files) {
+  std::vector<uint8_t> output(files.expected.size(), kUnwritten);
+  sim->Rewind();
+  sim->ResetStats();
+  const TfLiteStatus status = executable->Invoke(
+      driver, files.input.data(), files.input.size(),
+      [&output](int index, size_t size) -> uint8_t* {
+        return index == 0 && size <= output.size() ? output.data() : nullptr;
+      });
+  int differences = 0;
+  for (size_t i = 0; i < output.size(); ++i) {
+    if (output[i] != files.expected[i]) ++differences;
+  }
+  const bool sent_all = sim->stats().bytes_out == files.bulk_out.size();
+  const bool ok = status == kTfLiteOk && sim->matches_golden() && sent_all &&
+                  differences == 0;
+  printf("%s: %s, ", what, status == kTfLiteOk ? "invoked" : "failed");
+  if (!sim->matches_golden()) {
+    printf("bulk out differs from the golden capture at byte %lld, ",
+           static_cast<long long>(sim->mismatch_offset()));
+  } else {
+    printf("bulk out %s the golden capture (%llu of %zu bytes), ",
+           sent_all ? "matches" : "stops short of",
+           static_cast<unsigned long long>(sim->stats().bytes_out),
+           files.bulk_out.size());
+  }
+  printf("%d output bytes differ\n", differences);
+  return ok;
+}
+
+// Times `inferences` inferences back to back, checking each against the
+// golden capture, and prints where the time goes.
+bool Benchmark(EdgeTpuExecutable* executable, const TpuDriver& driver,
+               EdgeTpuSimTransport* sim, const Files& files, int inferences) {
+  std::vector<uint8_t> output(files.expected.size());
+  EdgeTpuProfile profile = {};
+  executable->set_profile(&profile);
+  int mismatches = 0;
+  const uint64_t start = TimerMicros();
+  for (int i = 0; i < inferences; ++i) {
+    sim->Rewind();
+    if (executable->Invoke(driver, files.input.data(), files.input.size(),
+                           [&output](int index, size_t size) -> uint8_t* {
+                             return output.data();
+                           }) != kTfLiteOk ||
+        !sim->matches_golden()) {
+      ++mismatches;
+    }
+  }
+  const double us = TimerMicros() - start;
+  executable->set_profile(nullptr);
+
+  const double bytes = files.bulk_out.size() + files.bulk_in.size();
+  printf("%d inferences: %.1f us each, %.0f inferences/s, %.1f MB/s through "
+         "the driver\n",
+         inferences, us / inferences, inferences * 1e6 / us,
+         bytes * inferences / us);
+  printf("  %-12s %10s %10s %10s\n", "phase", "us each", "max us", "bytes");
+  for (int i = 0; i < kEdgeTpuPhaseCount; ++i) {
+    const auto phase = static_cast<EdgeTpuPhase>(i);
+    const EdgeTpuPhaseStats& stats = profile.phase(phase);
+    if (stats.count == 0) continue;
+    printf("  %-12s %10.2f %10u %10llu\n", EdgeTpuPhaseName(phase),
+           static_cast<double>(stats.total_us) / stats.count, stats.max_us,
+           static_cast<unsigned long long>(stats.bytes / stats.count));
+  }
+  if (mismatches) {
+    printf("  %d inferences failed or left the golden capture\n", mismatches);
+  }
+  return mismatches == 0;
+}
+
+bool Run(const Files& files, int inferences) {
+  const auto packages = FindEdgeTpuPackages(files.model);
+  if (packages.empty()) {
+    printf("Model has no %s\n", kCustomOp);
+    return false;
+  }
+  const auto* custom_options = packages.front();
+  const auto* package = reinterpret_cast<const char*>(custom_options->data());
+  const platforms::darwinn::Executable* inference_exe;
+  const platforms::darwinn::Executable* parameter_caching_exe;
+  if (!ParseEdgeTpuPackage(package, custom_options->size(), &inference_exe,
+                           &parameter_caching_exe)) {
+    return false;
+  }
+  // What registering the package costs, less the lock and the lookup.
+  const benchmark::Timing registration = benchmark::Best([&] {
+    EdgeTpuArena arena;
+    ParseEdgeTpuPackage(package, custom_options->size(), &inference_exe,
+                        &parameter_caching_exe);
+    EdgeTpuExecutable::Create(&arena, inference_exe);
+  });
+  EdgeTpuArena arena;
+  auto* executable = EdgeTpuExecutable::Create(&arena, inference_exe);
+  if (!executable) {
+    printf("Can't create the executable\n");
+    return false;
+  }
+  printf("Package of %zu bytes: parsed, verified and created in %.1f us, "
+         "%zu bytes of state\n",
+         static_cast<size_t>(custom_options->size()), registration.micros,
+         arena.used());
+
+  EdgeTpuSimTransport sim;
+  sim.SetGoldenCapture(files.bulk_out);
+  sim.SetOutputTrace(files.bulk_in);
+  TpuDriver driver;
+  if (!driver.Initialize(&sim, PerformanceMode::kMax)) {
+    printf("Driver initialization failed\n");
+    return false;
+  }
+  bool ok = CheckInference("In place", executable, driver, &sim, files);
+  sim.set_send_in_place(false);
+  ok &= CheckInference("Bounced", executable, driver, &sim, files);
+  sim.set_send_in_place(true);
+  const bool switched = driver.SetPerformanceMode(PerformanceMode::kLow);
+  printf("Switch to low performance mode: %s\n", switched ? "ok" : "failed");
+  ok &= switched;
+  ok &= CheckInference("After the switch", executable, driver, &sim, files);
+  ok &= Benchmark(executable, driver, &sim, files, inferences);
+  return ok;
+}
+}  // namespace
+}  // namespace coralmicro
+
+int main(int argc, char** argv) {
+  using namespace coralmicro;
+  if (argc < 6 || argc > 7) {
+    printf("Usage: %s MODEL INPUT EXPECTED_OUTPUT BULK_OUT BULK_IN "
+           "[INFERENCES]\n",
+           argv[0]);
+    return 2;
+  }
+  Files files;
+  if (!benchmark::ReadFile(argv[1], &files.model) ||
+      !benchmark::ReadFile(argv[2], &files.input) ||
+      !benchmark::ReadFile(argv[3], &files.expected) ||
+      !benchmark::ReadFile(argv[4], &files.bulk_out) ||
+      !benchmark::ReadFile(argv[5], &files.bulk_in)) {
+    return 2;
+  }
+  const int inferences = argc == 7 ? atoi(argv[6]) : kDefaultInferences;
+  return Run(files, inferences) ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tests/host/tpu/edgetpu_sim_transport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
+#include "libs/tpu/darwinn/driver/config/beagle_csr_helper.h"
+
+namespace coralmicro {
+namespace {
+namespace registers = platforms::darwinn::driver::config::registers;
+
+// The driver sends the low 32 bits of CSR offsets.
+constexpr uint64_t kCsrAddressMask = 0xFFFFFFFF;
+
+const platforms::darwinn::driver::config::BeagleChipConfig& ChipConfig() {
+  static platforms::darwinn::driver::config::BeagleChipConfig chip_config;
+  return chip_config;
+}
+
+uint64_t CsrAddress(uint64_t reg) { return reg & kCsrAddressMask; }
+}  // namespace
+
+EdgeTpuSimTransport::EdgeTpuSimTransport() {
+  WriteRegister(ChipConfig().GetApexCsrOffsets().omc0_00,
+                registers::Omc000().raw());
+  SetTemperature(40.0f);
+}
+
+void EdgeTpuSimTransport::SetGoldenCapture(std::vector<uint8_t> golden) {
+  golden_ = std::move(golden);
+  golden_offset_ = 0;
+  mismatch_offset_ = -1;
+}
+
+void EdgeTpuSimTransport::SetOutputTrace(std::vector<uint8_t> trace) {
+  trace_ = std::move(trace);
+  trace_offset_ = 0;
+}
+
+void EdgeTpuSimTransport::Rewind() {
+  golden_offset_ = 0;
+  mismatch_offset_ = -1;
+  trace_offset_ = 0;
+  recording_data_.clear();
+}
+
+void EdgeTpuSimTransport::SetTemperature(float celsius) {
+  // The inverse of TpuDriver::GetTemperature().
+  const uint64_t reg = ChipConfig().GetApexCsrOffsets().omc0_dc;
+  registers::Omc0DC omc0_dc(ReadRegister(reg));
+  omc0_dc.set_data(static_cast<uint64_t>(662 - (celsius * 1000 - 550) / 250));
+  WriteRegister(reg, omc0_dc.raw());
+}
+
+uint64_t EdgeTpuSimTransport::ReadRegister(uint64_t reg) const {
+  auto it = registers_.find(CsrAddress(reg));
+  return it == registers_.end() ? 0 : it->second;
+}
+
+void EdgeTpuSimTransport::WriteRegister(uint64_t reg, uint64_t value) {
+  // The chip moves to the power state asked for by rg_force_sleep: 3 puts it
+  // to sleep in reset, which stops the scalar core, and 2 wakes it up.
+  if (CsrAddress(reg) ==
+      CsrAddress(ChipConfig().GetScuCsrOffsets().scu_ctrl_3)) {
+    registers::ScuCtrl3 scu_ctrl_3(value);
+    if (scu_ctrl_3.rg_force_sleep() == 0x3) {
+      scu_ctrl_3.set_cur_pwr_state(0x2);
+      registers_.erase(CsrAddress(
+          ChipConfig().GetScalarCoreCsrOffsets().scalarCoreRunControl));
+    } else if (scu_ctrl_3.rg_force_sleep() == 0x2) {
+      scu_ctrl_3.set_cur_pwr_state(0x0);
+    }
+    value = scu_ctrl_3.raw();
+  }
+  registers_[CsrAddress(reg)] = value;
+}
+
+bool EdgeTpuSimTransport::SubmitControl(const EdgeTpuControlSetup& setup,
+                                        uint8_t* data) {
+  const uint64_t reg =
+      (static_cast<uint64_t>(setup.index) << 16) | setup.value;
+  const size_t length = std::min<size_t>(setup.length, sizeof(uint64_t));
+  uint64_t value = 0;
+  if (setup.read) {
+    value = ReadRegister(reg);
+    memcpy(data, &value, length);
+  } else {
+    memcpy(&value, data, length);
+    WriteRegister(reg, value);
+  }
+  ++stats_.control_transfers;
+  queues_[static_cast<int>(EdgeTpuPipe::kControl)].push_back(setup.length);
+  return true;
+}
+
+bool EdgeTpuSimTransport::SubmitBulk(EdgeTpuPipe pipe, uint8_t* data,
+                                     uint32_t length) {
+  switch (pipe) {
+    case EdgeTpuPipe::kBulkOut:
+      CheckGolden(data, length);
+      if (recording_) {
+        recording_data_.insert(recording_data_.end(), data, data + length);
+      }
+      stats_.bytes_out += length;
+      break;
+    case EdgeTpuPipe::kBulkIn:
+      if (trace_.empty()) {
+        memset(data, 0, length);
+      } else {
+        for (uint32_t copied = 0; copied < length;) {
+          if (trace_offset_ == trace_.size()) trace_offset_ = 0;
+          const size_t n =
+              std::min<size_t>(length - copied, trace_.size() - trace_offset_);
+          memcpy(data + copied, trace_.data() + trace_offset_, n);
+          copied += n;
+          trace_offset_ += n;
+        }
+      }
+      stats_.bytes_in += length;
+      break;
+    case EdgeTpuPipe::kEvent:
+      // The driver ignores what the event holds.
+      memset(data, 0, length);
+      ++stats_.events;
+      break;
+    case EdgeTpuPipe::kControl:
+      return false;
+  }
+  queues_[static_cast<int>(pipe)].push_back(length);
+  return true;
+}
+
+EdgeTpuTransferStatus EdgeTpuSimTransport::Wait(EdgeTpuPipe pipe,
+                                                uint32_t timeout_ms,
+                                                uint32_t* transferred) {
+  auto& queue = queues_[static_cast<int>(pipe)];
+  if (queue.empty()) {
+    return EdgeTpuTransferStatus::kError;
+  }
+  *transferred = queue.front();
+  queue.pop_front();
+  return EdgeTpuTransferStatus::kSuccess;
+}
+
+void EdgeTpuSimTransport::Cancel(EdgeTpuPipe pipe) {
+  queues_[static_cast<int>(pipe)].clear();
+}
+
+void EdgeTpuSimTransport::CheckGolden(const uint8_t* data, uint32_t length) {
+  if (golden_offset_ < golden_.size() && mismatch_offset_ < 0) {
+    const size_t n = std::min<size_t>(length, golden_.size() - golden_offset_);
+    for (size_t i = 0; i < n; ++i) {
+      if (data[i] != golden_[golden_offset_ + i]) {
+        mismatch_offset_ = static_cast<int64_t>(golden_offset_ + i);
+        break;
+      }
+    }
+  }
+  golden_offset_ += length;
+}
+
+}  // namespace coralmicro
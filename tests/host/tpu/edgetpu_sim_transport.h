@@ -0,0 +1,137 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TESTS_HOST_TPU_EDGETPU_SIM_TRANSPORT_H_
+#define TESTS_HOST_TPU_EDGETPU_SIM_TRANSPORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "libs/tpu/edgetpu_transport.h"
+
+namespace coralmicro {
+
+// Transport to a simulated Edge TPU, so that the host side of libs/tpu
+// (package parsing, DMA hints, the bulk pipes and relayout) can run and be
+// benchmarked on the host, without a device.
+//
+// Transfers complete as soon as they are queued. CSRs are kept in a register
+// file that reads back what was last written, and that models the registers
+// the driver polls while it brings the chip up. What the bulk out pipe is
+// sent, headers included, is checked against a golden capture, and can be
+// recorded to make one. Reads of the bulk in pipe replay an output trace, in
+// the layout the device sends outputs before they are relaid out.
+//
+// For example, to check a model against captures of a run on a device:
+//
+// ```
+// EdgeTpuSimTransport sim;
+// sim.SetGoldenCapture(golden);  // test_data/testconv1-bulk-out.bin
+// sim.SetOutputTrace(trace);     // test_data/testconv1-bulk-in.bin
+// TpuDriver driver;
+// driver.Initialize(&sim, PerformanceMode::kMax);
+// sim.Rewind();
+// executable->Invoke(driver, input, input_size, output_buffer);
+// if (!sim.matches_golden()) {
+//   printf("Mismatch at byte %lld\n",
+//          static_cast<long long>(sim.mismatch_offset()));
+// }
+// ```
+class EdgeTpuSimTransport : public EdgeTpuTransport {
+ public:
+  // Bytes and transfers moved since the last reset.
+  struct Stats {
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint32_t control_transfers;
+    uint32_t events;
+  };
+
+  EdgeTpuSimTransport();
+  EdgeTpuSimTransport(const EdgeTpuSimTransport&) = delete;
+  EdgeTpuSimTransport& operator=(const EdgeTpuSimTransport&) = delete;
+
+  // Sets the bytes the bulk out pipe is expected to be sent, in order. Data
+  // sent past the end of the capture is not checked.
+  void SetGoldenCapture(std::vector<uint8_t> golden);
+  // Returns true if everything sent so far matches the golden capture.
+  bool matches_golden() const { return mismatch_offset_ < 0; }
+  // Offset of the first byte sent that did not match the golden capture, or
+  // -1 if all did.
+  int64_t mismatch_offset() const { return mismatch_offset_; }
+
+  // Sets the bytes reads of the bulk in pipe return, in order. Once the trace
+  // runs out, reads start over from its first byte, so a trace of one
+  // inference serves any number of them. Reads return zeros if it is empty.
+  void SetOutputTrace(std::vector<uint8_t> trace);
+
+  // Starts or stops appending what the bulk out pipe is sent to
+  // `recording()`.
+  void set_recording(bool recording) { recording_ = recording; }
+  const std::vector<uint8_t>& recording() const { return recording_data_; }
+
+  // Rewinds the golden capture and the output trace to their first byte, and
+  // clears the recording, so the next inference is checked from the start.
+  void Rewind();
+
+  // Sets the die temperature the chip reports, in degrees Celsius.
+  void SetTemperature(float celsius);
+
+  uint64_t ReadRegister(uint64_t reg) const;
+  void WriteRegister(uint64_t reg, uint64_t value);
+
+  const Stats& stats() const { return stats_; }
+  void ResetStats() { stats_ = {}; }
+
+  bool SubmitControl(const EdgeTpuControlSetup& setup, uint8_t* data) override;
+  bool SubmitBulk(EdgeTpuPipe pipe, uint8_t* data, uint32_t length) override;
+  EdgeTpuTransferStatus Wait(EdgeTpuPipe pipe, uint32_t timeout_ms,
+                             uint32_t* transferred) override;
+  void Cancel(EdgeTpuPipe pipe) override;
+  // Chunks are sent in place unless `set_send_in_place(false)`, which makes
+  // the driver copy them through its bounce buffers as it does for memory
+  // the device can't reach.
+  void set_send_in_place(bool send_in_place) {
+    send_in_place_ = send_in_place;
+  }
+  bool CanSendInPlace(const uint8_t* data, uint32_t length) const override {
+    return send_in_place_;
+  }
+  void DelayMicros(uint32_t us) override {}
+
+ private:
+  void CheckGolden(const uint8_t* data, uint32_t length);
+
+  // Bytes moved by each transfer queued on a pipe, oldest first.
+  std::deque<uint32_t> queues_[kEdgeTpuPipeCount];
+  std::map<uint64_t, uint64_t> registers_;
+  std::vector<uint8_t> golden_;
+  size_t golden_offset_ = 0;
+  int64_t mismatch_offset_ = -1;
+  std::vector<uint8_t> trace_;
+  size_t trace_offset_ = 0;
+  bool send_in_place_ = true;
+  bool recording_ = false;
+  std::vector<uint8_t> recording_data_;
+  Stats stats_ = {};
+};
+
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_TPU_EDGETPU_SIM_TRANSPORT_H_
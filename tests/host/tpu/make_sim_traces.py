@@ -0,0 +1,275 @@
+#!/usr/bin/python3
+# Copyright 2022 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Makes the bulk pipe traces edgetpu_sim_benchmark replays.
+
+Given an Edge TPU model, an input and the output it is expected to give,
+writes:
+
+  PREFIX-bulk-out.bin  What the driver sends on the bulk out pipe for one
+                       inference: the header and data of each instruction,
+                       input and parameter transfer, in the order of the
+                       executable's DMA hints.
+  PREFIX-bulk-in.bin   What the device sends on the bulk in pipe: each
+                       output in the tiled layout of its output layer,
+                       before the driver relays it out.
+
+EXPECTED_OUTPUT holds the output tensors back to back, in the order of the
+executable's DMA hints.
+
+The package is read straight from the model's flatbuffers, and the output is
+laid out with the formula of the executable schema, so that the traces don't
+depend on the libs/tpu code they check. No flatbuffers module is needed.
+
+Usage:
+  make_sim_traces.py MODEL INPUT EXPECTED_OUTPUT PREFIX
+"""
+
+import struct
+import sys
+
+# Executable schema, see libs/tpu/executable_generated.h.
+_EXECUTABLE_STAND_ALONE = 0
+_EXECUTABLE_EXECUTION_ONLY = 2
+_HINT_DMA_DESCRIPTOR = 1
+_HINT_INSTRUCTION = 2
+_DESC_OUTPUT = 0
+_DESC_INPUT = 1
+_DESC_PARAMETER = 2
+_TAG_INSTRUCTIONS = 0
+_TAG_INPUTS = 1
+_TAG_PARAMETERS = 2
+_DATA_TYPE_SIZES = {0: 1, 1: 2, 2: 4, 3: 2, 4: 2, 5: 4, 8: 1, 9: 2}
+_SIGNED_DATA_TYPES = (8, 9)
+# Key of the package in the custom options of the Edge TPU op.
+_KEY_EXECUTABLE = '4'
+
+
+class Table(object):
+  """Reads fields of a flatbuffers table."""
+
+  def __init__(self, buf, pos):
+    self.buf = buf
+    self.pos = pos
+    self.vtable = pos - struct.unpack_from('<i', buf, pos)[0]
+
+  def _field(self, vt):
+    if vt >= struct.unpack_from('<H', self.buf, self.vtable)[0]:
+      return 0
+    return struct.unpack_from('<H', self.buf, self.vtable + vt)[0]
+
+  def scalar(self, vt, fmt, default=0):
+    field = self._field(vt)
+    if not field:
+      return default
+    return struct.unpack_from('<' + fmt, self.buf, self.pos + field)[0]
+
+  def _indirect(self, vt):
+    field = self._field(vt)
+    if not field:
+      return None
+    pos = self.pos + field
+    return pos + struct.unpack_from('<I', self.buf, pos)[0]
+
+  def table(self, vt):
+    pos = self._indirect(vt)
+    return None if pos is None else Table(self.buf, pos)
+
+  def _vector(self, vt):
+    pos = self._indirect(vt)
+    if pos is None:
+      return pos, 0
+    return pos + 4, struct.unpack_from('<I', self.buf, pos)[0]
+
+  def bytes(self, vt):
+    pos, length = self._vector(vt)
+    return b'' if pos is None else self.buf[pos:pos + length]
+
+  def string(self, vt):
+    return self.bytes(vt).decode()
+
+  def ints(self, vt):
+    pos, length = self._vector(vt)
+    return [] if pos is None else list(
+        struct.unpack_from('<%di' % length, self.buf, pos))
+
+  def _offsets(self, vt):
+    pos, length = self._vector(vt)
+    for i in range(length):
+      item = pos + 4 * i
+      yield item + struct.unpack_from('<I', self.buf, item)[0]
+
+  def tables(self, vt):
+    return [Table(self.buf, pos) for pos in self._offsets(vt)]
+
+  def strings(self, vt):
+    return [
+        self.buf[pos + 4:pos + 4 + struct.unpack_from('<I', self.buf, pos)[0]]
+        for pos in self._offsets(vt)
+    ]
+
+
+def root(buf):
+  return Table(buf, struct.unpack_from('<I', buf, 0)[0])
+
+
+def flexbuffer_map_string(buf, wanted):
+  """Returns the string or blob stored under `wanted` in a flexbuffer map."""
+
+  def read(pos, width):
+    return int.from_bytes(buf[pos:pos + width], 'little')
+
+  root_width = buf[-1]
+  root_type = buf[-2]
+  root_pos = len(buf) - 2 - root_width
+  assert root_type >> 2 == 9, 'custom options are not a map'
+  width = 1 << (root_type & 3)
+  values = root_pos - read(root_pos, root_width)
+  count = read(values - width, width)
+  keys_pos = values - 3 * width
+  keys = keys_pos - read(keys_pos, width)
+  key_width = read(values - 2 * width, width)
+  for i in range(count):
+    key_pos = keys + i * key_width
+    key = key_pos - read(key_pos, key_width)
+    if buf[key:buf.index(b'\0', key)].decode() != wanted:
+      continue
+    packed_type = buf[values + count * width + i]
+    value = values + i * width
+    data = value - read(value, width)
+    data_width = 1 << (packed_type & 3)
+    return buf[data:data + read(data - data_width, data_width)]
+  raise KeyError(wanted)
+
+
+def inference_executable(model):
+  """Returns the inference executable of the model's Edge TPU op."""
+  tflite = root(model)
+  codes = tflite.tables(6)  # Model.operator_codes
+  for subgraph in tflite.tables(8):  # Model.subgraphs
+    for op in subgraph.tables(10):  # SubGraph.operators
+      code = codes[op.scalar(4, 'I')]  # Operator.opcode_index
+      if code.string(6) != 'edgetpu-custom-op':  # OperatorCode.custom_code
+        continue
+      # Operator.custom_options
+      package = flexbuffer_map_string(op.bytes(14), _KEY_EXECUTABLE)
+      # Package.serialized_multi_executable
+      multi = root(root(package).bytes(6))
+      for serialized in multi.strings(4):  # .serialized_executables
+        exe = root(serialized)
+        if exe.scalar(30, 'h') in (_EXECUTABLE_STAND_ALONE,
+                                   _EXECUTABLE_EXECUTION_ONLY):
+          return exe
+  raise ValueError('no Edge TPU inference executable')
+
+
+def header(tag, length):
+  return struct.pack('<IB3x', length, tag)
+
+
+def tiled_output(layer, tensor):
+  """Lays out `tensor`, in y, x, z order, as the device sends it."""
+  y_dim = layer.scalar(8, 'i')
+  x_dim = layer.scalar(10, 'i')
+  z_dim = layer.scalar(12, 'i')
+  data_type = layer.scalar(16, 'h')
+  executions = layer.scalar(22, 'i', 1)
+  size = _DATA_TYPE_SIZES[data_type]
+  padded = layer.scalar(6, 'I') * executions
+  out = bytearray(padded)
+  element = z_dim * size
+  if x_dim == 1 and y_dim == 1:
+    stride = element
+    if executions > 1:
+      stride += (padded - executions * element) // executions
+    places = [(e * stride, e * element) for e in range(executions)]
+  else:
+    layout = layer.table(20).table(4)  # OutputLayer.layout
+    y_tiles = layout.ints(4)
+    x_tiles = layout.ints(6)
+    tile_offsets = layout.ints(8)
+    x_offsets = layout.ints(10)
+    y_offsets = layout.ints(12)
+    row_sizes = layout.ints(14)
+    places = []
+    for y in range(y_dim):
+      for x in range(x_dim):
+        index = (tile_offsets[y_tiles[y] + x_tiles[x]] +
+                 y_offsets[y] * row_sizes[x] + x_offsets[x])
+        places.append((index * size, (y * x_dim + x) * element))
+  for src, dest in places:
+    out[src:src + element] = tensor[dest:dest + element]
+  if data_type in _SIGNED_DATA_TYPES:
+    # The device sends signed values offset by half their range.
+    for i in range(size - 1, len(out), size):
+      out[i] ^= 0x80
+  return bytes(out)
+
+
+def traces(model, inputs, expected):
+  exe = inference_executable(model)
+  bitstreams = exe.tables(14)  # Executable.instruction_bitstreams
+  parameters = exe.bytes(16)  # Executable.parameters
+  outputs = {layer.string(4): layer for layer in exe.tables(22)}
+  bulk_out = bytearray()
+  bulk_in = bytearray()
+  output_offset = 0
+  for hint in exe.table(18).tables(4):  # Executable.dma_hints.hints
+    kind = hint.scalar(4, 'B')
+    value = hint.table(6)
+    if kind == _HINT_INSTRUCTION:
+      bitstream = bitstreams[value.scalar(4, 'i')].bytes(4)
+      bulk_out += header(_TAG_INSTRUCTIONS, len(bitstream)) + bitstream
+    elif kind == _HINT_DMA_DESCRIPTOR:
+      meta = value.table(4)
+      offset = value.scalar(6, 'I')
+      size = value.scalar(8, 'I')
+      desc = meta.scalar(4, 'h')
+      if desc == _DESC_INPUT:
+        # Signed inputs would be masked as they are sent.
+        bulk_out += header(_TAG_INPUTS, size) + inputs[offset:offset + size]
+      elif desc == _DESC_PARAMETER:
+        bulk_out += header(_TAG_PARAMETERS, size) + parameters[offset:offset +
+                                                               size]
+      elif desc == _DESC_OUTPUT:
+        layer = outputs[meta.string(8)]
+        tensor_bytes = (layer.scalar(8, 'i') * layer.scalar(10, 'i') *
+                        layer.scalar(12, 'i') * layer.scalar(22, 'i', 1) *
+                        _DATA_TYPE_SIZES[layer.scalar(16, 'h')])
+        tiled = tiled_output(
+            layer, expected[output_offset:output_offset + tensor_bytes])
+        output_offset += tensor_bytes
+        bulk_in += tiled[:size]
+  return bytes(bulk_out), bytes(bulk_in)
+
+
+def main(argv):
+  if len(argv) != 5:
+    sys.exit(__doc__)
+  with open(argv[1], 'rb') as f:
+    model = f.read()
+  with open(argv[2], 'rb') as f:
+    inputs = f.read()
+  with open(argv[3], 'rb') as f:
+    expected = f.read()
+  bulk_out, bulk_in = traces(model, inputs, expected)
+  with open(argv[4] + '-bulk-out.bin', 'wb') as f:
+    f.write(bulk_out)
+  with open(argv[4] + '-bulk-in.bin', 'wb') as f:
+    f.write(bulk_in)
+
+
+if __name__ == '__main__':
+  main(sys.argv)
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tests/host/tpu/relayout_reference.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace coralmicro {
+namespace reference {
+namespace {
+int TensorDataTypeSize(platforms::darwinn::DataType data_type) {
+  switch (data_type) {
+    case platforms::darwinn::DataType_FIXED_POINT8:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT8:
+      return 1;
+    case platforms::darwinn::DataType_FIXED_POINT16:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT16:
+      return 2;
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT32:
+      return 4;
+    case platforms::darwinn::DataType_BFLOAT:
+      return 2;
+    case platforms::darwinn::DataType_HALF:
+      return 2;
+    case platforms::darwinn::DataType_SINGLE:
+      return 4;
+    default:
+      printf("Invalid DataType passed to TensorDataTypeSize().");
+      return 0;
+  }
+}
+
+bool SignedDataType(platforms::darwinn::DataType type) {
+  switch (type) {
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT8:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT16:
+      return true;
+
+    case platforms::darwinn::DataType_FIXED_POINT8:
+    case platforms::darwinn::DataType_FIXED_POINT16:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT32:
+    case platforms::darwinn::DataType_BFLOAT:
+    case platforms::darwinn::DataType_HALF:
+    case platforms::darwinn::DataType_SINGLE:
+      return false;
+  }
+
+  return false;
+}
+
+struct YBufferIndex {
+  // Holds the linearized tile ID for a given y value.
+  int y_linearized_tile_id;
+  // Holds local offset within a data chunk returned by a given tile.
+  int local_y_coordinate;
+};
+
+// Used in GetBufferIndex(int y, int x, int z)
+YBufferIndex GetYBufferIndex(const platforms::darwinn::Layer* layer, int y) {
+  const auto& layout = layer->any_layer_as_OutputLayer()->layout();
+  YBufferIndex output;
+  output.y_linearized_tile_id =
+      layout->y_coordinate_to_linear_tile_id_map()->Get(y);
+  output.local_y_coordinate = layout->y_coordinate_to_local_y_offset()->Get(y);
+  return output;
+}
+
+int GetBufferIndex(const platforms::darwinn::Layer* layer,
+                   const YBufferIndex& y_buffer_index, int x, int z) {
+  const auto& layout = layer->any_layer_as_OutputLayer()->layout();
+  const int linear_tile_id =
+      y_buffer_index.y_linearized_tile_id +
+      layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+  const int global_tile_byte_offset =
+      layout->linearized_tile_byte_offset()->Get(linear_tile_id);
+
+  const int local_x_byte_offset =
+      layout->x_coordinate_to_local_byte_offset()->Get(x);
+  const int local_y_byte_offset =
+      y_buffer_index.local_y_coordinate *
+      layout->x_coordinate_to_local_y_row_size()->Get(x);
+
+  return global_tile_byte_offset + local_y_byte_offset + local_x_byte_offset +
+         z;
+}
+
+void TransformSignedDataType(uint8_t* buffer, int data_type_size, int x_dim,
+                             int y_dim, int z_dim) {
+  int buffer_index = 0;
+
+  for (int y = 0; y < y_dim; ++y) {
+    for (int x = 0; x < x_dim; ++x) {
+      for (int z = 0; z < z_dim; ++z) {
+        // XORing with 128 on the last byte of each entry will flip the
+        // MSB of each entry. Please note that bytes are stored little
+        // endian.
+        int msb_index = buffer_index + data_type_size - 1;
+        buffer[msb_index] = buffer[msb_index] ^ 128;
+        buffer_index += data_type_size;
+      }
+    }
+  }
+}
+}  // namespace
+
+int GetBufferIndex(const platforms::darwinn::Layer* layer, int y, int x,
+                   int z) {
+  return GetBufferIndex(layer, GetYBufferIndex(layer, y), x, z);
+}
+
+void Relayout(const platforms::darwinn::Layer* layer, const uint8_t* src,
+              uint8_t* dest) {
+  uint8_t* const tensor = dest;
+  const int x_dim = layer->x_dim();
+  const int y_dim = layer->y_dim();
+  const int z_dim = layer->z_dim();
+  const int executions = layer->execution_count_per_inference();
+  const auto data_type_size = TensorDataTypeSize(layer->data_type());
+  const int z_bytes = z_dim * data_type_size;
+
+  if (y_dim == 1 && x_dim == 1) {
+    // One dimensional output (only z-dimension).
+    if (src != dest) {
+      const int padded_size_bytes = layer->size_bytes() * executions;
+      const int actual_size_bytes =
+          x_dim * y_dim * z_dim * data_type_size * executions;
+      if (executions == 1 || padded_size_bytes == actual_size_bytes) {
+        memcpy(dest, src, z_bytes * executions);
+      } else {
+        // Remove padding values at the end of each execution.
+        const int padded_size_per_execution =
+            (padded_size_bytes - actual_size_bytes) / executions;
+        for (int i = 0; i < executions; ++i) {
+          memcpy(dest, src, z_bytes);
+          dest += z_bytes;
+          src += z_bytes + padded_size_per_execution;
+        }
+      }
+    }
+  } else {
+    int z_bytes_padded;
+    if (x_dim > 1) {
+      // If x-dim is > 1, padded-z-size can be deduced by looking at
+      // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
+      z_bytes_padded =
+          GetBufferIndex(layer, 0, 1, 0) - GetBufferIndex(layer, 0, 0, 0);
+    } else {
+      // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
+      // padded-z-size can be deduced by looking at difference between
+      // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
+      z_bytes_padded =
+          GetBufferIndex(layer, 1, 0, 0) - GetBufferIndex(layer, 0, 0, 0);
+    }
+    z_bytes_padded *= data_type_size;
+
+    const auto* layout = layer->any_layer_as_OutputLayer()->layout();
+    std::vector<int> active_tile_x_sizes(x_dim);
+    int last_x = 0;
+    size_t active_tile_x_count = 0;
+
+    int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+
+    for (int x = 1; x < x_dim; ++x) {
+      int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+      if (cur_x_tile != last_x_tile) {
+        active_tile_x_sizes[active_tile_x_count] = x - last_x;
+        active_tile_x_count++;
+        last_x_tile = cur_x_tile;
+        last_x = x;
+      }
+    }
+    active_tile_x_sizes[active_tile_x_count] = x_dim - last_x;
+    active_tile_x_count++;
+
+#define RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(num_z_bytes, num_z_bytes_padded) \
+  do {                                                                        \
+    for (int y = 0; y < y_dim; ++y) {                                         \
+      const auto y_buffer_index = GetYBufferIndex(layer, y);                  \
+      int tile_starting_x = 0;                                                \
+      for (size_t x_tile = 0; x_tile < active_tile_x_count; ++x_tile) {       \
+        const unsigned char* source =                                         \
+            src + GetBufferIndex(layer, y_buffer_index, tile_starting_x, 0) * \
+                      data_type_size;                                         \
+        const int tile_x_size = active_tile_x_sizes[x_tile];                  \
+        for (int local_offset_x = 0; local_offset_x < tile_x_size;            \
+             ++local_offset_x) {                                              \
+          if ((num_z_bytes) == 1) {                                           \
+            *dest = *source;                                                  \
+          } else if ((num_z_bytes) == 3) {                                    \
+            *(dest + 0) = *(source + 0);                                      \
+            *(dest + 1) = *(source + 1);                                      \
+            *(dest + 2) = *(source + 2);                                      \
+          } else {                                                            \
+            memcpy(dest, source, (num_z_bytes));                              \
+          }                                                                   \
+          dest += (num_z_bytes);                                              \
+          source += (num_z_bytes_padded);                                     \
+        }                                                                     \
+        tile_starting_x += tile_x_size;                                       \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
+
+    if (z_bytes == 1) {
+      // Specialization for z_bytes = 1 (grayscale image).
+      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(1, 4);
+    } else if (z_bytes == 3) {
+      // Specialization for z_bytes = 3 (RGB image).
+      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(3, 4);
+    } else {
+      // Default.
+      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(z_bytes, z_bytes_padded);
+    }
+
+#undef RELAYOUT_WITH_Z_BYTES_SPECIALIZATION
+  }
+
+  if (SignedDataType(layer->data_type())) {
+    TransformSignedDataType(tensor, data_type_size, x_dim, y_dim, z_dim);
+  }
+}
+
+}  // namespace reference
+}  // namespace coralmicro
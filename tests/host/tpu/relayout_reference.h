@@ -0,0 +1,44 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TESTS_HOST_TPU_RELAYOUT_REFERENCE_H_
+#define TESTS_HOST_TPU_RELAYOUT_REFERENCE_H_
+
+#include <cstdint>
+
+#include "libs/tpu/executable_generated.h"
+
+namespace coralmicro {
+namespace reference {
+
+// Lays the whole output activations of `layer` at `src` out into `dest`, and
+// converts its signed values, the way `OutputLayer::Relayout()` and
+// `OutputLayer::TransformSignedDataType()` did before the relayout plans of
+// `OutputLayer::RelayoutChunk()`. The code is that of
+// libs/tpu/edgetpu_executable.cc at the time, made into functions of the
+// layer.
+void Relayout(const platforms::darwinn::Layer* layer, const uint8_t* src,
+              uint8_t* dest);
+
+// Index of element (`y`, `x`, `z`) of `layer`'s tensor in its output
+// activations, in elements of its data type, as `OutputLayer` computed it.
+int GetBufferIndex(const platforms::darwinn::Layer* layer, int y, int x,
+                   int z);
+
+}  // namespace reference
+}  // namespace coralmicro
+
+#endif  // TESTS_HOST_TPU_RELAYOUT_REFERENCE_H_